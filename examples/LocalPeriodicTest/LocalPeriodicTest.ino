@@ -0,0 +1,168 @@
+#include <AUnitVerbose.h>
+#include <Arduino.h>
+#include <FakeProtoDispatch.h>
+#include <LocalPeriodic.h>
+#include <MeshSimulator.h>
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <vector>
+
+using namespace aunit;
+
+// Runs everything on virtual time.
+MeshSimulator sim;
+
+using eth_addr = FakeProtoDispatch::eth_addr;
+
+// When each node started transmitting a frame, in local millis.
+static std::vector<uint32_t> g_sendTimes;
+
+struct PeriodicNode {
+  PeriodicNode(uint64_t id, const MeshSyncTime* time, uint32_t intervalMs, uint16_t numSlots)
+      : addr(id), dispatch(addr), everyMs(intervalMs) {
+    if (numSlots) {
+      periodic.slotted(numSlots, addr.addr);
+    }
+    periodic.setFillForTransmitHook([this](uint32_t* val) {
+      *val = sendOffsets.size();
+      sendOffsets.push_back(sim.now() % everyMs);
+      g_sendTimes.push_back(sim.now());
+      return true;
+    });
+    periodic.setReceivedHook([this](const ProtoDispatchPktHdr*, const uint32_t&) { ++received; });
+    periodic.begin(time, intervalMs);
+    dispatch.addProtocol(1, &periodic);
+    dispatch.begin();
+  }
+
+  eth_addr addr;
+  FakeProtoDispatch dispatch;
+  LocalPeriodicStruct<uint32_t> periodic;
+  // Time within the interval of each broadcast.
+  std::vector<uint32_t> sendOffsets;
+  size_t received = 0;
+  uint32_t everyMs;
+};
+
+struct SlotResult {
+  // Fraction of frames that didn't start in the same millisecond as another.
+  double deliveryRatio;
+  // Largest difference between when a node broadcast in two different intervals.
+  uint32_t maxJitterMs;
+  uint32_t conflicts;
+  uint32_t missed;
+};
+
+// Runs numNodes nodes in range of each other broadcasting every
+// second in 1 ms steps, all sharing one clock.  Frames sent in the
+// same millisecond are counted as collisions.
+SlotResult runPeriodic(size_t numNodes, uint16_t numSlots) {
+  static constexpr uint32_t k_every_ms = 1000;
+  MeshSyncTime time;
+  std::vector<std::unique_ptr<PeriodicNode>> nodes;
+  for (size_t i = 0; i != numNodes; ++i) {
+    uint64_t id = (uint64_t(random(1L << 24)) << 24) | random(1L << 24);
+    nodes.emplace_back(new PeriodicNode(id, &time, k_every_ms, numSlots));
+  }
+  auto run = [&](size_t numIntervals) {
+    for (size_t i = 0; i != numIntervals * k_every_ms; ++i) {
+      for (const auto& node : nodes) {
+        node->periodic.run();
+        node->dispatch.transmitAndReceive();
+      }
+      sim.advance(1);
+    }
+  };
+
+  // Give slot conflicts time to sort themselves out.
+  run(10);
+  g_sendTimes.clear();
+  for (const auto& node : nodes) {
+    node->sendOffsets.clear();
+  }
+  run(20);
+
+  SlotResult result;
+  std::map<uint32_t, size_t> framesAt;
+  for (uint32_t t : g_sendTimes) {
+    ++framesAt[t];
+  }
+  size_t clear = 0;
+  for (uint32_t t : g_sendTimes) {
+    if (framesAt[t] == 1) {
+      ++clear;
+    }
+  }
+  result.deliveryRatio = g_sendTimes.empty() ? 0 : double(clear) / g_sendTimes.size();
+  result.maxJitterMs = 0;
+  result.conflicts = 0;
+  result.missed = 0;
+  for (const auto& node : nodes) {
+    if (!node->sendOffsets.empty()) {
+      auto range = std::minmax_element(node->sendOffsets.begin(), node->sendOffsets.end());
+      result.maxJitterMs = std::max(result.maxJitterMs, *range.second - *range.first);
+    }
+    result.conflicts += node->periodic.slotConflicts();
+    result.missed += node->periodic.slotsMissed();
+  }
+  printf("%lu nodes %s: %lu frames, %.1f%% without collisions, broadcast times vary by up to "
+         "%u ms, %u slot conflicts, %u slots missed\n",
+         numNodes, numSlots ? "in slots" : "at random times", g_sendTimes.size(),
+         result.deliveryRatio * 100, result.maxJitterMs, result.conflicts, result.missed);
+  return result;
+}
+
+test(slottedBroadcasts) {
+  SlotResult random = runPeriodic(60, 0);
+  SlotResult slotted = runPeriodic(60, 64);
+  assertLess(random.deliveryRatio, 1.0);
+  assertEqual(slotted.deliveryRatio, 1.0);
+  // Each node stays within its 9 ms slot.
+  assertLess(slotted.maxJitterMs, 9U);
+  assertMore(random.maxJitterMs, 100U);
+  assertEqual(slotted.missed, 0U);
+}
+
+test(slotConflicts) {
+  // Addresses that only differ above the low bits all hash to the same slot.
+  static constexpr size_t k_nodes = 8;
+  MeshSyncTime time;
+  std::vector<std::unique_ptr<PeriodicNode>> nodes;
+  for (size_t i = 0; i != k_nodes; ++i) {
+    nodes.emplace_back(new PeriodicNode(i * k_nodes + 1, &time, 1000, k_nodes));
+  }
+  for (size_t i = 0; i != 10 * 1000; ++i) {
+    for (const auto& node : nodes) {
+      node->periodic.run();
+      node->dispatch.transmitAndReceive();
+    }
+    sim.advance(1);
+  }
+
+  uint32_t conflicts = 0;
+  std::vector<bool> used(k_nodes);
+  for (const auto& node : nodes) {
+    conflicts += node->periodic.slotConflicts();
+    assertFalse(used[node->periodic.slot()]);
+    used[node->periodic.slot()] = true;
+  }
+  assertMoreOrEqual(conflicts, uint32_t(k_nodes - 1));
+  // The lowest address always keeps its slot.
+  assertEqual(nodes[0]->periodic.slotConflicts(), 0U);
+}
+
+void setup() {
+  TestRunner::setTimeout(300);
+#if !defined(EPOXY_DUINO)
+  delay(1000);  // wait to prevent garbage on SERIAL_PORT_MONITOR
+#endif
+  SERIAL_PORT_MONITOR.begin(115200);
+  while (!SERIAL_PORT_MONITOR)
+    ;  // needed for Leonardo/Micro
+}
+
+void loop() { TestRunner::run(); }
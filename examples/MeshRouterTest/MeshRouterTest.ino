@@ -0,0 +1,318 @@
+#include <AUnitVerbose.h>
+#include <Arduino.h>
+#include <FakeProtoDispatch.h>
+#include <MeshRouter.h>
+#include <MeshSimulator.h>
+
+#include <stdio.h>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+using namespace aunit;
+
+// Runs everything on virtual time.
+MeshSimulator sim;
+
+using eth_addr = FakeProtoDispatch::eth_addr;
+
+// A routed protocol that sends queued messages and remembers what it receives.
+class MessageTarget : public ProtoDispatchTarget {
+ public:
+  struct Message {
+    eth_addr addr;
+    String data;
+  };
+  std::deque<Message> toSend;
+  std::vector<Message> received;
+  // Destinations of messages that couldn't be sent.
+  std::vector<eth_addr> unreachable;
+
+  void send(const eth_addr& dst, const String& data) { toSend.push_back({dst, data}); }
+
+  void onPacketReceived(const ProtoDispatchPktHdr* hdr, const uint8_t* pkt, size_t len) override {
+    Message msg;
+    memcpy(msg.addr.addr, hdr->src, ETH_ADDR_LEN);
+    for (size_t i = 0; i != len; ++i) {
+      msg.data.concat(char(pkt[i]));
+    }
+    received.push_back(msg);
+  }
+
+  int sendIfNeeded(uint8_t* dst, uint8_t* pkt, size_t maxlen) override {
+    if (toSend.empty()) {
+      return -1;
+    }
+    const Message& msg = toSend.front();
+    assert(msg.data.length() <= maxlen);
+    memcpy(dst, msg.addr.addr, ETH_ADDR_LEN);
+    memcpy(pkt, msg.data.begin(), msg.data.length());
+    int len = msg.data.length();
+    toSend.pop_front();
+    return len;
+  }
+
+  void onSendStatus(const uint8_t* ethaddr, bool success) override {
+    if (!success) {
+      eth_addr addr;
+      memcpy(addr.addr, ethaddr, ETH_ADDR_LEN);
+      unreachable.push_back(addr);
+    }
+  }
+};
+
+// A simulated node: a dispatcher, a router, and a routed protocol.
+struct Node {
+  explicit Node(uint64_t id) : addr(id), dispatch(addr), router(addr.addr) {
+    router.beaconMs(1000);
+    router.addProtocol(1, &target);
+    dispatch.addProtocol(1, &router);
+    dispatch.begin();
+  }
+
+  eth_addr addr;
+  FakeProtoDispatch dispatch;
+  MeshRouter router;
+  MessageTarget target;
+};
+
+using Network = std::vector<std::unique_ptr<Node>>;
+
+Network makeNodes(size_t numNodes) {
+  Network net;
+  for (size_t i = 0; i != numNodes; ++i) {
+    net.emplace_back(new Node(i + 1));
+  }
+  return net;
+}
+
+// Nodes in a line, each only in range of the ones next to it.
+Network makeLine(size_t numNodes) {
+  Network net = makeNodes(numNodes);
+  for (size_t i = 0; i + 1 < numNodes; ++i) {
+    net[i]->dispatch.connect(&net[i + 1]->dispatch);
+  }
+  return net;
+}
+
+// Nodes in a grid, each in range of the ones above, below, left, and right of it.
+Network makeGrid(size_t width, size_t height) {
+  Network net = makeNodes(width * height);
+  for (size_t y = 0; y != height; ++y) {
+    for (size_t x = 0; x != width; ++x) {
+      Node* node = net[y * width + x].get();
+      if (x + 1 < width) {
+        node->dispatch.connect(&net[y * width + x + 1]->dispatch);
+      }
+      if (y + 1 < height) {
+        node->dispatch.connect(&net[(y + 1) * width + x]->dispatch);
+      }
+    }
+  }
+  return net;
+}
+
+void runSome(size_t numReps, const Network& net) {
+  for (size_t i = 0; i != numReps; ++i) {
+    for (const auto& node : net) {
+      node->dispatch.transmitAndReceive();
+    }
+    sim.advance(100);
+  }
+}
+
+// Runs until done() returns true, or until maxReps is reached.  Returns the number of repetitions run.
+size_t runUntil(size_t maxReps, const Network& net, const std::function<bool()>& done) {
+  for (size_t i = 0; i != maxReps; ++i) {
+    if (done()) {
+      return i;
+    }
+    runSome(1, net);
+  }
+  return maxReps;
+}
+
+bool converged(const Network& net) {
+  for (const auto& node : net) {
+    if (node->router.numRoutes() != net.size() - 1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+test(routeLine) {
+  Network net = makeLine(5);
+  assertLess(runUntil(100, net, [&]() { return converged(net); }), 100UL);
+
+  const MeshRouter::Route* route = net[0]->router.route(net[4]->addr.addr);
+  assertTrue(route != nullptr);
+  assertEqual(route->cost, 4);
+  assertTrue(memcmp(route->nextHop, net[1]->addr.addr, 6) == 0);
+
+  net[0]->target.send(net[4]->addr, "Hello from the other end");
+  assertLess(runUntil(50, net, [&]() { return !net[4]->target.received.empty(); }), 50UL);
+  assertEqual(net[4]->target.received.size(), 1UL);
+  assertTrue(net[4]->target.received[0].addr == net[0]->addr);
+  assertEqual(net[4]->target.received[0].data, "Hello from the other end");
+
+  // Nodes in the middle forward it without seeing it themselves.
+  for (size_t i = 1; i != 4; ++i) {
+    assertEqual(net[i]->target.received.size(), 0UL);
+    assertEqual(net[i]->router.stats().forwarded, 1U);
+  }
+
+  // And back again.
+  net[4]->target.send(net[0]->addr, "Reply");
+  assertLess(runUntil(50, net, [&]() { return !net[0]->target.received.empty(); }), 50UL);
+  assertEqual(net[0]->target.received[0].data, "Reply");
+}
+
+test(routeBroadcast) {
+  Network net = makeLine(3);
+  assertLess(runUntil(100, net, [&]() { return converged(net); }), 100UL);
+
+  // Broadcasts only reach neighbors.
+  net[0]->target.send(eth_addr(0xffffffffffffULL), "Hi neighbors");
+  runSome(20, net);
+  assertEqual(net[1]->target.received.size(), 1UL);
+  assertTrue(net[1]->target.received[0].addr == net[0]->addr);
+  assertEqual(net[2]->target.received.size(), 0UL);
+}
+
+test(routeNoRoute) {
+  Network net = makeLine(2);
+  assertLess(runUntil(100, net, [&]() { return converged(net); }), 100UL);
+
+  net[0]->target.send(eth_addr(999), "Anybody there?");
+  runSome(5, net);
+  assertEqual(net[0]->target.unreachable.size(), 1UL);
+  assertTrue(net[0]->target.unreachable[0] == eth_addr(999));
+  assertEqual(net[0]->router.stats().noRoute, 1U);
+  assertEqual(net[1]->target.received.size(), 0UL);
+}
+
+test(routeAroundFailure) {
+  // Two paths from node 1 to node 4: through node 2 or node 3.
+  Network net = makeNodes(4);
+  net[0]->dispatch.connect(&net[1]->dispatch);
+  net[0]->dispatch.connect(&net[2]->dispatch);
+  net[1]->dispatch.connect(&net[3]->dispatch);
+  net[2]->dispatch.connect(&net[3]->dispatch);
+  assertLess(runUntil(100, net, [&]() { return converged(net); }), 100UL);
+
+  const MeshRouter::Route* route = net[0]->router.route(net[3]->addr.addr);
+  assertEqual(route->cost, 2);
+  Node* used = memcmp(route->nextHop, net[1]->addr.addr, 6) == 0 ? net[1].get() : net[2].get();
+  Node* other = used == net[1].get() ? net[2].get() : net[1].get();
+
+  // Take the node we were using out of range of everyone.
+  for (const auto& node : net) {
+    if (node.get() != used) {
+      used->dispatch.disconnect(&node->dispatch);
+    }
+  }
+  // Keep sending until something gets through; the failed sends tell
+  // the router the link is gone.
+  size_t sent = 0;
+  size_t rounds = runUntil(200, net, [&]() {
+    if (!net[3]->target.received.empty()) {
+      return true;
+    }
+    net[0]->target.send(net[3]->addr, "Message " + String(sent++));
+    return false;
+  });
+  printf("Rerouted after %lu rounds and %lu messages\n", rounds, sent);
+  assertLess(rounds, 20UL);
+  route = net[0]->router.route(net[3]->addr.addr);
+  assertTrue(memcmp(route->nextHop, other->addr.addr, 6) == 0);
+}
+
+test(routeRssiCost) {
+  // Node 1 can hear node 3 directly, but only barely.
+  Network net = makeNodes(3);
+  net[0]->dispatch.connect(&net[1]->dispatch, -60);
+  net[1]->dispatch.connect(&net[2]->dispatch, -60);
+  net[0]->dispatch.connect(&net[2]->dispatch, -90);
+  assertLess(runUntil(100, net, [&]() { return converged(net); }), 100UL);
+  runSome(50, net);
+
+  const MeshRouter::Route* route = net[0]->router.route(net[2]->addr.addr);
+  assertEqual(route->cost, 2);
+  assertTrue(memcmp(route->nextHop, net[1]->addr.addr, 6) == 0);
+}
+
+struct BenchmarkResult {
+  size_t convergeRounds;
+  size_t delivered;
+  // Total rounds between sending each message and its arrival.
+  size_t totalLatency;
+  uint8_t cost;
+};
+
+static constexpr size_t k_benchmark_messages = 20;
+
+// Measures how long routes take to form in the given network, then
+// sends messages from the first node to the last one at a time.
+BenchmarkResult routeBenchmark(const char* name, const Network& net) {
+  BenchmarkResult result;
+  result.convergeRounds = runUntil(300, net, [&]() { return converged(net); });
+
+  result.totalLatency = 0;
+  size_t framesBefore = 0;
+  for (const auto& node : net) {
+    framesBefore += node->dispatch.framesSent();
+  }
+  MessageTarget& dst = net.back()->target;
+  for (size_t i = 0; i != k_benchmark_messages; ++i) {
+    net.front()->target.send(net.back()->addr, "Message " + String(i));
+    result.totalLatency += runUntil(50, net, [&]() { return dst.received.size() > i; });
+  }
+  size_t frames = 0;
+  size_t beacons = 0;
+  for (const auto& node : net) {
+    frames += node->dispatch.framesSent();
+    beacons += node->router.stats().beaconsSent;
+  }
+  frames -= framesBefore;
+  result.delivered = dst.received.size();
+  const MeshRouter::Route* route = net.front()->router.route(net.back()->addr.addr);
+  result.cost = route ? route->cost : MeshRouter::INFINITE_COST;
+  printf("%s of %lu nodes converged in %lu rounds; %lu messages over %d hops took %.1f rounds "
+         "each, with %lu frames sent meanwhile and %lu beacons since startup\n",
+         name, net.size(), result.convergeRounds, result.delivered, result.cost,
+         double(result.totalLatency) / k_benchmark_messages, frames, beacons);
+  return result;
+}
+
+test(routeLineBenchmark) {
+  Network net = makeLine(8);
+  BenchmarkResult result = routeBenchmark("Line", net);
+  assertLess(result.convergeRounds, 300UL);
+  assertEqual(result.delivered, k_benchmark_messages);
+  assertEqual(result.cost, 7);
+  // A message can be forwarded at most once per round per hop.
+  assertLessOrEqual(result.totalLatency, k_benchmark_messages * (result.cost + 1));
+}
+
+test(routeGridBenchmark) {
+  Network net = makeGrid(4, 4);
+  BenchmarkResult result = routeBenchmark("Grid", net);
+  assertLess(result.convergeRounds, 300UL);
+  assertEqual(result.delivered, k_benchmark_messages);
+  assertEqual(result.cost, 6);
+  assertLessOrEqual(result.totalLatency, k_benchmark_messages * (result.cost + 1));
+}
+
+void setup() {
+  TestRunner::setTimeout(300);
+#if !defined(EPOXY_DUINO)
+  delay(1000);  // wait to prevent garbage on SERIAL_PORT_MONITOR
+#endif
+  SERIAL_PORT_MONITOR.begin(115200);
+  while (!SERIAL_PORT_MONITOR)
+    ;  // needed for Leonardo/Micro
+}
+
+void loop() { TestRunner::run(); }
@@ -0,0 +1,270 @@
+#include <AUnitVerbose.h>
+#include <Arduino.h>
+#include <FakeProtoDispatch.h>
+#include <MeshSimulator.h>
+#include <MeshSyncTime.h>
+
+#include <stdio.h>
+#include <time.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace aunit;
+
+using eth_addr = FakeProtoDispatch::eth_addr;
+
+test(eventOrder) {
+  MeshSimulator sim;
+  assertEqual(sim.now(), 1U);
+  std::string order;
+  sim.schedule(30, [&]() { order += "a"; });
+  sim.schedule(10, [&]() { order += "b"; });
+  sim.schedule(10, [&]() {
+    order += "c";
+    // Runs later in the same advance().
+    sim.schedule(5, [&]() {
+      order += "d";
+      assertEqual(sim.now(), 16U);
+    });
+  });
+  sim.advance(20);
+  assertEqual(order, std::string("bcd"));
+  assertEqual(sim.now(), 21U);
+  assertEqual(MeshClock::millis(), 21U);
+  sim.advance(10);
+  assertEqual(order, std::string("bcda"));
+  assertEqual(sim.eventsRun(), uint64_t(4));
+
+  // Checked every 100 ms.
+  uint32_t took = sim.runUntil(1000, [&]() { return sim.now() >= 250; });
+  assertEqual(took, 300U);
+  took = sim.runUntil(1000, []() { return false; });
+  assertEqual(took, 1000U);
+}
+
+// Broadcasts one packet and remembers what it hears.
+class Beeper : public ProtoDispatchTarget {
+ public:
+  void onPacketReceived(const ProtoDispatchPktHdr* hdr, const uint8_t* pkt, size_t len) override {
+    ++heard;
+    lastRssi = hdr->rssi;
+  }
+  int sendIfNeeded(uint8_t* dst, uint8_t* pkt, size_t maxlen) override {
+    if (sent) {
+      return -1;
+    }
+    sent = true;
+    memset(dst, 0xff, ETH_ADDR_LEN);
+    pkt[0] = 1;
+    return 1;
+  }
+
+  bool sent = false;
+  size_t heard = 0;
+  int8_t lastRssi = 0;
+};
+
+test(rangeTopology) {
+  MeshSimulator sim;
+  static constexpr size_t k_nodes = 3;
+  std::vector<std::unique_ptr<FakeProtoDispatch>> ds;
+  Beeper beepers[k_nodes];
+  for (size_t i = 0; i != k_nodes; ++i) {
+    ds.emplace_back(new FakeProtoDispatch(eth_addr(i + 1)));
+    ds.back()->addProtocol(1, &beepers[i]);
+    ds.back()->begin();
+    sim.addNode(ds.back().get());
+    sim.place(ds.back().get(), i * 40, 0);
+  }
+  sim.connectInRange(50);
+  sim.advance(1000);
+
+  // The ends are 80 m apart, so they only hear the middle node.
+  assertEqual(beepers[0].heard, size_t(1));
+  assertEqual(beepers[1].heard, size_t(2));
+  assertEqual(beepers[2].heard, size_t(1));
+  assertEqual(beepers[0].lastRssi, MeshSimulator::rssiAtDistance(40));
+  assertLess(MeshSimulator::rssiAtDistance(40), MeshSimulator::rssiAtDistance(10));
+
+  for (const auto& d : ds) {
+    sim.removeNode(d.get());
+  }
+}
+
+// Broadcasts a full-size packet every time it's asked.
+class Flooder : public ProtoDispatchTarget {
+ public:
+  void onPacketReceived(const ProtoDispatchPktHdr* hdr, const uint8_t* pkt, size_t len) override {
+    ++received;
+  }
+  int sendIfNeeded(uint8_t* dst, uint8_t* pkt, size_t maxlen) override {
+    memset(dst, 0xff, ETH_ADDR_LEN);
+    memset(pkt, 0x5a, maxlen);
+    return maxlen;
+  }
+
+  size_t received = 0;
+};
+
+// Measures how many packets per second FakeProtoDispatch can deliver
+// on a grid where each node has about 8 neighbors.
+test(deliveryThroughput) {
+  static constexpr size_t k_width = 20;
+  static constexpr size_t k_nodes = k_width * k_width;
+  static constexpr size_t k_rounds = 1000;
+  MeshSimulator sim;
+  std::vector<std::unique_ptr<FakeProtoDispatch>> ds;
+  std::vector<std::unique_ptr<Flooder>> flooders;
+  for (size_t i = 0; i != k_nodes; ++i) {
+    ds.emplace_back(new FakeProtoDispatch(eth_addr(i + 1)));
+    flooders.emplace_back(new Flooder);
+    ds.back()->addProtocol(1, flooders.back().get());
+    ds.back()->begin();
+    sim.addNode(ds.back().get());
+    sim.place(ds.back().get(), (i % k_width) * 10, (i / k_width) * 10);
+  }
+  sim.connectInRange(15);
+
+  clock_t cpuStart = clock();
+  for (size_t round = 0; round != k_rounds; ++round) {
+    for (const auto& d : ds) {
+      d->transmitAndReceive();
+    }
+  }
+  double cpuSecs = double(clock() - cpuStart) / CLOCKS_PER_SEC;
+  size_t received = 0;
+  for (const auto& f : flooders) {
+    received += f->received;
+  }
+  printf("%lu nodes delivered %lu packets in %.2f CPU s, %.0f packets/s\n", k_nodes, received,
+         cpuSecs, received / std::max(cpuSecs, 1e-6));
+  // Interior nodes have 8 neighbors, edges 5 and corners 3.  Packets
+  // from earlier nodes are received during the same round.
+  size_t perRound = (k_width - 2) * (k_width - 2) * 8 + 4 * (k_width - 2) * 5 + 4 * 3;
+  assertMoreOrEqual(received, (k_rounds - 1) * perRound);
+  assertLessOrEqual(received, k_rounds * perRound);
+
+  for (const auto& d : ds) {
+    sim.removeNode(d.get());
+  }
+}
+
+// A node in a simulated network whose synced clock starts out
+// unrelated to everyone else's.
+struct SimTimeNode {
+  SimTimeNode(MeshSimulator* sim, uint64_t id) : addr(id), dispatch(addr) {
+    time.electRoot(addr.addr);
+    time.applySync(sim->random(0, 1000000000));
+    dispatch.addProtocol(1, &time);
+    dispatch.begin();
+    sim->addNode(&dispatch);
+  }
+
+  eth_addr addr;
+  FakeProtoDispatch dispatch;
+  MeshSyncTime time;
+};
+
+using SimTimeNetwork = std::vector<std::unique_ptr<SimTimeNode>>;
+
+// Places numNodes nodes with random addresses on a grid with 10 m
+// between neighbors, moved up to 2 m in each direction, and links
+// nodes up to 15 m apart.
+void addGrid(MeshSimulator* sim, SimTimeNetwork* net, size_t numNodes, size_t width) {
+  for (size_t i = 0; i != numNodes; ++i) {
+    uint64_t id = (uint64_t(sim->random(1, 1L << 24)) << 24) | sim->random(0, 1L << 24);
+    net->emplace_back(new SimTimeNode(sim, id));
+    sim->place(&net->back()->dispatch, (i % width) * 10 + sim->random(-200, 200) / 100.,
+               (i / width) * 10 + sim->random(-200, 200) / 100.);
+  }
+  sim->connectInRange(15);
+}
+
+void removeAll(MeshSimulator* sim, const SimTimeNetwork& net) {
+  for (const auto& node : net) {
+    sim->removeNode(&node->dispatch);
+  }
+}
+
+// Whether every node follows the same root and has a synced clock
+// within maxErrorMs of every other's.
+bool converged(const MeshSimulator& sim, const SimTimeNetwork& net, uint32_t maxErrorMs) {
+  const uint8_t* root = net.front()->time.root();
+  uint32_t ref = net.front()->time.localToSynced(sim.now());
+  int32_t lo = 0, hi = 0;
+  for (const auto& node : net) {
+    if (memcmp(node->time.root(), root, ProtoDispatchTarget::ETH_ADDR_LEN) != 0) {
+      return false;
+    }
+    int32_t diff = node->time.localToSynced(sim.now()) - ref;
+    lo = std::min(lo, diff);
+    hi = std::max(hi, diff);
+  }
+  return uint32_t(hi - lo) <= maxErrorMs;
+}
+
+// Runs a small network for a minute, and returns every node's synced
+// clock and frame count.
+std::vector<uint32_t> runSmallNetwork(uint64_t seed) {
+  MeshSimulator sim(seed);
+  SimTimeNetwork net;
+  addGrid(&sim, &net, 20, 5);
+  sim.advance(60 * 1000);
+  std::vector<uint32_t> result;
+  for (const auto& node : net) {
+    result.push_back(node->time.localToSynced(sim.now()));
+    result.push_back(node->dispatch.framesSent());
+  }
+  removeAll(&sim, net);
+  return result;
+}
+
+test(deterministic) {
+  std::vector<uint32_t> first = runSmallNetwork(1);
+  std::vector<uint32_t> again = runSmallNetwork(1);
+  std::vector<uint32_t> other = runSmallNetwork(2);
+  assertTrue(first == again);
+  assertFalse(first == other);
+}
+
+// Starts 1000 nodes at once and times how long they take to agree on
+// a root and a synced clock, in virtual and CPU time.
+test(thousandNodeConvergence) {
+  static constexpr size_t k_nodes = 1000;
+  static constexpr uint32_t k_max_ms = 30 * 60 * 1000;
+  MeshSimulator sim(1);
+  SimTimeNetwork net;
+  addGrid(&sim, &net, k_nodes, 40);
+
+  clock_t cpuStart = clock();
+  // MeshSyncTime doesn't correct for the 1 ms it takes each packet to
+  // arrive, and the grid is over 30 hops across.
+  static constexpr uint32_t k_max_error_ms = 50;
+  uint32_t took =
+      sim.runUntil(k_max_ms, [&]() { return converged(sim, net, k_max_error_ms); }, 1000);
+  double cpuSecs = double(clock() - cpuStart) / CLOCKS_PER_SEC;
+  size_t frames = 0;
+  for (const auto& node : net) {
+    frames += node->dispatch.framesSent();
+  }
+  printf(
+          "%lu nodes in a 40-wide grid converged after %.1f virtual s, %lu frames, "
+          "%llu events, %.1f CPU s\n",
+          k_nodes, took / 1000., frames, (unsigned long long)sim.eventsRun(), cpuSecs);
+  assertLess(took, k_max_ms);
+  removeAll(&sim, net);
+}
+
+void setup() {
+  TestRunner::setTimeout(600);
+#if !defined(EPOXY_DUINO)
+  delay(1000);  // wait to prevent garbage on SERIAL_PORT_MONITOR
+#endif
+  SERIAL_PORT_MONITOR.begin(115200);
+  while (!SERIAL_PORT_MONITOR)
+    ;  // needed for Leonardo/Micro
+}
+
+void loop() { TestRunner::run(); }
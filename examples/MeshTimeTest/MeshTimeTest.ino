@@ -1,10 +1,21 @@
 #include <AUnitVerbose.h>
 #include <Arduino.h>
 #include <FakeProtoDispatch.h>
+#include <MeshSimulator.h>
 #include <MeshSyncTime.h>
 
+#include <stdio.h>
+
+#include <memory>
+#include <vector>
+
 using namespace aunit;
 
+// Runs everything on virtual time.
+MeshSimulator sim;
+
+using eth_addr = FakeProtoDispatch::eth_addr;
+
 test(fastLocal) {
   MeshSyncTime t;
 
@@ -83,8 +94,252 @@ test(slowLocal) {
   assertEqual(t.syncedToLocal(synced2 + 80 + 10), now2 + 40 + 10);
 }
 
+// Simulates a node whose clock runs ppm parts per million faster than
+// the clock it syncs to, receiving a sync packet every intervalMs to
+// 2 * intervalMs, each delayed by up to jitterMs.  Returns the largest
+// difference seen between the two clocks once a few packets have
+// been received; *skewPpb is set to the final skew estimate.
+uint32_t maxSyncError(int32_t ppm, uint32_t intervalMs, bool compensate, int32_t* skewPpb,
+                      uint32_t jitterMs = 2) {
+  // Same timing whether or not compensation is enabled, and whatever ran before.
+  sim.seed(1);
+  MeshSyncTime t;
+  t.skewCompensation(compensate);
+  ProtoDispatchPktHdr hdr;
+
+  // Time on the reference clock, in microseconds.
+  uint64_t refUs = 0;
+  // The local clock starts where the simulator's is now, since that's
+  // what MeshSyncTime measured its start from.
+  uint32_t localStart = MeshClock::millis();
+  auto localAt = [&](uint64_t us) {
+    return localStart + uint32_t((us + int64_t(us) * ppm / 1000000) / 1000);
+  };
+  auto syncedAt = [&](uint64_t us) { return uint32_t(us / 1000 + 5000000); };
+
+  uint32_t maxError = 0;
+  for (size_t i = 0; i != 40; ++i) {
+    MeshSyncTimeData data;
+    data.syncedMillis = syncedAt(refUs);
+    data.syncedDuration = 1000000000;
+    t.receiveSync(&hdr, data, localAt(refUs + MeshClock::random(0, jitterMs + 1) * 1000));
+
+    uint64_t nextUs = refUs + MeshClock::random(intervalMs, 2 * intervalMs) * 1000ULL;
+    for (; refUs < nextUs; refUs += 100 * 1000) {
+      if (i < 10) {
+        continue;
+      }
+      int32_t error = t.localToSynced(localAt(refUs)) - syncedAt(refUs);
+      maxError = std::max<uint32_t>(maxError, abs(error));
+    }
+  }
+  *skewPpb = t.skewPpb();
+  return maxError;
+}
+
+test(skewCompensation) {
+  for (int32_t ppm : {-40, 10, 40, 100}) {
+    int32_t skewPpb;
+    uint32_t uncompensated = maxSyncError(ppm, 60000, false, &skewPpb);
+    uint32_t compensated = maxSyncError(ppm, 60000, true, &skewPpb);
+    printf("Clock %d ppm fast, syncing every 60-120s: sync error %u ms uncompensated, %u ms "
+           "with skew compensation (estimated skew %d ppb)\n",
+           ppm, uncompensated, compensated, skewPpb);
+    assertLessOrEqual(compensated, uncompensated);
+    // Most of what's left is delivery jitter and rounding to milliseconds.
+    assertLessOrEqual(compensated, 6U);
+    assertLess(abs(skewPpb + ppm * 1000), 10000);
+  }
+}
+
+test(skewCompensationLowerRate) {
+  // Sending a sixth as many sync packets with skew compensation should
+  // do at least as well as without.
+  int32_t skewPpb;
+  uint32_t frequent = maxSyncError(100, 10000, false, &skewPpb);
+  uint32_t infrequent = maxSyncError(100, 60000, true, &skewPpb);
+  printf("Clock 100 ppm fast: sync error %u ms syncing every 10-20s uncompensated, %u ms every "
+         "60-120s compensated\n",
+         frequent, infrequent);
+  assertLessOrEqual(infrequent, frequent);
+}
+
+// A simulated node whose synced clock starts out unrelated to everyone else's.
+struct TimeNode {
+  TimeNode(uint64_t id, bool elect) : addr(id), dispatch(addr) {
+    if (elect) {
+      time.electRoot(addr.addr);
+    }
+    time.applySync(random(0, 1000000000));
+    dispatch.addProtocol(1, &time);
+    dispatch.begin();
+  }
+
+  eth_addr addr;
+  FakeProtoDispatch dispatch;
+  MeshSyncTime time;
+};
+
+using TimeNetwork = std::vector<std::unique_ptr<TimeNode>>;
+
+// Adds a line of numNodes nodes to net, numbered starting at firstId.
+void addLine(TimeNetwork* net, size_t numNodes, uint64_t firstId, bool elect) {
+  for (size_t i = 0; i != numNodes; ++i) {
+    net->emplace_back(new TimeNode(firstId + i, elect));
+    if (i) {
+      (*net)[net->size() - 2]->dispatch.connect(&net->back()->dispatch);
+    }
+  }
+}
+
+// Largest difference between any two nodes' synced clocks.
+uint32_t maxPairwiseError(const TimeNetwork& net) {
+  uint32_t now = sim.now();
+  uint32_t ref = net.front()->time.localToSynced(now);
+  int32_t lo = 0, hi = 0;
+  for (const auto& node : net) {
+    int32_t diff = node->time.localToSynced(now) - ref;
+    lo = std::min(lo, diff);
+    hi = std::max(hi, diff);
+  }
+  return hi - lo;
+}
+
+struct ConvergeResult {
+  // Seconds until every pair of clocks was within k_converged_ms for
+  // good, or the whole run if they never were.
+  double convergeSecs;
+  // Largest pairwise error over the last minute of the run.
+  uint32_t finalError;
+  size_t frames;
+};
+
+static constexpr uint32_t k_converged_ms = 10;
+
+// Runs net for the given number of 100 ms rounds.
+ConvergeResult runConverge(const TimeNetwork& net, size_t numRounds) {
+  ConvergeResult result;
+  size_t lastBad = 0;
+  bool everBad = false;
+  result.finalError = 0;
+  size_t framesBefore = 0;
+  for (const auto& node : net) {
+    framesBefore += node->dispatch.framesSent();
+  }
+  for (size_t i = 0; i != numRounds; ++i) {
+    for (const auto& node : net) {
+      node->dispatch.transmitAndReceive();
+    }
+    sim.advance(100);
+    uint32_t error = maxPairwiseError(net);
+    if (error > k_converged_ms) {
+      lastBad = i;
+      everBad = true;
+    }
+    if (i + 600 >= numRounds) {
+      result.finalError = std::max(result.finalError, error);
+    }
+  }
+  result.convergeSecs = everBad ? (lastBad + 1) / 10.0 : 0;
+  result.frames = -framesBefore;
+  for (const auto& node : net) {
+    result.frames += node->dispatch.framesSent();
+  }
+  return result;
+}
+
+bool sameRoot(const TimeNetwork& net, const eth_addr& root) {
+  for (const auto& node : net) {
+    if (memcmp(node->time.root(), root.addr, 6) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static constexpr size_t k_converge_rounds = 10 * 60 * 10;
+
+// Starts a line of 8 nodes at once, with unrelated clocks.
+ConvergeResult coldStartBenchmark(bool elect) {
+  TimeNetwork net;
+  addLine(&net, 8, 1, elect);
+  ConvergeResult result = runConverge(net, k_converge_rounds);
+  printf("Cold start of 8 nodes in a line %s: converged after %.1f s, worst pairwise error %u ms "
+         "over the last minute, %lu frames\n",
+         elect ? "electing a root" : "following the longest synced", result.convergeSecs,
+         result.finalError, result.frames);
+  return result;
+}
+
+test(electRootColdStart) {
+  ConvergeResult longest = coldStartBenchmark(false);
+  ConvergeResult elected = coldStartBenchmark(true);
+  assertLessOrEqual(elected.convergeSecs, longest.convergeSecs);
+  // Up to a transmit interval for the first packet, then a few packets per hop.
+  assertLess(elected.convergeSecs, 60.0);
+  assertLessOrEqual(elected.finalError, k_converged_ms);
+}
+
+// Lets two lines of 5 nodes settle separately, then joins their ends.
+ConvergeResult mergeBenchmark(bool elect, TimeNetwork* net) {
+  addLine(net, 5, 1, elect);
+  addLine(net, 5, 6, elect);
+  runConverge(*net, 5 * 60 * 10);
+  (*net)[4]->dispatch.connect(&(*net)[5]->dispatch);
+  ConvergeResult result = runConverge(*net, k_converge_rounds);
+  printf("Merging two lines of 5 nodes %s: converged after %.1f s, worst pairwise error %u ms "
+         "over the last minute, %lu frames\n",
+         elect ? "electing a root" : "following the longest synced", result.convergeSecs,
+         result.finalError, result.frames);
+  return result;
+}
+
+test(electRootMerge) {
+  TimeNetwork longestNet;
+  ConvergeResult longest = mergeBenchmark(false, &longestNet);
+  TimeNetwork net;
+  ConvergeResult elected = mergeBenchmark(true, &net);
+  assertLessOrEqual(elected.convergeSecs, longest.convergeSecs);
+  assertLess(elected.convergeSecs, 60.0);
+  assertLessOrEqual(elected.finalError, k_converged_ms);
+
+  // Both lines started at the same time, so the lowest address wins,
+  // and strata count hops from it.
+  assertTrue(sameRoot(net, net[0]->addr));
+  for (size_t i = 0; i != net.size(); ++i) {
+    assertEqual(net[i]->time.stratum(), int(i));
+  }
+}
+
+test(electRootLoss) {
+  TimeNetwork net;
+  addLine(&net, 6, 1, true);
+  runConverge(net, 2 * 60 * 10);
+  assertTrue(sameRoot(net, net[0]->addr));
+
+  // Take the root out of range; the rest should carry on its timeline
+  // under the next lowest address.
+  int32_t jumps = 0;
+  for (const auto& node : net) {
+    node->time.setJumpHook([&](int32_t) { ++jumps; });
+  }
+  net[0]->dispatch.disconnect(&net[1]->dispatch);
+  TimeNetwork rest;
+  rest.swap(net);
+  std::unique_ptr<TimeNode> oldRoot = std::move(rest.front());
+  rest.erase(rest.begin());
+  ConvergeResult result = runConverge(rest, 5 * 60 * 10);
+  printf("Lost the root of 6 nodes in a line: worst pairwise error %u ms over the last minute\n",
+         result.finalError);
+  assertTrue(sameRoot(rest, rest[0]->addr));
+  assertEqual(rest[0]->time.stratum(), 0);
+  assertEqual(rest.back()->time.stratum(), int(rest.size() - 1));
+  assertEqual(jumps, 0);
+  assertLessOrEqual(result.finalError, k_converged_ms);
+}
+
 void setup() {
-  TestRunner::setTimeout(30);
+  TestRunner::setTimeout(300);
 #if !defined(EPOXY_DUINO)
   delay(1000);  // wait to prevent garbage on SERIAL_PORT_MONITOR
 #endif
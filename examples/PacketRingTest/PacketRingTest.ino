@@ -0,0 +1,155 @@
+#include <AUnitVerbose.h>
+#include <Arduino.h>
+#include <PacketRing.h>
+
+#include <thread>
+
+using namespace aunit;
+
+using Ring = PacketRing<16>;
+
+ProtoDispatchPktHdr hdrFrom(uint8_t src) {
+  ProtoDispatchPktHdr hdr;
+  memset(hdr.src, src, sizeof(hdr.src));
+  hdr.rssi = -src;
+  return hdr;
+}
+
+test(ringOrder) {
+  Ring ring;
+  assertTrue(ring.begin(4));
+  assertTrue(ring.front() == nullptr);
+
+  // Go around a few times to make sure wrapping works.
+  for (uint8_t i = 0; i != 10; ++i) {
+    uint8_t data[] = {i, uint8_t(i + 1)};
+    assertTrue(ring.push(hdrFrom(i), data, i % 3));
+    assertEqual(ring.size(), 1UL);
+    const Ring::Packet* pkt = ring.front();
+    assertTrue(pkt != nullptr);
+    assertEqual(pkt->hdr.src[5], i);
+    assertEqual(pkt->hdr.rssi, int8_t(-i));
+    assertEqual(pkt->len, size_t(i % 3));
+    assertEqual(memcmp(pkt->data, data, pkt->len), 0);
+    ring.pop();
+    assertTrue(ring.front() == nullptr);
+  }
+  assertEqual(ring.overflows(), 0U);
+  assertEqual(ring.highWater(), 1U);
+}
+
+test(ringOverflow) {
+  Ring ring;
+  uint8_t data[17] = {};
+  // Nothing fits before begin.
+  assertFalse(ring.push(hdrFrom(0), data, 1));
+  assertEqual(ring.overflows(), 1U);
+  assertTrue(ring.begin(4));
+  for (uint8_t i = 0; i != 4; ++i) {
+    data[0] = i;
+    assertTrue(ring.push(hdrFrom(i), data, 1));
+  }
+  assertFalse(ring.push(hdrFrom(4), data, 1));
+  assertEqual(ring.size(), 4UL);
+  assertEqual(ring.overflows(), 2U);
+  assertEqual(ring.highWater(), 4U);
+
+  ring.pop();
+  // Too long.
+  assertFalse(ring.push(hdrFrom(5), data, 17));
+  assertEqual(ring.overflows(), 3U);
+  assertTrue(ring.push(hdrFrom(6), data, 16));
+
+  // The oldest packets are kept, in order.
+  for (uint8_t i : {1, 2, 3, 6}) {
+    assertEqual(ring.front()->hdr.src[0], i);
+    ring.pop();
+  }
+  assertTrue(ring.front() == nullptr);
+  assertEqual(ring.highWater(), 4U);
+}
+
+// Pushes numbered packets from one thread while another pops them.
+// If retry is true, the producer waits for room instead of dropping
+// packets.  Returns false if anything arrived corrupted or out of order.
+bool stressRing(size_t numPackets, bool retry, size_t* received, uint32_t* overflows) {
+  PacketRing<250> ring;
+  if (!ring.begin(8)) {
+    return false;
+  }
+
+  std::thread producer([&]() {
+    uint8_t data[250];
+    for (uint32_t seq = 0; seq != numPackets; ++seq) {
+      size_t len = sizeof(seq) + seq % (sizeof(data) - sizeof(seq));
+      memcpy(data, &seq, sizeof(seq));
+      for (size_t i = sizeof(seq); i != len; ++i) {
+        data[i] = seq + i;
+      }
+      ProtoDispatchPktHdr hdr = hdrFrom(seq);
+      while (!ring.push(hdr, data, len) && retry) {
+        std::this_thread::yield();
+      }
+    }
+  });
+
+  bool ok = true;
+  uint32_t nextSeq = 0;
+  *received = 0;
+  while (nextSeq != numPackets) {
+    const auto* pkt = ring.front();
+    if (!pkt) {
+      if (!retry && *received + ring.overflows() == numPackets) {
+        break;
+      }
+      std::this_thread::yield();
+      continue;
+    }
+    uint32_t seq;
+    memcpy(&seq, pkt->data, sizeof(seq));
+    if (seq < nextSeq || (retry && seq != nextSeq)) {
+      ok = false;
+    }
+    if (pkt->hdr.src[0] != uint8_t(seq) || pkt->len != sizeof(seq) + seq % (250 - sizeof(seq))) {
+      ok = false;
+    }
+    for (size_t i = sizeof(seq); i != pkt->len; ++i) {
+      if (pkt->data[i] != uint8_t(seq + i)) {
+        ok = false;
+      }
+    }
+    nextSeq = seq + 1;
+    ++*received;
+    ring.pop();
+  }
+  producer.join();
+  *overflows = ring.overflows();
+  return ok;
+}
+
+test(ringStressLossless) {
+  size_t received;
+  uint32_t overflows;
+  assertTrue(stressRing(1000000, true /* retry */, &received, &overflows));
+  assertEqual(received, 1000000UL);
+}
+
+test(ringStressLossy) {
+  size_t received;
+  uint32_t overflows;
+  assertTrue(stressRing(1000000, false /* don't retry */, &received, &overflows));
+  printf("Received %lu packets, %u overflowed\n", received, overflows);
+  assertEqual(received + overflows, 1000000UL);
+}
+
+void setup() {
+  TestRunner::setTimeout(60);
+#if !defined(EPOXY_DUINO)
+  delay(1000);  // wait to prevent garbage on SERIAL_PORT_MONITOR
+#endif
+  SERIAL_PORT_MONITOR.begin(115200);
+  while (!SERIAL_PORT_MONITOR)
+    ;  // needed for Leonardo/Micro
+}
+
+void loop() { TestRunner::run(); }
@@ -0,0 +1,135 @@
+#include <AUnitVerbose.h>
+#include <Arduino.h>
+#include <PeerCache.h>
+
+#include <set>
+
+using namespace aunit;
+
+// Stands in for the ESP-NOW peer table.
+class FakePeerTable {
+ public:
+  explicit FakePeerTable(size_t maxPeers) : _maxPeers(maxPeers) {}
+
+  std::set<uint64_t> peers;
+  size_t adds = 0;
+  size_t dels = 0;
+
+  PeerCache makeCache() {
+    return PeerCache([this](const uint8_t* addr) { return add(addr); },
+                     [this](const uint8_t* addr) { del(addr); });
+  }
+
+ private:
+  static uint64_t key(const uint8_t* addr) {
+    uint64_t k = 0;
+    for (size_t i = 0; i != 6; ++i) {
+      k = (k << 8) | addr[i];
+    }
+    return k;
+  }
+  bool add(const uint8_t* addr) {
+    ++adds;
+    if (peers.size() == _maxPeers || !peers.insert(key(addr)).second) {
+      return false;
+    }
+    return true;
+  }
+  void del(const uint8_t* addr) {
+    ++dels;
+    peers.erase(key(addr));
+  }
+
+  size_t _maxPeers;
+};
+
+struct Addr {
+  uint8_t addr[6];
+  explicit Addr(uint8_t last) : addr{2, 0, 0, 0, 0, last} {}
+};
+
+test(peerCacheHits) {
+  FakePeerTable table(20);
+  PeerCache cache = table.makeCache();
+
+  assertTrue(cache.use(Addr(1).addr));
+  assertTrue(cache.use(Addr(2).addr));
+  assertTrue(cache.use(Addr(1).addr));
+  assertTrue(cache.use(Addr(2).addr));
+  assertEqual(cache.hits(), 2U);
+  assertEqual(cache.misses(), 2U);
+  assertEqual(cache.evictions(), 0U);
+  assertEqual(table.adds, 2UL);
+  assertEqual(cache.size(), 2UL);
+
+  // Broadcasts don't need a peer.
+  uint8_t bcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+  assertTrue(cache.use(bcast));
+  assertEqual(table.adds, 2UL);
+  assertFalse(cache.contains(bcast));
+}
+
+test(peerCacheEvictsLeastRecentlyUsed) {
+  FakePeerTable table(20);
+  PeerCache cache = table.makeCache();
+  cache.capacity(3);
+
+  for (uint8_t i : {1, 2, 3}) {
+    assertTrue(cache.use(Addr(i).addr));
+  }
+  // Using 1 again makes 2 the least recently used.
+  assertTrue(cache.use(Addr(1).addr));
+  assertTrue(cache.use(Addr(4).addr));
+  assertFalse(cache.contains(Addr(2).addr));
+  for (uint8_t i : {1, 3, 4}) {
+    assertTrue(cache.contains(Addr(i).addr));
+  }
+  assertEqual(cache.evictions(), 1U);
+  assertEqual(table.peers.size(), 3UL);
+
+  // Shrinking removes the least recently used peers.
+  cache.capacity(1);
+  assertEqual(table.peers.size(), 1UL);
+  assertTrue(cache.contains(Addr(4).addr));
+  assertEqual(cache.evictions(), 3U);
+}
+
+test(peerCacheStaysWithinTable) {
+  // Alternating among more destinations than fit never overflows the table.
+  FakePeerTable table(5);
+  PeerCache cache = table.makeCache();
+  cache.capacity(4);
+  for (size_t round = 0; round != 100; ++round) {
+    assertTrue(cache.use(Addr(round % 7).addr));
+    assertLess(table.peers.size(), 5UL);
+  }
+  assertEqual(cache.hits() + cache.misses(), 100U);
+  assertEqual(table.dels, size_t(cache.evictions()));
+
+  // Only the most recently used destinations hit.
+  for (size_t round = 0; round != 100; ++round) {
+    cache.use(Addr(round % 2).addr);
+  }
+  assertEqual(cache.misses(), 100U);
+}
+
+test(peerCacheAddFails) {
+  FakePeerTable table(1);
+  PeerCache cache = table.makeCache();
+  // Someone else took the only slot.
+  table.peers.insert(99);
+  assertFalse(cache.use(Addr(1).addr));
+  assertEqual(cache.size(), 0UL);
+}
+
+void setup() {
+  TestRunner::setTimeout(30);
+#if !defined(EPOXY_DUINO)
+  delay(1000);  // wait to prevent garbage on SERIAL_PORT_MONITOR
+#endif
+  SERIAL_PORT_MONITOR.begin(115200);
+  while (!SERIAL_PORT_MONITOR)
+    ;  // needed for Leonardo/Micro
+}
+
+void loop() { TestRunner::run(); }
@@ -8,19 +8,52 @@ MeshSyncSketch::MeshSyncSketch(int version) : MeshSync(version, ESP.getSketchSiz
 
 bool MeshSyncSketch::startUpdate(size_t updateLen, int newVersion, const uint8_t* metadata,
                                  size_t metadataLen) {
-  Update.begin(updateLen);
-  Update.runAsync(true);
   String expectedMD5;
   while (metadataLen) {
     expectedMD5.concat(char(*metadata));
     ++metadata;
     --metadataLen;
   }
-  Update.setMD5(expectedMD5.c_str());
+
+  if (Update.isRunning() &&
+      (newVersion != _newVersion || expectedMD5 != _newSketchMD5 || updateLen != Update.size())) {
+    // Left over from a different update that was aborted.
+    Update.end();
+  }
+  _newVersion = newVersion;
+  _newSketchMD5 = expectedMD5;
+  if (!Update.isRunning() && !_beginFlash(updateLen)) {
+    return false;
+  }
   Serial.printf("Starting firmware update to version %d from %d\n", newVersion, localVersion());
   return true;
 }
 
+bool MeshSyncSketch::_beginFlash(size_t updateLen) {
+  if (!Update.begin(updateLen)) {
+    Serial.print("MeshSyncSketch: Unable to start update: ");
+    Update.printError(Serial);
+    return false;
+  }
+  Update.runAsync(true);
+  Update.setMD5(_newSketchMD5.c_str());
+  return true;
+}
+
+size_t MeshSyncSketch::resumeUpdate(size_t offset) {
+  if (Update.progress() == offset) {
+    return offset;
+  }
+
+  // Update can only be written in order, so start over.
+  Update.end();
+  if (!_beginFlash(getNewSize())) {
+    // Update can get in a bad state; reset and try again later.
+    ESP.reset();
+  }
+  return 0;
+}
+
 bool MeshSyncSketch::receiveUpdateChunk(const uint8_t* chunk, size_t chunklen) {
   static uint8_t printCounter = 0;
   if (printCounter & 0xF) {
@@ -43,6 +76,11 @@ bool MeshSyncSketch::receiveUpdateChunk(const uint8_t* chunk, size_t chunklen) {
 }
 
 void MeshSyncSketch::onUpdateAbort() {
+  if (!Update.hasError()) {
+    // Leave the update open, so we can pick up where we left off.
+    Serial.printf("Pausing firmware update at %u of %u\n", Update.progress(), Update.size());
+    return;
+  }
   Serial.printf("Aborting firmware update\n");
   Update.end();
   // Update can get in a bad state; reset and try again later.
@@ -18,13 +18,21 @@ class MeshSyncSketch : public MeshSync {
   bool startUpdate(size_t updateLen, int newVersion, const uint8_t* metadata,
                    size_t metadataLen) override;
   bool receiveUpdateChunk(const uint8_t* chunk, size_t chunklen) override;
+  size_t resumeUpdate(size_t offset) override;
   void onUpdateAbort() override;
   void onUpdateComplete() override;
 
   bool provideUpdateChunk(size_t offset, uint8_t* chunk, size_t size) override;
   int provideUpdateMetadata(uint8_t* metadata, size_t maxlen) override;
 
+  bool _beginFlash(size_t updateLen);
+
   String _localSketchMD5;
+
+  // Update being written to flash.  This is kept open when an update
+  // is aborted, so it can be resumed.
+  int _newVersion = -1;
+  String _newSketchMD5;
 };
 
 #endif
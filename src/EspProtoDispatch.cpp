@@ -8,19 +8,51 @@
 #define WIFI_CHAN 1
 
 EspProtoDispatchClass EspProtoDispatch;
+EspProtoDispatchClass* EspProtoDispatchClass::_active = nullptr;
+
+static bool addPeer(const uint8_t* addr) {
+  int res = esp_now_add_peer(const_cast<u8*>(addr), ESP_NOW_ROLE_COMBO, WIFI_CHAN, NULL, 0);
+  if (res != 0) {
+    Serial.printf("esp_now_add_peer failed: %d\n", res);
+    return false;
+  }
+  return true;
+}
+
+static void delPeer(const uint8_t* addr) {
+  int res = esp_now_del_peer(const_cast<u8*>(addr));
+  if (res != 0) {
+    Serial.printf("esp_now_del_peer failed: %d\n", res);
+  }
+}
+
+EspProtoDispatchClass::EspProtoDispatchClass() : _peers(addPeer, delPeer) {}
 
 void EspProtoDispatchClass::_esp_now_recv_cb(u8* src, u8* data, u8 len) {
-  static ProtoDispatchPktHdr protohdr;
+  ProtoDispatchPktHdr protohdr;
   memcpy(protohdr.src, src, 6);
-  EspProtoDispatch.receivePacket(&protohdr, data, len);
+  _active->_rxRing.push(protohdr, data, len);
 }
 
 void EspProtoDispatchClass::_esp_now_send_cb(u8* dst, u8 status) {
-  assert(EspProtoDispatch._sendInProgress);
-  EspProtoDispatch._sendInProgress = false;
+  uint32_t completed = _active->_framesCompleted.load(std::memory_order_relaxed);
+  assert(completed != _active->_framesSent);
+  uint32_t bit = 1u << (completed % 32);
+  // A status of 0 means success.
+  if (status == 0) {
+    _active->_sendStatusBits.fetch_or(bit, std::memory_order_relaxed);
+  } else {
+    _active->_sendStatusBits.fetch_and(~bit, std::memory_order_relaxed);
+  }
+  _active->_framesCompleted.store(completed + 1, std::memory_order_release);
 }
 
 void EspProtoDispatchClass::protoDispatchBegin() {
+  if (!_rxRing.begin(_rxRingSlots)) {
+    Serial.println("Unable to allocate receive ring");
+    abort();
+  }
+  _active = this;
   wifi_set_channel(1);
   wifi_set_opmode(STATION_MODE);
   wifi_promiscuous_enable(0);
@@ -51,31 +83,38 @@ void EspProtoDispatchClass::protoDispatchBegin() {
 }
 
 void EspProtoDispatchClass::espTransmitIfNeeded() {
-  if (_sendInProgress) {
-    return;
+  while (const auto* pkt = _rxRing.front()) {
+    receivePacket(&pkt->hdr, pkt->data, pkt->len);
+    _rxRing.pop();
   }
 
-  uint8_t dst[ETH_ADDR_LEN];
-  uint8_t xmitBuf[MAX_PKT_LEN];
-  int pktLen = transmitIfNeeded(dst, xmitBuf, MAX_PKT_LEN);
-  if (pktLen < 0) {
-    return;
+  uint32_t completed = _framesCompleted.load(std::memory_order_acquire);
+  uint32_t statusBits = _sendStatusBits.load(std::memory_order_relaxed);
+  while (_framesReported != completed) {
+    sendCompleted(statusBits & (1u << (_framesReported % 32)));
+    ++_framesReported;
   }
 
-  _sendInProgress = true;
-  if (memcmp(dst, _lastPeer, ETH_ADDR_LEN) && !etherIsBroadcast(dst)) {
-    memcpy(_lastPeer, dst, ETH_ADDR_LEN);
-    int res = esp_now_add_peer(dst, ESP_NOW_ROLE_COMBO, WIFI_CHAN, NULL, 0);
+  // Keep up to MAX_IN_FLIGHT frames queued so the radio doesn't sit idle.
+  while (_framesSent - completed < MAX_IN_FLIGHT) {
+    uint8_t dst[ETH_ADDR_LEN];
+    uint8_t xmitBuf[MAX_PKT_LEN];
+    int pktLen = transmitIfNeeded(dst, xmitBuf, MAX_PKT_LEN);
+    if (pktLen < 0) {
+      return;
+    }
+
+    _peers.use(dst);
+    // Count it before sending, since the send callback may happen right away.
+    ++_framesSent;
+    int res = esp_now_send(dst, xmitBuf, pktLen);
     if (res != 0) {
-      Serial.printf("esp_now_add_peer failed: %d\n", res);
+      Serial.printf("esp_now_send failed: %d\n", res);
+      --_framesSent;
+      sendAborted();
+      return;
     }
   }
-  int res = esp_now_send(dst, xmitBuf, pktLen);
-  if (res == 0) {
-    _sendInProgress = true;
-  } else {
-    Serial.printf("esp_now_send failed: %d\n", res);
-  }
 }
 
 #endif
@@ -1,25 +1,61 @@
 #ifndef ESP_PROTO_DISPATCH_H
 #define ESP_PROTO_DISPATCH_H
 
+#include "PacketRing.h"
+#include "PeerCache.h"
 #include "ProtoDispatch.h"
 
 #if defined(ESP8266)
 
 class EspProtoDispatchClass : public ProtoDispatchBase {
  public:
-  // Call this once per loop to transmit if needed.
+  EspProtoDispatchClass();
+
+  // Call this once per loop to process received packets and transmit if needed.
   void espTransmitIfNeeded();
 
+  // Sets how many received packets can wait to be processed; must be
+  // a power of 2.  Each takes about 260 bytes, allocated by begin().
+  // Must be called before begin.  Defaults to 8.
+  void rxRingSlots(size_t slots) { _rxRingSlots = slots; }
+
+  // Packets received while the ring of packets waiting to be processed was full.
+  uint32_t rxOverflows() const { return _rxRing.overflows(); }
+  // Most packets that have been waiting to be processed at once.
+  uint32_t rxHighWater() const { return _rxRing.highWater(); }
+
+  // ESP-NOW peers added for unicast destinations.  The capacity can
+  // be changed to leave room for peers added elsewhere.
+  PeerCache& peers() { return _peers; }
+
  private:
   static constexpr size_t MAX_PKT_LEN = 250;
+  // Frames handed to ESP-NOW that it hasn't reported on yet.  This
+  // must be no more than 32, the number of bits in _sendStatusBits.
+  static constexpr uint32_t MAX_IN_FLIGHT = 4;
 
   static void _esp_now_recv_cb(u8* src, u8* data, u8 len);
   static void _esp_now_send_cb(u8* dst, u8 status);
 
   void protoDispatchBegin() override;
 
-  bool _sendInProgress = false;
-  uint8_t _lastPeer[ETH_ADDR_LEN] = {0, 0, 0, 0, 0, 0};
+  // Instance that receives callbacks; the global one unless a
+  // StaticProtoDispatch is used instead.
+  static EspProtoDispatchClass* _active;
+
+  // Number of frames handed to ESP-NOW.  Only changed by the loop.
+  uint32_t _framesSent = 0;
+  // Number of frames whose status the loop has passed on.
+  uint32_t _framesReported = 0;
+  // Number of frames ESP-NOW has reported on.  Only changed by the send callback.
+  std::atomic<uint32_t> _framesCompleted{0};
+  // Bit n % 32 is set if frame n was sent successfully.  Only changed by the send callback.
+  std::atomic<uint32_t> _sendStatusBits{0};
+  PeerCache _peers;
+
+  // Packets are received in the WiFi callback, and processed from espTransmitIfNeeded.
+  PacketRing<MAX_PKT_LEN> _rxRing;
+  size_t _rxRingSlots = 8;
 };
 
 extern EspProtoDispatchClass EspProtoDispatch;
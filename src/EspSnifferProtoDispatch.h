@@ -1,6 +1,8 @@
 #ifndef ESP_SNIFFER_PROTO_DISPATCH_H
 #define ESP_SNIFFER_PROTO_DISPATCH_H
 
+#include "PacketRing.h"
+#include "PeerCache.h"
 #include "ProtoDispatch.h"
 
 #if defined(ESP8266)
@@ -10,9 +12,25 @@
 // access to the RSSI.
 class EspSnifferProtoDispatchClass : public ProtoDispatchBase {
  public:
-  // Call this once per loop to transmit if needed.
+  EspSnifferProtoDispatchClass();
+
+  // Call this once per loop to process received packets and transmit if needed.
   void espTransmitIfNeeded();
 
+  // Sets how many received packets can wait to be processed; must be
+  // a power of 2.  Each takes about 260 bytes, allocated by begin().
+  // Must be called before begin.  Defaults to 8.
+  void rxRingSlots(size_t slots) { _rxRingSlots = slots; }
+
+  // Packets received while the ring of packets waiting to be processed was full.
+  uint32_t rxOverflows() const { return _rxRing.overflows(); }
+  // Most packets that have been waiting to be processed at once.
+  uint32_t rxHighWater() const { return _rxRing.highWater(); }
+
+  // ESP-NOW peers added for unicast destinations.  The capacity can
+  // be changed to leave room for peers added elsewhere.
+  PeerCache& peers() { return _peers; }
+
   // Add a hook to get called whenever a packet is received to track the RSSI.
   using rssi_hook_func_t = std::function<void(const uint8_t* src, int8_t rssi)>;
   void setRSSIHook(const rssi_hook_func_t& f);
@@ -20,16 +38,36 @@ class EspSnifferProtoDispatchClass : public ProtoDispatchBase {
  private:
   // TODO(nils): Figure out what this number should actually be.
   static constexpr size_t MAX_PKT_LEN = 70;
+  // Other nodes may be sending with EspProtoDispatch, which uses bigger packets.
+  static constexpr size_t MAX_RX_PKT_LEN = 250;
+  // Frames handed to ESP-NOW that it hasn't reported on yet.  This
+  // must be no more than 32, the number of bits in _sendStatusBits.
+  static constexpr uint32_t MAX_IN_FLIGHT = 4;
 
   static void _esp_sniffer_recv_cb(uint8_t* buf, uint16_t len);
   static void _esp_now_send_cb(u8* dst, u8 status);
 
   void protoDispatchBegin() override;
 
-  bool _sendInProgress = false;
-  uint8_t _lastPeer[ETH_ADDR_LEN] = {0, 0, 0, 0, 0, 0};
+  // Instance that receives callbacks; the global one unless a
+  // StaticProtoDispatch is used instead.
+  static EspSnifferProtoDispatchClass* _active;
+
+  // Number of frames handed to ESP-NOW.  Only changed by the loop.
+  uint32_t _framesSent = 0;
+  // Number of frames whose status the loop has passed on.
+  uint32_t _framesReported = 0;
+  // Number of frames ESP-NOW has reported on.  Only changed by the send callback.
+  std::atomic<uint32_t> _framesCompleted{0};
+  // Bit n % 32 is set if frame n was sent successfully.  Only changed by the send callback.
+  std::atomic<uint32_t> _sendStatusBits{0};
+  PeerCache _peers;
   uint8_t _localAddr[ETH_ADDR_LEN] = {0, 0, 0, 0, 0, 0};
   rssi_hook_func_t _rssi_hook;
+
+  // Packets are received in the WiFi callback, and processed from espTransmitIfNeeded.
+  PacketRing<MAX_RX_PKT_LEN> _rxRing;
+  size_t _rxRingSlots = 8;
 };
 
 extern EspSnifferProtoDispatchClass EspSnifferProtoDispatch;
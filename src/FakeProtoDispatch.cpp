@@ -1,68 +1,181 @@
 #include "FakeProtoDispatch.h"
 
-std::set<FakeProtoDispatch*> FakeProtoDispatch::dispatches;
+#include <algorithm>
+
+constexpr size_t FakeProtoDispatch::MAX_FRAME_LEN;
+constexpr size_t FakeProtoDispatch::PACKETS_PER_BLOCK;
+
+std::vector<FakeProtoDispatch*> FakeProtoDispatch::dispatches;
+std::vector<std::unique_ptr<FakeProtoDispatch::pkt[]>> FakeProtoDispatch::_packetBlocks;
+FakeProtoDispatch::pkt* FakeProtoDispatch::_freePackets = nullptr;
 
 FakeProtoDispatch::FakeProtoDispatch(const eth_addr& localAddress) : _localAddress(localAddress) {
-  dispatches.insert(this);
+  dispatches.push_back(this);
+}
+
+FakeProtoDispatch::~FakeProtoDispatch() {
+  while (!_links.empty()) {
+    disconnect(_links.begin()->first);
+  }
+  dispatches.erase(std::find(dispatches.begin(), dispatches.end(), this));
+  for (const queued_pkt& in : _queue) {
+    _releasePacket(in.p);
+  }
 }
 
-FakeProtoDispatch::~FakeProtoDispatch() { dispatches.erase(this); }
+FakeProtoDispatch::pkt* FakeProtoDispatch::_allocPacket() {
+  if (!_freePackets) {
+    _packetBlocks.emplace_back(new pkt[PACKETS_PER_BLOCK]);
+    pkt* block = _packetBlocks.back().get();
+    for (size_t i = 0; i != PACKETS_PER_BLOCK; ++i) {
+      block[i].nextFree = _freePackets;
+      _freePackets = &block[i];
+    }
+  }
+  pkt* p = _freePackets;
+  _freePackets = p->nextFree;
+  p->refs = 0;
+  return p;
+}
+
+void FakeProtoDispatch::_releasePacket(pkt* p) {
+  if (p->refs) {
+    --p->refs;
+  }
+  if (!p->refs) {
+    p->nextFree = _freePackets;
+    _freePackets = p;
+  }
+}
+
+void FakeProtoDispatch::connect(FakeProtoDispatch* other, int8_t rssi) {
+  assert(other != this);
+  _setLink(other, rssi);
+  other->_setLink(this, rssi);
+}
+
+void FakeProtoDispatch::disconnect(FakeProtoDispatch* other) {
+  _removeLink(other);
+  other->_removeLink(this);
+}
+
+void FakeProtoDispatch::_setLink(FakeProtoDispatch* other, int8_t rssi) {
+  for (auto& link : _links) {
+    if (link.first == other) {
+      link.second = rssi;
+      return;
+    }
+  }
+  _links.emplace_back(other, rssi);
+}
+
+void FakeProtoDispatch::_removeLink(FakeProtoDispatch* other) {
+  for (auto it = _links.begin(); it != _links.end(); ++it) {
+    if (it->first == other) {
+      _links.erase(it);
+      return;
+    }
+  }
+}
 
 void FakeProtoDispatch::transmitAndReceive() {
-  while (!_queue.empty()) {
-    std::shared_ptr<pkt> in = _queue.front();
-    _queue.pop_front();
-
-    printf("Fake dispatch %s receiving a packet %p of length %lu from %s\n",
-           _localAddress.str().c_str(), in.get(), in->data.size(), in->src.str().c_str());
-    static ProtoDispatchPktHdr hdr;
-    memcpy(hdr.src, in->src.addr, 6);
-    receivePacket(&hdr, (const uint8_t*)in->data.data(), in->data.size());
+  // Indexed rather than iterated, in case a hook queues more.
+  for (size_t i = 0; i != _sendResults.size(); ++i) {
+    sendCompleted(_sendResults[i]);
   }
+  _sendResults.clear();
+
+  for (size_t i = 0; i != _queue.size(); ++i) {
+    pkt* in = _queue[i].p;
+    int8_t rssi = _queue[i].rssi;
 
-  eth_addr dst;
-  size_t maxlen = 250;
-  uint8_t buf[maxlen];
+    if (_logging) {
+      printf("Fake dispatch %s receiving a packet %p of length %lu from %s\n",
+             _localAddress.str().c_str(), in, in->len, in->src.str().c_str());
+    }
+    _curReceiveLossy += _receiveLossyFactor;
+    if (_curReceiveLossy > 1) {
+      _curReceiveLossy -= 1;
+      if (_logging) {
+        printf("DROPPING due to simulated packet loss\n");
+      }
+    } else {
+      static ProtoDispatchPktHdr hdr;
+      memcpy(hdr.src, in->src.addr, 6);
+      hdr.rssi = rssi;
+      receivePacket(&hdr, in->data, in->len);
+    }
+    _releasePacket(in);
+  }
+  _queue.clear();
 
-  int xmitlen = transmitIfNeeded(dst.addr, buf, maxlen);
+  pkt* p = _allocPacket();
+  int xmitlen = transmitIfNeeded(p->dst.addr, p->data, MAX_FRAME_LEN);
   if (xmitlen < 0) {
+    _releasePacket(p);
     return;
   }
+  p->src = _localAddress;
+  p->len = xmitlen;
 
+  const eth_addr& dst = p->dst;
   bool bcast = etherIsBroadcast(dst.addr);
+  ++_framesSent;
 
-  std::shared_ptr<pkt> p = std::make_shared<pkt>();
-  p->src = _localAddress;
-  p->dst = dst;
-  p->data = std::string((char*)buf, xmitlen);
-
-  printf("Fake dispatch %s transmitting a packet %p of length %d to %s\n",
-         _localAddress.str().c_str(), p.get(), xmitlen, dst.str().c_str());
+  if (_logging) {
+    printf("Fake dispatch %s transmitting a packet %p of length %d to %s\n",
+           _localAddress.str().c_str(), p, xmitlen, dst.str().c_str());
 
-  for (int i = 0; i != xmitlen; ++i) {
-    printf(" %02x", buf[i]);
-    if (isprint(buf[i])) {
-      printf(" (%c)", buf[i]);
-    } else {
-      printf("    ");
+    for (int i = 0; i != xmitlen; ++i) {
+      printf(" %02x", p->data[i]);
+      if (isprint(p->data[i])) {
+        printf(" (%c)", p->data[i]);
+      } else {
+        printf("    ");
+      }
     }
+    putchar('\n');
   }
-  putchar('\n');
   _curLossy += _sendLossyFactor;
   if (_curLossy > 1) {
     _curLossy -= 1;
-    printf("DROPPING due to simulated packet loss\n");
+    if (_logging) {
+      printf("DROPPING due to simulated packet loss\n");
+    }
+    _sendResults.push_back(bcast);
+    _releasePacket(p);
     return;
   }
 
-  for (FakeProtoDispatch* remote : dispatches) {
-    if (remote == this) {
-      continue;
-    }
+  bool delivered = bcast;
+  auto deliver = [&](FakeProtoDispatch* remote, int8_t rssi) {
     if (!bcast && remote->_localAddress != dst) {
-      continue;
+      return;
     }
-    remote->_queue.push_back(p);
-    printf("Queued to %s\n", remote->_localAddress.str().c_str());
+    ++p->refs;
+    remote->_queue.push_back({p, rssi});
+    delivered = true;
+    if (_logging) {
+      printf("Queued to %s\n", remote->_localAddress.str().c_str());
+    }
+    if (remote->_packetQueuedHook) {
+      remote->_packetQueuedHook();
+    }
+  };
+  if (_links.empty()) {
+    // Unconnected instances reach every other unconnected instance.
+    for (FakeProtoDispatch* remote : dispatches) {
+      if (remote != this && remote->_links.empty()) {
+        deliver(remote, 0);
+      }
+    }
+  } else {
+    for (const auto& link : _links) {
+      deliver(link.first, link.second);
+    }
+  }
+  if (!p->refs) {
+    _releasePacket(p);
   }
+  _sendResults.push_back(delivered);
 }
@@ -1,14 +1,22 @@
 #ifndef FAKE_PROTO_DISPATCH_H
 #define FAKE_PROTO_DISPATCH_H
 
-#include <deque>
+#include <functional>
 #include <memory>
-#include <set>
 #include <string>
+#include <vector>
 
 #include "ProtoDispatch.h"
 
 // Broadcasts all packets to all instances.  Useful for testing.
+//
+// To simulate nodes that are out of range of each other, use connect()
+// to set up links.  Instances that are connected to anything only
+// exchange packets with the instances they're connected to.
+//
+// Packets are kept in reference counted buffers from a shared pool,
+// so simulations with many nodes don't allocate memory for each
+// packet.  Logging every packet is off by default; see setLogging.
 class FakeProtoDispatch : public ProtoDispatchBase {
  public:
   struct eth_addr {
@@ -38,21 +46,87 @@ class FakeProtoDispatch : public ProtoDispatchBase {
     _sendLossyFactor = lossyFactor;
   }
 
+  // Drops this fraction of packets received by this instance only.
+  void setReceiveLossy(double lossyFactor) { _receiveLossyFactor = lossyFactor; }
+
+  // Number of packets this instance has transmitted, including ones that were dropped.
+  size_t framesSent() const { return _framesSent; }
+
+  // Whether each frame was delivered is reported during the following
+  // call to transmitAndReceive, like a send callback would.  A unicast
+  // frame fails if it's dropped or nobody has the destination address.
+
+  // Adds a link between this instance and other in both directions.
+  // Packets received over the link are reported with the given RSSI.
+  void connect(FakeProtoDispatch* other, int8_t rssi = 0);
+  // Removes a link added with connect().  If this instance is no
+  // longer connected to anything, it can reach every instance again.
+  void disconnect(FakeProtoDispatch* other);
+
+  // Called whenever a packet is queued for this instance to receive
+  // during its next transmitAndReceive.
+  void setPacketQueuedHook(const std::function<void()>& f) { _packetQueuedHook = f; }
+
+  // Prints every packet this instance sends and receives.
+  void setLogging(bool logging) { _logging = logging; }
+
  private:
+  // Longest frame we send, as with ESP-NOW.
+  static constexpr size_t MAX_FRAME_LEN = 250;
+  // Packet buffers are allocated this many at a time, and reused
+  // instead of being freed.
+  static constexpr size_t PACKETS_PER_BLOCK = 256;
+
   struct pkt {
     eth_addr src;
     eth_addr dst;
-    std::string data;
+    // Number of queues this packet is waiting in.
+    uint32_t refs;
+    // Next unused packet, while this one is unused.
+    pkt* nextFree;
+    size_t len;
+    uint8_t data[MAX_FRAME_LEN];
   };
+  static pkt* _allocPacket();
+  // Returns p to the pool once nothing refers to it.
+  static void _releasePacket(pkt* p);
 
-  static std::set<FakeProtoDispatch*> dispatches;
+  void _setLink(FakeProtoDispatch* other, int8_t rssi);
+  void _removeLink(FakeProtoDispatch* other);
+
+  struct queued_pkt {
+    pkt* p;
+    int8_t rssi;
+  };
+
+  static std::vector<std::unique_ptr<pkt[]>> _packetBlocks;
+  static pkt* _freePackets;
+
+  // Kept in the order instances were created, and links in the order
+  // they were added, so packets are delivered in the same order every
+  // run.
+  static std::vector<FakeProtoDispatch*> dispatches;
 
   eth_addr _localAddress;
 
-  std::deque<std::shared_ptr<pkt>> _queue;
+  // Instances this one is linked to, and the RSSI of each link.
+  std::vector<std::pair<FakeProtoDispatch*, int8_t>> _links;
+
+  // Packets to receive during the next transmitAndReceive.  Cleared
+  // instead of popped so its storage is reused.
+  std::vector<queued_pkt> _queue;
+  std::function<void()> _packetQueuedHook;
+  bool _logging = false;
 
   double _sendLossyFactor = 0;
   double _curLossy = 0;
+
+  size_t _framesSent = 0;
+  // Delivery results waiting to be reported.
+  std::vector<bool> _sendResults;
+
+  double _receiveLossyFactor = 0;
+  double _curReceiveLossy = 0;
 };
 
 #endif
@@ -1,7 +1,12 @@
 #include "LocalPeriodic.h"
 
+#include <algorithm>
 #include <limits>
 
+constexpr uint32_t LocalPeriodicBuf::BROADCAST_START_FIFTHS;
+constexpr uint32_t LocalPeriodicBuf::BROADCAST_END_FIFTHS;
+constexpr uint32_t LocalPeriodicBuf::SLOT_FREE_INTERVALS;
+
 void LocalPeriodicBuf::begin(const MeshSyncTime* timeSource, uint32_t everyMs) {
   _timeSource = timeSource;
   _everyMs = everyMs;
@@ -9,12 +14,51 @@ void LocalPeriodicBuf::begin(const MeshSyncTime* timeSource, uint32_t everyMs) {
   _scheduleNextTimeStep();
 }
 
+void LocalPeriodicBuf::slotted(uint16_t numSlots, const uint8_t* localAddr) {
+  _numSlots = numSlots;
+  memcpy(_localAddr, localAddr, ETH_ADDR_LEN);
+  _slotHeard.assign(numSlots, 0);
+  _slotPicks = 0;
+  if (numSlots) {
+    _pickSlot(0);
+  }
+}
+
+void LocalPeriodicBuf::_pickSlot(uint32_t interval) {
+  // FNV-1a hash of our address and the number of slots we've picked.
+  uint32_t hash = 2166136261U;
+  auto mix = [&](uint8_t b) { hash = (hash ^ b) * 16777619U; };
+  for (uint8_t b : _localAddr) {
+    mix(b);
+  }
+  for (size_t i = 0; i != 4; ++i) {
+    mix(_slotPicks >> (i * 8));
+  }
+  ++_slotPicks;
+
+  uint16_t start = hash % _numSlots;
+  for (uint16_t i = 0; i != _numSlots; ++i) {
+    uint16_t slot = (start + i) % _numSlots;
+    uint32_t heard = _slotHeard[slot];
+    if (!heard || interval + 1 - heard > SLOT_FREE_INTERVALS) {
+      _slot = slot;
+      return;
+    }
+  }
+  // Everything's taken; hope for the best.
+  _slot = start;
+}
+
+uint32_t LocalPeriodicBuf::_slotWidth() const {
+  return _everyMs * (BROADCAST_END_FIFTHS - BROADCAST_START_FIFTHS) / 5 / _numSlots;
+}
+
 void LocalPeriodicBuf::run() {
   if (!_everyMs || !_timeSource) {
     return;
   }
 
-  uint32_t now = millis();
+  uint32_t now = MeshClock::millis();
   if (!timeIsAfter(now, _nextTimeStep)) {
     return;
   }
@@ -24,30 +68,78 @@ void LocalPeriodicBuf::run() {
 
 void LocalPeriodicBuf::_scheduleNextTimeStep() {
   assert(_everyMs > 0);
-  uint32_t now = millis();
+  uint32_t now = MeshClock::millis();
   uint32_t synced = _timeSource->localToSynced(now);
   // If we don't have time to transmit, wait until the next interval to start.
-  uint32_t intervalStart = synced + (_everyMs * 4 / 5);
+  uint32_t intervalStart = synced + (_everyMs * BROADCAST_END_FIFTHS / 5);
   intervalStart -= intervalStart % _everyMs;
 
-  _nextBroadcast = _timeSource->syncedToLocal(
-      random(intervalStart + _everyMs * 1 / 5, intervalStart + _everyMs * 4 / 5));
+  uint32_t broadcastStart = intervalStart + _everyMs * BROADCAST_START_FIFTHS / 5;
+  uint32_t broadcastEnd = intervalStart + _everyMs * BROADCAST_END_FIFTHS / 5;
+  if (_numSlots) {
+    uint32_t width = _slotWidth();
+    // Nodes in neighboring slots may be off by the sync error in the
+    // other direction, so leave room for both.
+    uint32_t guard = std::min(std::max<uint32_t>(2 * _timeSource->syncErrorMs(), 1), width / 4);
+    broadcastStart += _slot * width;
+    broadcastEnd = broadcastStart + width - guard;
+    broadcastStart += guard;
+    _broadcastDeadline = _timeSource->syncedToLocal(broadcastEnd);
+  }
+  _nextBroadcast = _timeSource->syncedToLocal(MeshClock::random(broadcastStart, broadcastEnd));
 
   _nextTimeStep = _timeSource->syncedToLocal(intervalStart + _everyMs);
 }
 
 void LocalPeriodicBuf::onPacketReceived(const ProtoDispatchPktHdr* hdr, const uint8_t* pkt,
                                         size_t len) {
-  onReceivedBuf(hdr, pkt, len);
+  if (!_numSlots) {
+    onReceivedBuf(hdr, pkt, len);
+    return;
+  }
+
+  if (len < sizeof(LocalPeriodicSlotHeader)) {
+    return;
+  }
+  LocalPeriodicSlotHeader slotHdr;
+  memcpy(&slotHdr, pkt, sizeof(LocalPeriodicSlotHeader));
+  if (slotHdr.slot < _numSlots && _timeSource && _everyMs) {
+    uint32_t interval = _timeSource->localToSynced(MeshClock::millis()) / _everyMs;
+    _slotHeard[slotHdr.slot] = interval + 1;
+    if (slotHdr.slot == _slot && memcmp(hdr->src, _localAddr, ETH_ADDR_LEN) < 0) {
+      // The lower address keeps the slot.
+      ++_slotConflicts;
+      _pickSlot(interval);
+    }
+  }
+  onReceivedBuf(hdr, pkt + sizeof(LocalPeriodicSlotHeader), len - sizeof(LocalPeriodicSlotHeader));
 }
 
 int LocalPeriodicBuf::sendIfNeeded(uint8_t* ethaddr, uint8_t* pkt, size_t maxlen) {
-  if (!timeIsAfter(millis(), _nextBroadcast)) {
+  uint32_t now = MeshClock::millis();
+  if (!timeIsAfter(now, _nextBroadcast)) {
     return -1;
   }
   // Don't broadcast again until next time step.  This probably won't end up being the final time.
   _nextBroadcast += _everyMs;
-  int res = onTransmitBuf(pkt, maxlen);
+
+  size_t hdrLen = 0;
+  if (_numSlots) {
+    bool late = timeIsAfter(now, _broadcastDeadline);
+    _broadcastDeadline += _everyMs;
+    if (late) {
+      // Sending now could run into the next slot.
+      ++_slotsMissed;
+      return -1;
+    }
+    assert(maxlen >= sizeof(LocalPeriodicSlotHeader));
+    LocalPeriodicSlotHeader slotHdr;
+    slotHdr.slot = _slot;
+    memcpy(pkt, &slotHdr, sizeof(LocalPeriodicSlotHeader));
+    hdrLen = sizeof(LocalPeriodicSlotHeader);
+  }
+
+  int res = onTransmitBuf(pkt + hdrLen, maxlen - hdrLen);
   if (res < 0) {
     return res;
   }
@@ -55,5 +147,5 @@ int LocalPeriodicBuf::sendIfNeeded(uint8_t* ethaddr, uint8_t* pkt, size_t maxlen
   // Send to broadcast address
   memset(ethaddr, 0xff, 6);
 
-  return res;
+  return res + hdrLen;
 }
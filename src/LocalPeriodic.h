@@ -1,15 +1,48 @@
 #ifndef LOCAL_PERIODIC_H
 #define LOCAL_PERIODIC_H
 
+#include <vector>
+
 #include "MeshSyncTime.h"
 #include "ProtoDispatch.h"
 
+// Sent before each buffer in slotted mode; see LocalPeriodicBuf::slotted.
+struct LocalPeriodicSlotHeader {
+  // Slot the sender transmits in.
+  uint16_t slot;
+};
+
 class LocalPeriodicBuf : public ProtoDispatchTarget {
  public:
   void begin(const MeshSyncTime* timeSource, uint32_t everyMs);
   void run();
   ~LocalPeriodicBuf() override = default;
 
+  // If enabled, the part of each interval used for broadcasting is
+  // divided into numSlots slots, and each node broadcasts only in its
+  // own slot instead of at a random time, so nodes in range of each
+  // other don't collide.  localAddr is the address the dispatcher
+  // sends from, e.g. from WiFi.macAddress().
+  //
+  // Our slot starts out as a hash of our address.  Each broadcast
+  // says which slot it was sent in; if we hear a node with a lower
+  // address using our slot, we move to one we haven't heard anyone
+  // use recently.  Only conflicts between nodes in range of each
+  // other are detected.  We broadcast at a random point in our slot,
+  // leaving a guard time at each end of twice the sync error reported
+  // by the time source, and skip the interval if we can't send before
+  // the guard time at the end.  numSlots should be at least the
+  // number of nodes in range of each other.  Slotted nodes ignore
+  // broadcasts from nodes that aren't and vice versa, so all nodes
+  // should agree on this.  Disabled by default.
+  void slotted(uint16_t numSlots, const uint8_t* localAddr);
+  // Slot we're currently broadcasting in.
+  uint16_t slot() const { return _slot; }
+  // Number of times we moved to a different slot because of a conflict.
+  uint32_t slotConflicts() const { return _slotConflicts; }
+  // Number of intervals we didn't broadcast in because we missed our slot.
+  uint32_t slotsMissed() const { return _slotsMissed; }
+
   virtual void onTimeStep() {}
   virtual void onReceivedBuf(const ProtoDispatchPktHdr* hdr, const uint8_t* pkt, size_t len) = 0;
   virtual int onTransmitBuf(uint8_t* pkt, size_t maxlen) = 0;
@@ -19,7 +52,16 @@ class LocalPeriodicBuf : public ProtoDispatchTarget {
   int sendIfNeeded(uint8_t* ethaddr, uint8_t* pkt, size_t maxlen) override;
 
  private:
+  // Broadcasts happen between these fractions of each interval.
+  static constexpr uint32_t BROADCAST_START_FIFTHS = 1;
+  static constexpr uint32_t BROADCAST_END_FIFTHS = 4;
+  // A slot we haven't heard anyone use for this many intervals is free.
+  static constexpr uint32_t SLOT_FREE_INTERVALS = 3;
+
   void _scheduleNextTimeStep();
+  // Moves to a slot nobody else seems to be using.
+  void _pickSlot(uint32_t interval);
+  uint32_t _slotWidth() const;
 
   const MeshSyncTime* _timeSource = nullptr;
   bool _synced = false;
@@ -28,6 +70,19 @@ class LocalPeriodicBuf : public ProtoDispatchTarget {
 
   // Next time to broadcast in local time
   uint32_t _nextBroadcast = 0;
+  // In slotted mode, local time after which it's too late to
+  // broadcast in our slot.
+  uint32_t _broadcastDeadline = 0;
+
+  uint16_t _numSlots = 0;
+  uint16_t _slot = 0;
+  uint8_t _localAddr[ETH_ADDR_LEN] = {};
+  // Number of slots we've picked, to vary the hash.
+  uint32_t _slotPicks = 0;
+  // One more than the last interval each slot was heard in, or 0 if never.
+  std::vector<uint32_t> _slotHeard;
+  uint32_t _slotConflicts = 0;
+  uint32_t _slotsMissed = 0;
 
   // Next time step in local time.
   uint32_t _nextTimeStep = 0;
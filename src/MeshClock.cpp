@@ -0,0 +1,4 @@
+#include "MeshClock.h"
+
+MeshClock::millis_func_t MeshClock::_millis = nullptr;
+MeshClock::random_func_t MeshClock::_random = nullptr;
@@ -0,0 +1,29 @@
+#ifndef MESH_CLOCK_H
+#define MESH_CLOCK_H
+
+#include <Arduino.h>
+
+// Where the library gets the time and random numbers from.  These are
+// just millis() and random() unless replaced, e.g. by MeshSimulator to
+// run many simulated nodes on virtual time.
+class MeshClock {
+ public:
+  using millis_func_t = uint32_t (*)();
+  using random_func_t = long (*)(long min, long max);
+
+  static uint32_t millis() { return _millis ? _millis() : ::millis(); }
+  static long random(long max) { return random(0, max); }
+  static long random(long min, long max) { return _random ? _random(min, max) : ::random(min, max); }
+
+  // Replaces millis() and random().  Passing null restores the defaults.
+  static void set(millis_func_t millisFunc, random_func_t randomFunc) {
+    _millis = millisFunc;
+    _random = randomFunc;
+  }
+
+ private:
+  static millis_func_t _millis;
+  static random_func_t _random;
+};
+
+#endif
@@ -3,10 +3,13 @@
 
 #include <EspProtoDispatch.h>
 #include <EspSnifferProtoDispatch.h>
+#include <MeshSyncCollection.h>
 #include <MeshSyncMem.h>
 #include <MeshSyncStruct.h>
 #include <EspMeshSyncSketch.h>
 #include <MeshSyncTime.h>
+#include <MeshRouter.h>
+#include <StaticProtoDispatch.h>
 #include <CustomProto.h>
 #include <LocalPeriodic.h>
 
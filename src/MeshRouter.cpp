@@ -0,0 +1,387 @@
+#include "MeshRouter.h"
+
+#include <algorithm>
+
+constexpr uint8_t MeshRouter::INFINITE_COST;
+constexpr uint8_t MeshRouter::MAX_HOPS;
+
+MeshRouter::MeshRouter(const uint8_t* localAddr) { memcpy(_localAddr, localAddr, ETH_ADDR_LEN); }
+
+void MeshRouter::addProtocol(uint8_t protocolId, ProtoDispatchTarget* target) {
+  assert(!_findTarget(protocolId));
+  _targets.emplace_back(protocolId, target);
+}
+
+ProtoDispatchTarget* MeshRouter::_findTarget(uint8_t protocolId) const {
+  for (const auto& target : _targets) {
+    if (target.first == protocolId) {
+      return target.second;
+    }
+  }
+  return nullptr;
+}
+
+uint8_t MeshRouter::defaultLinkCost(int8_t rssi) {
+  if (rssi == 0 || rssi >= -70) {
+    return 1;
+  }
+  if (rssi >= -80) {
+    return 2;
+  }
+  if (rssi >= -87) {
+    return 4;
+  }
+  return 8;
+}
+
+const MeshRouter::Route* MeshRouter::route(const uint8_t* dst) const {
+  for (const Route& route : _routes) {
+    if (memcmp(route.dst, dst, ETH_ADDR_LEN) == 0) {
+      return &route;
+    }
+  }
+  return nullptr;
+}
+
+MeshRouter::Route* MeshRouter::_findRoute(const uint8_t* dst) {
+  return const_cast<Route*>(route(dst));
+}
+
+size_t MeshRouter::numRoutes() const {
+  size_t count = 0;
+  for (const Route& route : _routes) {
+    if (route.cost < INFINITE_COST) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+void MeshRouter::onPacketReceived(const ProtoDispatchPktHdr* hdr, const uint8_t* pkt,
+                                  size_t len) {
+  if (len < 1) {
+    return;
+  }
+  switch (Op(pkt[0])) {
+    case Op::BEACON:
+      _onBeacon(hdr, pkt, len);
+      break;
+    case Op::DATA:
+      _onData(hdr, pkt, len);
+      break;
+  }
+}
+
+void MeshRouter::_onBeacon(const ProtoDispatchPktHdr* hdr, const uint8_t* pkt, size_t len) {
+  if (len < sizeof(BeaconData)) {
+    return;
+  }
+  BeaconData beacon;
+  memcpy(&beacon, pkt, sizeof(beacon));
+  if (len < sizeof(beacon) + beacon.count * sizeof(BeaconEntry)) {
+    return;
+  }
+
+  uint8_t linkCost = _linkCostHook ? _linkCostHook(hdr->src, hdr->rssi) : defaultLinkCost(hdr->rssi);
+  linkCost = std::max<uint8_t>(1, std::min(linkCost, INFINITE_COST));
+  _updateRoute(hdr->src, hdr->src, beacon.seq, 0, linkCost);
+
+  const uint8_t* ptr = pkt + sizeof(beacon);
+  for (size_t i = 0; i != beacon.count; ++i, ptr += sizeof(BeaconEntry)) {
+    BeaconEntry entry;
+    memcpy(&entry, ptr, sizeof(entry));
+    if (memcmp(entry.dst, _localAddr, ETH_ADDR_LEN) == 0) {
+      if (_seqIsAfter(entry.seq, _seq)) {
+        // We must have restarted.  Continue from where we left off so
+        // our beacons aren't ignored as stale.
+        _seq = entry.seq;
+        _triggerBeacon();
+      } else if (entry.cost >= INFINITE_COST) {
+        // Someone lost their route to us; a new beacon lets them find another.
+        _triggerBeacon();
+      }
+      continue;
+    }
+    uint8_t cost = std::min<uint32_t>(uint32_t(entry.cost) + linkCost, INFINITE_COST);
+    _updateRoute(entry.dst, hdr->src, entry.seq, entry.cost, cost);
+  }
+}
+
+void MeshRouter::_updateRoute(const uint8_t* dst, const uint8_t* nextHop, uint16_t seq,
+                              uint8_t advertisedCost, uint8_t cost) {
+  uint32_t now = MeshClock::millis();
+  Route* route = _findRoute(dst);
+  if (!route) {
+    if (cost >= INFINITE_COST) {
+      return;
+    }
+    Route newRoute;
+    memcpy(newRoute.dst, dst, ETH_ADDR_LEN);
+    memcpy(newRoute.nextHop, nextHop, ETH_ADDR_LEN);
+    newRoute.cost = cost;
+    newRoute.seq = seq;
+    newRoute.feasibleCost = cost;
+    newRoute.lastHeard = now;
+    newRoute.failures = 0;
+    _routes.push_back(newRoute);
+    _triggerBeacon();
+    return;
+  }
+
+  if (_seqIsAfter(route->seq, seq)) {
+    // Based on an older beacon than our route.
+    return;
+  }
+  bool newer = seq != route->seq;
+  // A neighbor whose cost is lower than ours was can't be routing through us.
+  bool feasible = newer || advertisedCost < route->feasibleCost;
+  bool valid = route->cost < INFINITE_COST;
+  bool sameHop = memcmp(route->nextHop, nextHop, ETH_ADDR_LEN) == 0;
+
+  if (sameHop) {
+    if (!feasible || cost >= INFINITE_COST) {
+      // Our next hop lost its route, or it got worse and might be a loop.
+      _breakRoute(route);
+      return;
+    }
+  } else {
+    if (!feasible || cost >= INFINITE_COST) {
+      if (valid && cost >= INFINITE_COST) {
+        // Tell the neighbor about our route.
+        _triggerBeacon();
+      }
+      return;
+    }
+    if (valid && cost >= route->cost && now - route->lastHeard < 2 * _beaconMs) {
+      // Newer news of dst often arrives over a worse path first.  Give
+      // our current next hop a chance to pass it on before switching.
+      return;
+    }
+    memcpy(route->nextHop, nextHop, ETH_ADDR_LEN);
+    route->failures = 0;
+  }
+
+  if (!valid) {
+    route->failures = 0;
+  }
+  route->feasibleCost = newer ? cost : std::min(route->feasibleCost, cost);
+  route->cost = cost;
+  route->seq = seq;
+  route->lastHeard = now;
+  if (!valid) {
+    _triggerBeacon();
+  }
+}
+
+void MeshRouter::_breakRoute(Route* route) {
+  if (route->cost >= INFINITE_COST) {
+    return;
+  }
+  Serial.printf("MeshRouter: lost route to %s\n", etherToString(route->dst).c_str());
+  route->cost = INFINITE_COST;
+  route->lastHeard = MeshClock::millis();
+  _triggerBeacon();
+
+  if (memcmp(route->dst, route->nextHop, ETH_ADDR_LEN) == 0) {
+    // Lost a neighbor, so we can't use it to reach anyone else either.
+    for (Route& via : _routes) {
+      if (memcmp(via.nextHop, route->dst, ETH_ADDR_LEN) == 0) {
+        _breakRoute(&via);
+      }
+    }
+  }
+}
+
+void MeshRouter::_expireRoutes() {
+  uint32_t now = MeshClock::millis();
+  uint32_t timeout = ROUTE_TIMEOUT_INTERVALS * _beaconMs;
+  for (auto it = _routes.begin(); it != _routes.end();) {
+    if (now - it->lastHeard <= timeout) {
+      ++it;
+    } else if (it->cost < INFINITE_COST) {
+      _breakRoute(&*it);
+      ++it;
+    } else {
+      it = _routes.erase(it);
+    }
+  }
+}
+
+void MeshRouter::_triggerBeacon() {
+  uint32_t when =
+      MeshClock::millis() + MeshClock::random(TRIGGERED_BEACON_MS / 2, TRIGGERED_BEACON_MS);
+  if (timeIsAfter(_nextBeaconTime, when)) {
+    _nextBeaconTime = when;
+  }
+}
+
+void MeshRouter::_onData(const ProtoDispatchPktHdr* hdr, const uint8_t* pkt, size_t len) {
+  if (len < sizeof(DataHeader)) {
+    return;
+  }
+  DataHeader data;
+  memcpy(&data, pkt, sizeof(data));
+  if (memcmp(data.src, _localAddr, ETH_ADDR_LEN) == 0) {
+    return;
+  }
+  bool bcast = etherIsBroadcast(data.nextHop);
+  if (!bcast && memcmp(data.nextHop, _localAddr, ETH_ADDR_LEN) != 0) {
+    // Overheard a packet meant for another node.
+    return;
+  }
+
+  if (bcast || memcmp(data.dst, _localAddr, ETH_ADDR_LEN) == 0) {
+    ProtoDispatchTarget* target = _findTarget(data.protocolId);
+    if (!target) {
+      return;
+    }
+    ProtoDispatchPktHdr originHdr;
+    memcpy(originHdr.src, data.src, ETH_ADDR_LEN);
+    if (memcmp(data.src, hdr->src, ETH_ADDR_LEN) == 0) {
+      // RSSI is only meaningful if the packet came straight from its sender.
+      originHdr.rssi = hdr->rssi;
+    }
+    ++_stats.delivered;
+    target->onPacketReceived(&originHdr, pkt + sizeof(data), len - sizeof(data));
+    return;
+  }
+
+  if (data.ttl <= 1) {
+    ++_stats.ttlExpired;
+    return;
+  }
+  if (_forwardQueue.size() >= MAX_FORWARD_QUEUE) {
+    ++_stats.queueDrops;
+    return;
+  }
+  --data.ttl;
+  _forwardQueue.emplace_back(pkt, pkt + len);
+  memcpy(_forwardQueue.back().data(), &data, sizeof(data));
+}
+
+int MeshRouter::sendIfNeeded(uint8_t* dst, uint8_t* pkt, size_t maxlen) {
+  _expireRoutes();
+
+  int len = _sendBeacon(dst, pkt, maxlen);
+  if (len >= 0) {
+    return len;
+  }
+  len = _sendForward(dst, pkt, maxlen);
+  if (len >= 0) {
+    return len;
+  }
+  return _sendOriginated(dst, pkt, maxlen);
+}
+
+int MeshRouter::_sendBeacon(uint8_t* dst, uint8_t* pkt, size_t maxlen) {
+  uint32_t now = MeshClock::millis();
+  if (!timeIsAfter(now, _nextBeaconTime)) {
+    return -1;
+  }
+  _nextBeaconTime = now + MeshClock::random(_beaconMs, 2 * _beaconMs);
+  assert(maxlen >= sizeof(BeaconData));
+
+  _seq += 2;
+  BeaconData beacon;
+  beacon.op = Op::BEACON;
+  beacon.seq = _seq;
+  size_t maxEntries = std::min<size_t>((maxlen - sizeof(beacon)) / sizeof(BeaconEntry), 255);
+  beacon.count = std::min(_routes.size(), maxEntries);
+
+  uint8_t* ptr = pkt + sizeof(beacon);
+  for (size_t i = 0; i != beacon.count; ++i, ptr += sizeof(BeaconEntry)) {
+    // If they don't all fit, continue where the last beacon left off.
+    const Route& route = _routes[(_beaconStart + i) % _routes.size()];
+    BeaconEntry entry;
+    memcpy(entry.dst, route.dst, ETH_ADDR_LEN);
+    entry.seq = route.seq;
+    entry.cost = route.cost;
+    memcpy(ptr, &entry, sizeof(entry));
+  }
+  if (!_routes.empty()) {
+    _beaconStart = (_beaconStart + beacon.count) % _routes.size();
+  }
+  memcpy(pkt, &beacon, sizeof(beacon));
+
+  memset(dst, 0xFF, ETH_ADDR_LEN);
+  ++_stats.beaconsSent;
+  return ptr - pkt;
+}
+
+int MeshRouter::_sendForward(uint8_t* dst, uint8_t* pkt, size_t maxlen) {
+  while (!_forwardQueue.empty()) {
+    std::vector<uint8_t> fwd = std::move(_forwardQueue.front());
+    _forwardQueue.pop_front();
+
+    DataHeader data;
+    memcpy(&data, fwd.data(), sizeof(data));
+    const Route* route = _findRoute(data.dst);
+    if (!route || route->cost >= INFINITE_COST) {
+      ++_stats.noRoute;
+      continue;
+    }
+    if (fwd.size() > maxlen) {
+      continue;
+    }
+    memcpy(data.nextHop, route->nextHop, ETH_ADDR_LEN);
+    memcpy(fwd.data(), &data, sizeof(data));
+    memcpy(pkt, fwd.data(), fwd.size());
+    memcpy(dst, route->nextHop, ETH_ADDR_LEN);
+    ++_stats.forwarded;
+    return fwd.size();
+  }
+  return -1;
+}
+
+int MeshRouter::_sendOriginated(uint8_t* dst, uint8_t* pkt, size_t maxlen) {
+  if (maxlen <= sizeof(DataHeader)) {
+    return -1;
+  }
+  for (size_t i = 0; i != _targets.size(); ++i) {
+    const auto& target = _targets[_nextTarget];
+    _nextTarget = (_nextTarget + 1) % _targets.size();
+
+    DataHeader data;
+    int len = target.second->sendIfNeeded(data.dst, pkt + sizeof(data), maxlen - sizeof(data));
+    if (len < 0) {
+      continue;
+    }
+
+    if (etherIsBroadcast(data.dst)) {
+      memset(data.nextHop, 0xFF, ETH_ADDR_LEN);
+    } else {
+      const Route* route = _findRoute(data.dst);
+      if (!route || route->cost >= INFINITE_COST) {
+        ++_stats.noRoute;
+        target.second->onSendStatus(data.dst, false);
+        continue;
+      }
+      memcpy(data.nextHop, route->nextHop, ETH_ADDR_LEN);
+    }
+    data.op = Op::DATA;
+    data.protocolId = target.first;
+    data.ttl = MAX_HOPS;
+    memcpy(data.src, _localAddr, ETH_ADDR_LEN);
+    memcpy(pkt, &data, sizeof(data));
+    memcpy(dst, data.nextHop, ETH_ADDR_LEN);
+    ++_stats.originated;
+    return sizeof(data) + len;
+  }
+  return -1;
+}
+
+void MeshRouter::onSendStatus(const uint8_t* ethaddr, bool success) {
+  if (etherIsBroadcast(ethaddr)) {
+    return;
+  }
+  for (Route& route : _routes) {
+    if (memcmp(route.nextHop, ethaddr, ETH_ADDR_LEN) != 0) {
+      continue;
+    }
+    if (success) {
+      route.failures = 0;
+    } else if (++route.failures >= MAX_LINK_FAILURES) {
+      _breakRoute(&route);
+    }
+  }
+}
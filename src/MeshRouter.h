@@ -0,0 +1,187 @@
+#ifndef MESH_ROUTER_H
+#define MESH_ROUTER_H
+
+#include <deque>
+#include <functional>
+#include <vector>
+
+#include "ProtoDispatch.h"
+
+// Forwards packets over several radio hops, so protocols can talk to
+// specific nodes that are out of range.
+//
+// MeshRouter is added to a dispatcher like any other protocol, and
+// routed protocols are added to the MeshRouter instead of the
+// dispatcher.  A routed protocol's sendIfNeeded fills in the address
+// of the final destination instead of a neighbor, and its
+// onPacketReceived is passed the address of the node that originally
+// sent the packet.  Packets sent to the broadcast address only reach
+// our neighbors.
+//
+// Routes are found with a distance vector protocol: each node
+// periodically broadcasts a beacon listing every node it has a route
+// to and the cost of the route.  As in Babel, each node's beacons
+// carry a sequence number, and we only switch to a route through a
+// different neighbor if it's based on a newer beacon or is cheaper
+// than any route we've had based on the same one.  This avoids
+// routing loops, and lets us fail over as soon as a neighbor tells us
+// about another route.  Each link costs 1 unless the dispatcher
+// reports RSSI (e.g. EspSnifferProtoDispatch), in which case weak
+// links cost more; see setLinkCostHook.
+class MeshRouter : public ProtoDispatchTarget {
+ public:
+  // Cost of a route to a node that can't be reached.
+  static constexpr uint8_t INFINITE_COST = 64;
+  // Packets are dropped after being forwarded this many times.
+  static constexpr uint8_t MAX_HOPS = 16;
+
+  // localAddr is the address the dispatcher sends from, e.g. from
+  // WiFi.macAddress().
+  explicit MeshRouter(const uint8_t* localAddr);
+
+  // Adds a protocol that can send to nodes more than one hop away.
+  // Routed protocols have their own protocol ids, separate from the
+  // dispatcher's.
+  void addProtocol(uint8_t protocolId, ProtoDispatchTarget* target);
+
+  // Sets the number of milliseconds between beacons.  The actual
+  // interval will be a random interval between 1 and 2 times this
+  // number to avoid synchronization issues.  Routes that aren't
+  // refreshed for several intervals are dropped.
+  void beaconMs(uint32_t ms) { _beaconMs = ms; }
+
+  struct Route {
+    uint8_t dst[ETH_ADDR_LEN];
+    // Neighbor to send packets for dst to.
+    uint8_t nextHop[ETH_ADDR_LEN];
+    // Sum of the cost of each link, or INFINITE_COST if dst can't be
+    // reached any more.
+    uint8_t cost;
+    // Sequence number of the beacon from dst this route is based on.
+    uint16_t seq;
+    // Lowest cost we've had for a route to dst based on seq.
+    uint8_t feasibleCost;
+    // Last time this route was confirmed by a beacon from nextHop.
+    uint32_t lastHeard;
+    // Unicast frames to nextHop that failed since the last success.
+    uint8_t failures;
+  };
+  // Returns null if we don't have a route to dst.
+  const Route* route(const uint8_t* dst) const;
+  // Number of nodes we have a route to.
+  size_t numRoutes() const;
+
+  struct Stats {
+    uint32_t beaconsSent = 0;
+    // Packets sent by routed protocols on this node.
+    uint32_t originated = 0;
+    // Packets forwarded on behalf of other nodes.
+    uint32_t forwarded = 0;
+    // Packets delivered to routed protocols on this node.
+    uint32_t delivered = 0;
+    // Packets dropped because there was no route to their destination.
+    uint32_t noRoute = 0;
+    // Packets dropped because they had been forwarded MAX_HOPS times.
+    uint32_t ttlExpired = 0;
+    // Packets dropped because too many were waiting to be forwarded.
+    uint32_t queueDrops = 0;
+  };
+  const Stats& stats() const { return _stats; }
+
+  // Returns the cost of the link to a neighbor we received a packet
+  // from with the given RSSI, from 1 to INFINITE_COST.  RSSI is 0 if
+  // the dispatcher doesn't report it.
+  using link_cost_func_t = std::function<uint8_t(const uint8_t* neighbor, int8_t rssi)>;
+  void setLinkCostHook(const link_cost_func_t& f) { _linkCostHook = f; }
+  static uint8_t defaultLinkCost(int8_t rssi);
+
+ private:
+  enum class Op : uint8_t { BEACON, DATA };
+
+  struct BeaconData {
+    Op op;
+    // This many BeaconEntry follow.
+    uint8_t count;
+    // Sender's sequence number.
+    uint16_t seq;
+  };
+
+  struct BeaconEntry {
+    uint8_t dst[ETH_ADDR_LEN];
+    uint16_t seq;
+    uint8_t cost;
+  };
+
+  struct DataHeader {
+    Op op;
+    uint8_t protocolId;
+    // Hops left before the packet is dropped.
+    uint8_t ttl;
+    // Node that should handle this packet next.  Sniffing dispatchers
+    // see unicast packets for other nodes too.
+    uint8_t nextHop[ETH_ADDR_LEN];
+    // Node that originally sent the packet.
+    uint8_t src[ETH_ADDR_LEN];
+    // Final destination.
+    uint8_t dst[ETH_ADDR_LEN];
+    // Packet data follows.
+  };
+
+  // Packets beyond this many waiting to be forwarded are dropped.
+  static constexpr size_t MAX_FORWARD_QUEUE = 8;
+  // A neighbor is considered gone after this many failed frames in a row.
+  static constexpr uint8_t MAX_LINK_FAILURES = 3;
+  // Beacon intervals after which a route that hasn't been refreshed is
+  // considered broken, and after which a broken route is forgotten.
+  static constexpr uint32_t ROUTE_TIMEOUT_INTERVALS = 6;
+  // Delay before sending a beacon after a route changes, so several
+  // changes can be sent together.
+  static constexpr uint32_t TRIGGERED_BEACON_MS = 200;
+
+  void onPacketReceived(const ProtoDispatchPktHdr* hdr, const uint8_t* pkt, size_t len) override;
+  void _onBeacon(const ProtoDispatchPktHdr* hdr, const uint8_t* pkt, size_t len);
+  void _onData(const ProtoDispatchPktHdr* hdr, const uint8_t* pkt, size_t len);
+
+  int sendIfNeeded(uint8_t* dst, uint8_t* pkt, size_t maxlen) override;
+  int _sendBeacon(uint8_t* dst, uint8_t* pkt, size_t maxlen);
+  int _sendForward(uint8_t* dst, uint8_t* pkt, size_t maxlen);
+  int _sendOriginated(uint8_t* dst, uint8_t* pkt, size_t maxlen);
+
+  void onSendStatus(const uint8_t* ethaddr, bool success) override;
+
+  static bool _seqIsAfter(uint16_t seq, uint16_t ref) { return uint16_t(ref - seq) >> 15; }
+  Route* _findRoute(const uint8_t* dst);
+  // Updates the route to dst from a neighbor's beacon, if it's better
+  // than the one we have.  advertisedCost is the neighbor's cost to
+  // dst, and cost includes the link to the neighbor.
+  void _updateRoute(const uint8_t* dst, const uint8_t* nextHop, uint16_t seq,
+                    uint8_t advertisedCost, uint8_t cost);
+  // Marks route as broken, and tells our neighbors soon.
+  void _breakRoute(Route* route);
+  void _expireRoutes();
+  void _triggerBeacon();
+  ProtoDispatchTarget* _findTarget(uint8_t protocolId) const;
+
+  uint8_t _localAddr[ETH_ADDR_LEN];
+  std::vector<std::pair<uint8_t /* protocol id */, ProtoDispatchTarget*>> _targets;
+  // Routed protocol to ask for a packet next.
+  size_t _nextTarget = 0;
+
+  uint32_t _beaconMs = 5000;
+  uint32_t _nextBeaconTime = 0;
+  // Sequence number of our last beacon.
+  uint16_t _seq = 0;
+  // Index of the first route to list in the next beacon, for when they
+  // don't all fit.
+  size_t _beaconStart = 0;
+
+  std::vector<Route> _routes;
+
+  // Packets from other nodes, including their DataHeader, waiting to be forwarded.
+  std::deque<std::vector<uint8_t>> _forwardQueue;
+
+  link_cost_func_t _linkCostHook;
+  Stats _stats;
+};
+
+#endif
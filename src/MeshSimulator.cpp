@@ -0,0 +1,168 @@
+#include "MeshSimulator.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+MeshSimulator* MeshSimulator::_active = nullptr;
+
+MeshSimulator::MeshSimulator(uint64_t seed) {
+  assert(!_active);
+  _active = this;
+  this->seed(seed);
+  MeshClock::set(&_clockMillis, &_clockRandom);
+}
+
+MeshSimulator::~MeshSimulator() {
+  MeshClock::set(nullptr, nullptr);
+  _active = nullptr;
+}
+
+uint32_t MeshSimulator::_clockMillis() { return _active->_now; }
+
+long MeshSimulator::_clockRandom(long min, long max) { return _active->random(min, max); }
+
+void MeshSimulator::seed(uint64_t seed) { _rngState = seed; }
+
+long MeshSimulator::random(long min, long max) {
+  if (min >= max) {
+    return min;
+  }
+  // splitmix64
+  uint64_t z = (_rngState += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+  return min + long(z % uint64_t(max - min));
+}
+
+bool MeshSimulator::EventLater::operator()(const Event& a, const Event& b) const {
+  if (a.time != b.time) {
+    return ProtoDispatchTarget::timeIsAfter(a.time, b.time);
+  }
+  return a.seq > b.seq;
+}
+
+void MeshSimulator::schedule(uint32_t delayMs, const std::function<void()>& f) {
+  _events.push({_now + delayMs, _nextSeq++, f});
+}
+
+void MeshSimulator::addNode(FakeProtoDispatch* dispatch, uint32_t pollMs,
+                            const std::function<void()>& loop) {
+  assert(pollMs > 0);
+  assert(!_findNode(dispatch));
+  Node node;
+  node.dispatch = dispatch;
+  node.pollMs = pollMs;
+  node.loop = loop;
+  size_t index = _nodes.size();
+  _nodes.push_back(node);
+  schedule(random(0, pollMs), [this, index]() { _poll(index); });
+  dispatch->setPacketQueuedHook([this, index]() { _packetQueued(index); });
+}
+
+void MeshSimulator::removeNode(FakeProtoDispatch* dispatch) {
+  Node* node = _findNode(dispatch);
+  if (node) {
+    dispatch->setPacketQueuedHook(nullptr);
+    // Leave its slot so the indexes in scheduled polls stay valid.
+    node->dispatch = nullptr;
+    node->loop = nullptr;
+  }
+}
+
+MeshSimulator::Node* MeshSimulator::_findNode(FakeProtoDispatch* dispatch) {
+  for (Node& node : _nodes) {
+    if (node.dispatch == dispatch) {
+      return &node;
+    }
+  }
+  return nullptr;
+}
+
+void MeshSimulator::_poll(size_t index) {
+  FakeProtoDispatch* dispatch = _nodes[index].dispatch;
+  if (!dispatch) {
+    // Removed since this poll was scheduled.
+    return;
+  }
+  schedule(_nodes[index].pollMs, [this, index]() { _poll(index); });
+  if (_nodes[index].loop) {
+    // Copied, since loop() may add nodes.
+    std::function<void()> loop = _nodes[index].loop;
+    loop();
+  }
+  _nodes[index].receiveScheduled = false;
+  dispatch->transmitAndReceive();
+}
+
+void MeshSimulator::_packetQueued(size_t index) {
+  if (_nodes[index].receiveScheduled) {
+    return;
+  }
+  _nodes[index].receiveScheduled = true;
+  schedule(_receiveDelayMs, [this, index]() {
+    FakeProtoDispatch* dispatch = _nodes[index].dispatch;
+    if (dispatch && _nodes[index].receiveScheduled) {
+      _nodes[index].receiveScheduled = false;
+      dispatch->transmitAndReceive();
+    }
+  });
+}
+
+void MeshSimulator::advance(uint32_t ms) {
+  uint32_t end = _now + ms;
+  while (!_events.empty() && !ProtoDispatchTarget::timeIsAfter(_events.top().time, end)) {
+    Event event = _events.top();
+    _events.pop();
+    _now = event.time;
+    ++_eventsRun;
+    event.f();
+  }
+  _now = end;
+}
+
+uint32_t MeshSimulator::runUntil(uint32_t maxMs, const std::function<bool()>& done,
+                                 uint32_t checkMs) {
+  uint32_t start = _now;
+  while (_now - start < maxMs) {
+    if (done()) {
+      break;
+    }
+    advance(std::min(checkMs, maxMs - (_now - start)));
+  }
+  return _now - start;
+}
+
+void MeshSimulator::place(FakeProtoDispatch* dispatch, double x, double y) {
+  Node* node = _findNode(dispatch);
+  assert(node);
+  node->placed = true;
+  node->x = x;
+  node->y = y;
+}
+
+int8_t MeshSimulator::rssiAtDistance(double meters) {
+  // Log-distance path loss with an exponent of 3.
+  double rssi = -40 - 30 * log10(std::max(meters, 1.0));
+  return int8_t(std::max(rssi, -127.0));
+}
+
+void MeshSimulator::connectInRange(double rangeM) {
+  for (size_t i = 0; i != _nodes.size(); ++i) {
+    const Node& a = _nodes[i];
+    if (!a.dispatch || !a.placed) {
+      continue;
+    }
+    for (size_t j = i + 1; j != _nodes.size(); ++j) {
+      const Node& b = _nodes[j];
+      if (!b.dispatch || !b.placed) {
+        continue;
+      }
+      double dist = hypot(a.x - b.x, a.y - b.y);
+      if (dist <= rangeM) {
+        a.dispatch->connect(b.dispatch, rssiAtDistance(dist));
+      }
+    }
+  }
+}
@@ -0,0 +1,115 @@
+#ifndef MESH_SIMULATOR_H
+#define MESH_SIMULATOR_H
+
+#include <functional>
+#include <queue>
+#include <vector>
+
+#include "FakeProtoDispatch.h"
+
+// Runs FakeProtoDispatch nodes on virtual time, so host simulations
+// of many nodes or long stretches of time don't have to wait for
+// them.  While a MeshSimulator exists, MeshClock::millis() returns its
+// virtual time and MeshClock::random() draws from its seeded random
+// number generator, so the same seed gives the same run every time.
+//
+// Nodes added with addNode are polled periodically, like a sketch's
+// loop() would.  Time only passes while running events, e.g.:
+//
+//   MeshSimulator sim(seed);
+//   FakeProtoDispatch a(1), b(2);
+//   ... add protocols ...
+//   sim.addNode(&a);
+//   sim.addNode(&b);
+//   sim.advance(60 * 1000);
+//
+// Tests that poll their dispatchers themselves can call advance()
+// instead of delay().  Only one MeshSimulator may exist at a time.
+class MeshSimulator {
+ public:
+  explicit MeshSimulator(uint64_t seed = 1);
+  ~MeshSimulator();
+
+  // Current virtual time in milliseconds.  Starts at 1, since some
+  // protocols treat 0 as unset.
+  uint32_t now() const { return _now; }
+
+  // Restarts the random number generator.
+  void seed(uint64_t seed);
+  // Returns a random number from min up to but not including max.
+  long random(long min, long max);
+
+  // Runs f at virtual time now() + delayMs.  Events for the same time
+  // run in the order they were scheduled.
+  void schedule(uint32_t delayMs, const std::function<void()>& f);
+
+  // Polls dispatch every pollMs, starting at a random point in the
+  // first interval.  If given, loop is called before each poll, e.g.
+  // to run LocalPeriodicBuf::run.  Packets sent to the node are
+  // received receiveDelayMs after they're sent instead of waiting for
+  // the next poll, like a sketch whose loop() runs continuously.  The
+  // node must be removed before it's destroyed.
+  void addNode(FakeProtoDispatch* dispatch, uint32_t pollMs = 100,
+               const std::function<void()>& loop = nullptr);
+  void receiveDelayMs(uint32_t ms) { _receiveDelayMs = ms; }
+  void removeNode(FakeProtoDispatch* dispatch);
+
+  // Runs events until virtual time has advanced by ms.
+  void advance(uint32_t ms);
+  // Runs until done() returns true, checking every checkMs, or until
+  // maxMs pass.  Returns the virtual time taken.
+  uint32_t runUntil(uint32_t maxMs, const std::function<bool()>& done, uint32_t checkMs = 100);
+
+  // Range topology: each node gets a position in meters, and
+  // connectInRange links every pair of nodes within rangeM of each
+  // other.  RSSI falls off with distance as in open space, from about
+  // -40 dBm at 1 m to -90 dBm at 50 m.
+  void place(FakeProtoDispatch* dispatch, double x, double y);
+  void connectInRange(double rangeM);
+  static int8_t rssiAtDistance(double meters);
+
+  // Number of events run so far, including polls.
+  uint64_t eventsRun() const { return _eventsRun; }
+
+ private:
+  struct Event {
+    uint32_t time;
+    // Order the event was scheduled in, to break ties.
+    uint64_t seq;
+    std::function<void()> f;
+  };
+  struct EventLater {
+    bool operator()(const Event& a, const Event& b) const;
+  };
+
+  struct Node {
+    // Null once removed.
+    FakeProtoDispatch* dispatch;
+    uint32_t pollMs;
+    std::function<void()> loop;
+    // Whether a receive is scheduled for packets queued since the last poll.
+    bool receiveScheduled = false;
+    bool placed = false;
+    double x = 0;
+    double y = 0;
+  };
+
+  void _poll(size_t index);
+  void _packetQueued(size_t index);
+  Node* _findNode(FakeProtoDispatch* dispatch);
+
+  static uint32_t _clockMillis();
+  static long _clockRandom(long min, long max);
+  static MeshSimulator* _active;
+
+  uint32_t _now = 1;
+  uint32_t _receiveDelayMs = 1;
+  // splitmix64 state.
+  uint64_t _rngState = 0;
+  uint64_t _nextSeq = 0;
+  uint64_t _eventsRun = 0;
+  std::priority_queue<Event, std::vector<Event>, EventLater> _events;
+  std::vector<Node> _nodes;
+};
+
+#endif
@@ -1,14 +1,56 @@
 #include "MeshSync.h"
 
+#include <algorithm>
 #include <stdio.h>
 
 // If true, update stragglers first.
 static constexpr bool k_lower_first = true;
 
+// Hashes the metadata (which usually includes a checksum of the data)
+// and the base version, to tell different updates with the same
+// version and length apart.
+static uint32_t resumeDigest(const uint8_t* metadata, size_t metadataLen, int baseVersion) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i != metadataLen; ++i) {
+    h = (h ^ metadata[i]) * 16777619u;
+  }
+  for (size_t i = 0; i != sizeof(baseVersion); ++i) {
+    h = (h ^ uint8_t(baseVersion >> (i * 8))) * 16777619u;
+  }
+  return h;
+}
+
 MeshSync::MeshSync(int localVersion, size_t localSize) {
   _localVersion.version = localVersion;
   _localVersion.len = localSize;
-  _nextProvideTime = millis() + random(0, _initialUpgradeMs / 2);
+  _nextProvideTime = MeshClock::millis() + MeshClock::random(0, _initialUpgradeMs / 2);
+}
+
+MeshSync::~MeshSync() { _stopChunkTracking(); }
+
+void MeshSync::fecGroupSize(uint8_t chunks) {
+  if (chunks > MAX_FEC_GROUP_SIZE) {
+    chunks = MAX_FEC_GROUP_SIZE;
+  }
+  _fecGroupSize = chunks;
+}
+
+void MeshSync::manifestBlockSize(size_t bytes) {
+  if (bytes > MeshSyncManifest::MAX_BLOCK_SIZE) {
+    bytes = MeshSyncManifest::MAX_BLOCK_SIZE;
+  }
+  _manifestBlockSize = bytes;
+  _localManifestBuilt = false;
+}
+
+void MeshSync::windowSize(uint8_t chunks) {
+  if (chunks < 1) {
+    chunks = 1;
+  }
+  if (chunks > MAX_WINDOW_SIZE) {
+    chunks = MAX_WINDOW_SIZE;
+  }
+  _windowSize = chunks;
 }
 
 void MeshSync::onPacketReceived(const ProtoDispatchPktHdr* hdr, const uint8_t* pkt, size_t len) {
@@ -16,15 +58,37 @@ void MeshSync::onPacketReceived(const ProtoDispatchPktHdr* hdr, const uint8_t* p
     return;
   }
   Op op = (Op)pkt[0];
+  int baseVersion = -1;
+  if (op == Op::DELTA) {
+    // Refers to the delta from the given base version instead of the full data.
+    if (len < 1 + sizeof(DeltaData) + 1) {
+      return;
+    }
+    DeltaData delta;
+    memcpy(&delta, pkt + 1, sizeof(DeltaData));
+    if (delta.baseVersion < 0) {
+      return;
+    }
+    baseVersion = delta.baseVersion;
+    pkt += 1 + sizeof(DeltaData);
+    len -= 1 + sizeof(DeltaData);
+    op = (Op)pkt[0];
+  }
   switch (op) {
     case Op::ADVERTISE:
-      _onAdvertise(hdr->src, pkt + 1, len - 1);
+      _onAdvertise(hdr->src, pkt + 1, len - 1, baseVersion);
       break;
     case Op::REQUEST:
-      _onRequest(hdr->src, pkt + 1, len - 1);
+      _onRequest(hdr->src, pkt + 1, len - 1, baseVersion);
       break;
     case Op::PROVIDE:
-      _onProvide(hdr->src, pkt + 1, len - 1);
+      _onProvide(hdr->src, pkt + 1, len - 1, baseVersion);
+      break;
+    case Op::REQUEST_WINDOW:
+      _onRequestWindow(hdr->src, pkt + 1, len - 1, baseVersion);
+      break;
+    case Op::REPAIR:
+      _onRepair(hdr->src, pkt + 1, len - 1, baseVersion);
       break;
     default:
       Serial.printf("Unknown mesh sync packet type %d recceived with length %d\n", int(op), len);
@@ -32,7 +96,83 @@ void MeshSync::onPacketReceived(const ProtoDispatchPktHdr* hdr, const uint8_t* p
   }
 }
 
+size_t MeshSync::_writeOp(uint8_t* pkt, Op op, int baseVersion) {
+  if (baseVersion < 0) {
+    pkt[0] = int(op);
+    return 1;
+  }
+  DeltaData delta;
+  delta.baseVersion = baseVersion;
+  pkt[0] = int(Op::DELTA);
+  memcpy(pkt + 1, &delta, sizeof(DeltaData));
+  pkt[1 + sizeof(DeltaData)] = int(op);
+  return 2 + sizeof(DeltaData);
+}
+
+bool MeshSync::_isUpdateStream(int version, int baseVersion) const {
+  return version == _updateVersion.version && baseVersion == _updateBaseVersion;
+}
+
+bool MeshSync::_isLocalStream(int version, int baseVersion) const {
+  if (version != _localVersion.version) {
+    return false;
+  }
+  return baseVersion < 0 || baseVersion == provideDeltaBase();
+}
+
+size_t MeshSync::_localStreamLen(int baseVersion) {
+  if (baseVersion >= 0) {
+    return provideDeltaLen();
+  }
+  if (!_manifestBlockSize) {
+    return _localVersion.len;
+  }
+  if (!_buildLocalManifest()) {
+    // Don't provide anything that can't be verified.
+    return 0;
+  }
+  return _localManifest.streamLen();
+}
+
+bool MeshSync::_provideStreamChunk(int baseVersion, size_t offset, uint8_t* chunk, size_t size) {
+  if (baseVersion >= 0) {
+    return provideDeltaChunk(offset, chunk, size);
+  }
+  if (!_manifestBlockSize) {
+    return provideUpdateChunk(offset, chunk, size);
+  }
+  // The leaves are sent first, followed by the data.
+  return _localManifest.readStream(offset, chunk, size,
+                                   [this](size_t dataOffset, uint8_t* data, size_t len) {
+                                     return provideUpdateChunk(dataOffset, data, len);
+                                   });
+}
+
+bool MeshSync::_buildLocalManifest() {
+  if (_localManifestBuilt) {
+    return true;
+  }
+  if (!_localManifest.build(_localVersion.len, _manifestBlockSize,
+                            [this](size_t offset, uint8_t* data, size_t len) {
+                              return provideUpdateChunk(offset, data, len);
+                            })) {
+    Serial.printf("Unable to compute checksums for version %d\n", _localVersion.version);
+    return false;
+  }
+  _localManifestBuilt = true;
+  return true;
+}
+
+size_t MeshSync::_deliveredOffset() const {
+  return _updateVerified ? _updateManifest.dataVerified() : _updateCurOffset;
+}
+
 void MeshSync::_updateStop(String msg) {
+  if (_deliveredOffset()) {
+    _saveResumeState();
+  }
+  _updateVerified = false;
+  _updateManifest.clear();
   onUpdateAbort();
   if (_updateStopHook) {
     _updateStopHook(msg);
@@ -40,6 +180,40 @@ void MeshSync::_updateStop(String msg) {
     Serial.println(msg);
   }
   _updateInProgress = false;
+  _stopChunkTracking();
+}
+
+size_t MeshSync::_resumeOffset() const {
+  MeshSyncResumeStore::State state;
+  if (_resumeValid) {
+    state = _resumeState;
+  } else if (!_resumeStore || !_resumeStore->loadState(&state)) {
+    return 0;
+  }
+  if (state.version != _updateVersion.version || state.len != _updateVersion.len ||
+      state.digest != _updateDigest || state.offset > state.len) {
+    return 0;
+  }
+  return state.offset;
+}
+
+void MeshSync::_saveResumeState() {
+  _resumeState.version = _updateVersion.version;
+  _resumeState.len = _updateVersion.len;
+  _resumeState.digest = _updateDigest;
+  _resumeState.offset = _deliveredOffset();
+  _resumeValid = true;
+  _resumeSavedOffset = _resumeState.offset;
+  if (_resumeStore) {
+    _resumeStore->saveState(_resumeState);
+  }
+}
+
+void MeshSync::_clearResumeState() {
+  _resumeValid = false;
+  if (_resumeStore) {
+    _resumeStore->clearState();
+  }
 }
 
 void MeshSync::_updateProgress() {
@@ -63,18 +237,20 @@ bool MeshSync::upToDate() const {
     return true;
   }
 
-  if (!_startTime || (millis() - _startTime) < _initialUpgradeMs) {
+  if (!_startTime || (MeshClock::millis() - _startTime) < _initialUpgradeMs) {
     // Wait _initialUpgradeMs to try and make sure we have a recent version.
     return false;
   }
   return true;
 }
 
-void MeshSync::_onAdvertise(const uint8_t* srcaddr, const uint8_t* pkt, size_t len) {
-  if (_updateInProgress) {
-    // IDEA(nils): If we're in the middle of updating and we lose
-    // contact, should we start downloading from a different source if
-    // available?
+void MeshSync::_onAdvertise(const uint8_t* srcaddr, const uint8_t* pkt, size_t len,
+                            int baseVersion) {
+  if (_flood) {
+    _noteNeighbor(srcaddr);
+  }
+  if (baseVersion >= 0) {
+    _onDeltaAdvertise(srcaddr, pkt, len, baseVersion);
     return;
   }
 
@@ -82,36 +258,160 @@ void MeshSync::_onAdvertise(const uint8_t* srcaddr, const uint8_t* pkt, size_t l
     return;
   }
 
+  if (_updateInProgress) {
+    // Remember who else we could get this update from, in case our source goes away.
+    AdvertiseData adv;
+    memcpy(&adv, pkt, sizeof(AdvertiseData));
+    if (adv.version == _updateVersion.version) {
+      _noteUpdateSource(srcaddr, baseVersion);
+    } else if (adv.version > _updateVersion.version) {
+      _newerVersionSeen = true;
+      _newerVersionTime = MeshClock::millis();
+    }
+    return;
+  }
+
   memcpy(&_updateVersion, pkt, sizeof(AdvertiseData));
 
+  if (_trickle && _updateVersion.version != _localVersion.version) {
+    _trickleReset(MeshClock::millis());
+  }
+
   if (_updateVersion.version <= _localVersion.version) {
     _seenThisOrOlderVersion = true;
-    if (_updateVersion.version < _localVersion.version &&
-        (_nextAdvertiseTime - millis()) > (_initialUpgradeMs / 2)) {
+    if (_updateVersion.version == _localVersion.version && _trickleCopies < 255) {
+      ++_trickleCopies;
+    }
+    if (_floodPending && _updateVersion.version == _localVersion.version &&
+        ++_floodCopies >= _floodRedundancy) {
+      // Enough of our neighbors have passed it on already.
+      _floodPending = false;
+      ++_floodsSuppressed;
+      _nextAdvertiseTime = MeshClock::millis() + MeshClock::random(_advertiseMs, 2 * _advertiseMs);
+    }
+    if (!_trickle && _updateVersion.version < _localVersion.version &&
+        (_nextAdvertiseTime - MeshClock::millis()) > (_initialUpgradeMs / 2)) {
       // Something just appeared with an old version; make sure they're aware right away that
       // there's a new one.
-      _nextAdvertiseTime = millis() + random(0, _initialUpgradeMs / 2);
+      _nextAdvertiseTime = MeshClock::millis() + MeshClock::random(0, _initialUpgradeMs / 2);
     }
     return;
   }
 
   _seenNewerVersion = true;
 
-  if (startUpdate(_updateVersion.len, _updateVersion.version, pkt + sizeof(AdvertiseData),
-                  len - sizeof(AdvertiseData))) {
-    _updateProgress();
-    memcpy(_updateEth, srcaddr, ETH_ADDR_LEN);
-    _updateCurOffset = 0;
+  const uint8_t* metadata = pkt + sizeof(AdvertiseData);
+  size_t metadataLen = len - sizeof(AdvertiseData);
+  size_t dataLen = _updateVersion.len;
+  ManifestData manifest;
+  if (_manifestBlockSize) {
+    if (metadataLen < sizeof(ManifestData)) {
+      return;
+    }
+    memcpy(&manifest, metadata, sizeof(ManifestData));
+    if (!manifest.blockSize || manifest.blockSize > MeshSyncManifest::MAX_BLOCK_SIZE ||
+        manifest.dataLen + MeshSyncManifest::leavesLen(manifest.dataLen, manifest.blockSize) !=
+            _updateVersion.len) {
+      return;
+    }
+    dataLen = manifest.dataLen;
+    metadata += sizeof(ManifestData);
+    metadataLen -= sizeof(ManifestData);
+  }
 
-    _nextRetryTime = millis();
-    _checkUpdateComplete();
+  if (startUpdate(dataLen, _updateVersion.version, metadata, metadataLen)) {
+    _updateBaseVersion = -1;
+    _beginUpdate(srcaddr, pkt + sizeof(AdvertiseData), len - sizeof(AdvertiseData),
+                 _manifestBlockSize ? &manifest : nullptr);
+  }
+}
 
-    // Abort any update sending, if we don't have the newest version.
-    _dataRequested = false;
+void MeshSync::_onDeltaAdvertise(const uint8_t* srcaddr, const uint8_t* pkt, size_t len,
+                                 int baseVersion) {
+  if (len < sizeof(AdvertiseData)) {
+    return;
+  }
+
+  AdvertiseData delta;
+  memcpy(&delta, pkt, sizeof(AdvertiseData));
+  if (_updateInProgress) {
+    if (delta.version == _updateVersion.version) {
+      _noteUpdateSource(srcaddr, baseVersion);
+    }
+    return;
+  }
+
+  if (delta.version <= _localVersion.version) {
+    return;
+  }
+  _seenNewerVersion = true;
+
+  if (baseVersion != _localVersion.version) {
+    // Not useful to us; we'll get the full version from a regular advertisement instead.
+    return;
+  }
+
+  if (startDeltaUpdate(delta.len, delta.version, baseVersion, pkt + sizeof(AdvertiseData),
+                       len - sizeof(AdvertiseData))) {
+    _updateVersion = delta;
+    _updateBaseVersion = baseVersion;
+    _beginUpdate(srcaddr, pkt + sizeof(AdvertiseData), len - sizeof(AdvertiseData));
   }
 }
 
-void MeshSync::_onRequest(const uint8_t* /* srcaddr */, const uint8_t* pkt, size_t len) {
+void MeshSync::_beginUpdate(const uint8_t* srcaddr, const uint8_t* metadata, size_t metadataLen,
+                            const ManifestData* manifest) {
+  _updateDigest = resumeDigest(metadata, metadataLen, _updateBaseVersion);
+  size_t resumeOffset = _resumeOffset();
+  size_t resumed = resumeUpdate(resumeOffset);
+  assert(resumed <= resumeOffset);
+  if (resumed) {
+    Serial.printf("Resuming update at %u of %u\n", unsigned(resumed), unsigned(_updateVersion.len));
+  }
+  _resumeSavedOffset = resumed;
+  _updateCurOffset = resumed;
+  _updateVerified = false;
+  if (manifest) {
+    // The leaves are needed again even if resuming; after them, the
+    // manifest's stream skips ahead to where we left off.
+    _updateCurOffset = 0;
+    if (!_updateManifest.expect(manifest->dataLen, manifest->blockSize, manifest->root,
+                                resumed)) {
+      _clearResumeState();
+      _updateStop("Unable to verify update");
+      return;
+    }
+    _updateVerified = true;
+  }
+  _retryCount = 0;
+  _sourceRetryCount = 0;
+  _retryBackoff = 0;
+  _linkRetryPending = false;
+  _linkRetries = 0;
+  _rttSamples = 0;
+  _rttPending = false;
+
+  _updateProgress();
+  memcpy(_updateEth, srcaddr, ETH_ADDR_LEN);
+  _updateSources.clear();
+  _noteUpdateSource(srcaddr, _updateBaseVersion);
+  _newerVersionSeen = false;
+  _updateWindowSize = _windowSize;
+  _updateFecGroupSize = _fecGroupSize;
+  _stopChunkTracking();
+  _startChunkTracking();
+
+  _nextRetryTime = MeshClock::millis();
+  _checkUpdateComplete();
+
+  // Abort any update sending, if we don't have the newest version.
+  _dataRequested = false;
+  _provideWindowMissing = 0;
+  _provideRepairPending = false;
+}
+
+void MeshSync::_onRequest(const uint8_t* srcaddr, const uint8_t* pkt, size_t len,
+                          int baseVersion) {
   if (len < sizeof(RequestData)) {
     return;
   }
@@ -120,37 +420,98 @@ void MeshSync::_onRequest(const uint8_t* /* srcaddr */, const uint8_t* pkt, size
   memcpy(&req, pkt, sizeof(RequestData));
 
   if (_updateInProgress) {
-    if (req.version != _updateVersion.version) {
-      return;
-    }
-    // Don't serve anything while we're updating ourselves.  However,
-    // if someone else is requesting things, let them go first if they're farther along.
-    if (k_lower_first ? (req.offset <= _updateCurOffset) : (req.offset >= _updateCurOffset)) {
-      _resetRetryTime();
-      _seenOther = true;
+    if (_isUpdateStream(req.version, baseVersion)) {
+      _yieldToOtherRequester(req.offset);
     }
     return;
   }
 
-  if (req.version != _localVersion.version) {
+  if (!_isLocalStream(req.version, baseVersion) || req.offset >= _localStreamLen(baseVersion)) {
     return;
   }
+  _noteRequester(srcaddr);
 
-  if (_dataRequested) {
+  if (_dataRequested && baseVersion == _provideRequestBase) {
     if (k_lower_first ? (req.offset < _maxRequestedOffset) : (req.offset > _maxRequestedOffset)) {
       _maxRequestedOffset = req.offset;
     }
   } else {
     _dataRequested = true;
     _maxRequestedOffset = req.offset;
+    _provideRequestBase = baseVersion;
+  }
+}
+
+void MeshSync::_onRequestWindow(const uint8_t* srcaddr, const uint8_t* pkt, size_t len,
+                                int baseVersion) {
+  if (len < sizeof(WindowRequestData)) {
+    return;
+  }
+
+  WindowRequestData req;
+  memcpy(&req, pkt, sizeof(WindowRequestData));
+
+  if (_updateInProgress) {
+    if (_isUpdateStream(req.version, baseVersion)) {
+      _yieldToOtherRequester(req.offset);
+    }
+    return;
+  }
+
+  if (!_isLocalStream(req.version, baseVersion) || !req.chunkSize || !req.missing ||
+      req.offset >= _localStreamLen(baseVersion)) {
+    return;
+  }
+  _noteRequester(srcaddr);
+
+  if (_provideWindowMissing) {
+    if (req.offset == _provideWindowOffset && req.chunkSize == _provideWindowChunkSize &&
+        baseVersion == _provideWindowBase) {
+      // Someone else wants chunks from the same window; send everything either of them is missing.
+      _provideWindowMissing |= req.missing;
+      if (!_provideWindowFecGroupSize) {
+        _provideWindowFecGroupSize = req.fecGroupSize;
+      }
+      return;
+    }
+    if (k_lower_first ? (req.offset >= _provideWindowOffset)
+                      : (req.offset <= _provideWindowOffset)) {
+      return;
+    }
+  }
+
+  _provideWindowBase = baseVersion;
+  _provideWindowOffset = req.offset;
+  _provideWindowChunkSize = req.chunkSize;
+  _provideWindowMissing = req.missing;
+  _provideWindowFecGroupSize = req.fecGroupSize;
+  if (_provideWindowFecGroupSize > MAX_FEC_GROUP_SIZE) {
+    _provideWindowFecGroupSize = 0;
   }
 }
 
-void MeshSync::_onProvide(const uint8_t* /* srcaddr */, const uint8_t* pkt, size_t len) {
+void MeshSync::_yieldToOtherRequester(size_t offset) {
+  // Don't serve anything while we're updating ourselves.  However,
+  // if someone else is requesting things, let them go first if they're farther along.
+  if (k_lower_first ? (offset <= _updateCurOffset) : (offset >= _updateCurOffset)) {
+    _resetRetryTime();
+    _seenOther = true;
+  }
+}
+
+void MeshSync::_yieldToOtherProvider() {
+  // Someone else is providing; let them do it.
+  uint32_t interval = _rttIntervalMs();
+  _nextProvideTime = MeshClock::millis() + MeshClock::random(interval * 2, interval * 4);
+  _dataRequested = false;
+  _provideWindowMissing = 0;
+  _provideRepairPending = false;
+}
+
+void MeshSync::_onProvide(const uint8_t* srcaddr, const uint8_t* pkt, size_t len,
+                          int baseVersion) {
   if (!_updateInProgress) {
-    // Someone else is providing; let them do it.
-    _nextProvideTime = millis() + random(_retryMs * 2, _retryMs * 4);
-    _dataRequested = false;
+    _yieldToOtherProvider();
     return;
   }
 
@@ -160,59 +521,442 @@ void MeshSync::_onProvide(const uint8_t* /* srcaddr */, const uint8_t* pkt, size
 
   ProvideData prov;
   memcpy(&prov, pkt, sizeof(ProvideData));
-  if (prov.version != _updateVersion.version) {
+  if (!_isUpdateStream(prov.version, baseVersion)) {
+    return;
+  }
+
+  const uint8_t* chunk = pkt + sizeof(ProvideData);
+  size_t chunkLen = len - sizeof(ProvideData);
+
+  // Whoever's providing our update is our current source.
+  memcpy(_updateEth, srcaddr, ETH_ADDR_LEN);
+  _noteUpdateSource(srcaddr, baseVersion);
+
+  if (_rttPending && prov.offset >= _rttRequestOffset && prov.offset < _rttRequestEnd) {
+    // Time until the next requested chunk arrives, so the retry timer
+    // also covers the gaps between chunks when a window is streamed.
+    _rttSample(MeshClock::millis() - _rttRequestTime);
+    _rttRequestTime = MeshClock::millis();
+  }
+
+  // Even chunks we don't otherwise need can help rebuild a lost chunk later.
+  _fecAccumulate(prov.offset, chunk, chunkLen);
+
+  if (_acceptChunk(prov.offset, chunk, chunkLen)) {
+    return;
+  }
+
+  if (k_lower_first ? (prov.offset < _updateCurOffset) : (prov.offset > _updateCurOffset)) {
+    _resetRetryTime();
+    _seenOther = true;
+  }
+}
+
+void MeshSync::_onRepair(const uint8_t* /* srcaddr */, const uint8_t* pkt, size_t len,
+                         int baseVersion) {
+  if (!_updateInProgress) {
+    _yieldToOtherProvider();
+    return;
+  }
+
+  if (len <= sizeof(RepairData) || !_fecParity) {
+    return;
+  }
+
+  RepairData rep;
+  memcpy(&rep, pkt, sizeof(RepairData));
+  if (!_isUpdateStream(rep.version, baseVersion) || rep.chunkSize != _updateChunkSize ||
+      rep.groupSize != _updateFecGroupSize) {
+    return;
+  }
+
+  size_t groupBytes = size_t(_updateFecGroupSize) * _updateChunkSize;
+  if (rep.offset % groupBytes || rep.offset >= _updateVersion.len) {
+    return;
+  }
+  size_t group = rep.offset / groupBytes;
+  FecGroup& fec = _fecGroups[group % _fecGroups.size()];
+  if (fec.group != group) {
+    return;
+  }
+
+  // We can rebuild the missing chunk if it's the only one in the group we haven't seen.
+  size_t groupChunks = (_updateVersion.len - rep.offset + _updateChunkSize - 1) / _updateChunkSize;
+  if (groupChunks > _updateFecGroupSize) {
+    groupChunks = _updateFecGroupSize;
+  }
+  uint32_t allChunks = groupChunks >= 32 ? ~uint32_t(0) : (uint32_t(1) << groupChunks) - 1;
+  uint32_t missing = allChunks & ~fec.received;
+  if (__builtin_popcount(missing) != 1) {
+    return;
+  }
+
+  size_t offset = rep.offset + __builtin_ctz(missing) * _updateChunkSize;
+  size_t chunkLen = _expectedChunkLen(offset);
+  const uint8_t* parity = pkt + sizeof(RepairData);
+  if (chunkLen > len - sizeof(RepairData)) {
     return;
   }
-  if (prov.offset != _updateCurOffset) {
-    if (k_lower_first ? (prov.offset < _updateCurOffset) : (prov.offset > _updateCurOffset)) {
-      _resetRetryTime();
-      _seenOther = true;
+
+  uint8_t* chunk = _fecParity + (group % _fecGroups.size()) * _updateChunkSize;
+  for (size_t i = 0; i != chunkLen; ++i) {
+    chunk[i] ^= parity[i];
+  }
+  fec.received = allChunks;
+  ++_chunksRepaired;
+  _acceptChunk(offset, chunk, chunkLen);
+}
+
+bool MeshSync::_acceptChunk(size_t offset, const uint8_t* chunk, size_t chunkLen) {
+  if (!_chunksReceived.empty()) {
+    // Out-of-order receive; keep anything we don't have yet, whoever requested it.
+    int res = _storeChunk(offset, chunk, chunkLen);
+    if (res == 0) {
+      return false;
+    }
+    if (res > 0) {
+      _onChunkProgress();
+    }
+    return true;
+  }
+
+  if (offset == _updateCurOffset) {
+    if (!_receiveChunk(chunk, chunkLen)) {
+      return true;
+    }
+    // Deliver any buffered chunks which are now in order.
+    while (_windowReceived & 1) {
+      size_t slot = (_updateCurOffset / _updateChunkSize) % _updateWindowSize;
+      if (!_receiveChunk(_windowBuf + slot * _updateChunkSize,
+                         _expectedChunkLen(_updateCurOffset))) {
+        return true;
+      }
     }
+    _onChunkProgress();
+    return true;
+  }
+
+  if (_bufferWindowChunk(offset, chunk, chunkLen)) {
+    _onChunkProgress();
+    return true;
+  }
+  return false;
+}
+
+void MeshSync::_fecAccumulate(size_t offset, const uint8_t* chunk, size_t chunkLen) {
+  if (!_fecParity || offset % _updateChunkSize || offset >= _updateVersion.len ||
+      chunkLen != _expectedChunkLen(offset)) {
     return;
   }
 
-  size_t chunkLen = len - sizeof(ProvideData);
+  size_t chunkIdx = offset / _updateChunkSize;
+  size_t group = chunkIdx / _updateFecGroupSize;
+  FecGroup& fec = _fecGroups[group % _fecGroups.size()];
+  uint8_t* parity = _fecParity + (group % _fecGroups.size()) * _updateChunkSize;
+  if (fec.group != group) {
+    fec.group = group;
+    fec.received = 0;
+    memset(parity, 0, _updateChunkSize);
+  }
 
-  bool res = receiveUpdateChunk(pkt + sizeof(ProvideData), chunkLen);
-  if (!res) {
-    _updateStop("Receiving chunk failed");
+  uint32_t bit = uint32_t(1) << (chunkIdx % _updateFecGroupSize);
+  if (fec.received & bit) {
     return;
   }
-#if VERBOSE
-  Serial.printf(" %u+%d/u", _updateCurOffset, chunkLen, _updateVersion.len);
-#endif
-  _updateCurOffset += chunkLen;
+  for (size_t i = 0; i != chunkLen; ++i) {
+    parity[i] ^= chunk[i];
+  }
+  fec.received |= bit;
+}
+
+void MeshSync::_onChunkProgress() {
   _retryCount = 0;
+  _sourceRetryCount = 0;
+  _retryBackoff = 0;
   _updateProgress();
+  if (_resumeStore && _updateCurOffset < _updateVersion.len &&
+      _deliveredOffset() - _resumeSavedOffset >= _resumeCheckpointBytes) {
+    _saveResumeState();
+  }
 
-  if (_seenOther) {
+  if (_seenOther || _windowRequested) {
+    // Either someone else is going first, or the rest of our window is still on its way.
     _resetRetryTime();
   } else {
-    _nextRetryTime = millis();
+    _nextRetryTime = MeshClock::millis();
   }
   _checkUpdateComplete();
 }
 
+bool MeshSync::_receiveChunk(const uint8_t* chunk, size_t chunkLen) {
+  size_t oldOffset = _updateCurOffset;
+  if (_updateVerified) {
+    if (!_receiveVerifiedChunk(chunk, chunkLen)) {
+      return false;
+    }
+  } else {
+    bool res = receiveUpdateChunk(chunk, chunkLen);
+    if (!res) {
+      _updateStop("Receiving chunk failed");
+      return false;
+    }
+    _updateCurOffset += chunkLen;
+  }
+#if VERBOSE
+  Serial.printf(" %u+%d/u", oldOffset, chunkLen, _updateVersion.len);
+#endif
+
+  if (chunkLen == _updateChunkSize && _updateCurOffset == oldOffset + chunkLen) {
+    // Slide the window forward by one chunk.
+    _windowReceived >>= 1;
+    _windowRequested >>= 1;
+  } else {
+    // Chunk boundaries no longer line up with the window.
+    _windowReceived = 0;
+    _windowRequested = 0;
+  }
+  return true;
+}
+
+bool MeshSync::_receiveVerifiedChunk(const uint8_t* chunk, size_t chunkLen) {
+  auto receive = [this](const uint8_t* block, size_t blockLen) {
+    return receiveUpdateChunk(block, blockLen);
+  };
+  MeshSyncManifest::Result res = _updateManifest.write(_updateCurOffset, chunk, chunkLen, receive);
+  if (res == MeshSyncManifest::Result::FAILED) {
+    _updateStop("Receiving chunk failed");
+    return false;
+  }
+
+  // Continue from the start of the chunk holding the next byte the
+  // manifest needs, so requests stay aligned with our chunks.
+  _updateCurOffset = _updateManifest.streamOffset();
+  if (_updateChunkSize && _updateCurOffset != _updateVersion.len) {
+    _updateCurOffset -= _updateCurOffset % _updateChunkSize;
+  }
+
+  if (res == MeshSyncManifest::Result::CORRUPT) {
+    ++_corruptBlocks;
+    Serial.printf("Corrupt block received; requesting again from %u\n", unsigned(_updateCurOffset));
+    _windowReceived = 0;
+    _windowRequested = 0;
+    _rttPending = false;
+    _nextRetryTime = MeshClock::millis();
+    return false;
+  }
+  return true;
+}
+
+int MeshSync::_storeChunk(size_t offset, const uint8_t* chunk, size_t chunkLen) {
+  size_t end = offset + chunkLen;
+  if (end > _updateVersion.len) {
+    return 0;
+  }
+
+  // Providers with a different packet size may send chunks that
+  // don't line up with ours, so only count the chunks this one
+  // covers completely.
+  size_t first = (offset + _updateChunkSize - 1) / _updateChunkSize;
+  size_t last = (end == _updateVersion.len) ? _chunksReceived.size() : end / _updateChunkSize;
+  bool extendsPrefix = offset <= _updateCurOffset && end > _updateCurOffset;
+  bool newChunks = false;
+  for (size_t i = first; i < last; ++i) {
+    if (!_chunksReceived[i]) {
+      newChunks = true;
+      break;
+    }
+  }
+  if (!extendsPrefix && !newChunks) {
+    return 0;
+  }
+
+  if (!receiveUpdateChunkAt(offset, chunk, chunkLen)) {
+    _updateStop("Receiving chunk failed");
+    return -1;
+  }
+#if VERBOSE
+  Serial.printf(" %u+%d/u", offset, chunkLen, _updateVersion.len);
+#endif
+
+  for (size_t i = first; i < last; ++i) {
+    _chunksReceived[i] = true;
+  }
+
+  size_t oldOffset = _updateCurOffset;
+  if (extendsPrefix) {
+    _updateCurOffset = end;
+  }
+  while (_updateCurOffset < _updateVersion.len &&
+         _chunksReceived[_updateCurOffset / _updateChunkSize]) {
+    _updateCurOffset += _expectedChunkLen(_updateCurOffset);
+  }
+
+  if (oldOffset % _updateChunkSize == 0 && _updateCurOffset % _updateChunkSize == 0) {
+    size_t shift = (_updateCurOffset - oldOffset) / _updateChunkSize;
+    _windowRequested = shift >= 32 ? 0 : _windowRequested >> shift;
+    for (size_t i = 0; i != 32 && _updateCurOffset / _updateChunkSize + i < _chunksReceived.size();
+         ++i) {
+      if (_chunksReceived[_updateCurOffset / _updateChunkSize + i]) {
+        _windowRequested &= ~(uint32_t(1) << i);
+      }
+    }
+  } else {
+    _windowRequested = 0;
+  }
+  return 1;
+}
+
+bool MeshSync::_windowActive() const {
+  if (!_windowBuf && _chunksReceived.empty()) {
+    return false;
+  }
+  return _updateCurOffset % _updateChunkSize == 0;
+}
+
+bool MeshSync::_haveChunk(size_t idx) const {
+  if (!_chunksReceived.empty()) {
+    return _chunksReceived[_updateCurOffset / _updateChunkSize + idx];
+  }
+  return _windowReceived & (uint32_t(1) << idx);
+}
+
+size_t MeshSync::_expectedChunkLen(size_t offset) const {
+  assert(offset < _updateVersion.len);
+  size_t remaining = _updateVersion.len - offset;
+  return remaining < _updateChunkSize ? remaining : _updateChunkSize;
+}
+
+bool MeshSync::_bufferWindowChunk(size_t offset, const uint8_t* chunk, size_t chunkLen) {
+  if (!_windowBuf || !_windowActive() || offset <= _updateCurOffset ||
+      offset >= _updateVersion.len) {
+    return false;
+  }
+  if ((offset - _updateCurOffset) % _updateChunkSize) {
+    return false;
+  }
+  size_t idx = (offset - _updateCurOffset) / _updateChunkSize;
+  if (idx >= _updateWindowSize || chunkLen != _expectedChunkLen(offset)) {
+    return false;
+  }
+
+  uint32_t bit = uint32_t(1) << idx;
+  _windowRequested &= ~bit;
+  if (!(_windowReceived & bit)) {
+    size_t slot = (offset / _updateChunkSize) % _updateWindowSize;
+    memcpy(_windowBuf + slot * _updateChunkSize, chunk, chunkLen);
+    _windowReceived |= bit;
+  }
+  return true;
+}
+
+void MeshSync::_startChunkTracking() {
+  if (_updateChunkSize || !_chunkSize || !_updateInProgress) {
+    return;
+  }
+  _updateChunkSize = _chunkSize;
+  if (_updateBaseVersion >= 0) {
+    // Leave room to mark packets as being part of a delta.
+    _updateChunkSize -= 1 + sizeof(DeltaData);
+  }
+
+  if (_updateWindowSize > 1 && _updateFecGroupSize) {
+    // Leave room for the larger header on repair packets.
+    _updateChunkSize -= sizeof(RepairData) - sizeof(ProvideData);
+    size_t numGroups = (_updateWindowSize + _updateFecGroupSize - 1) / _updateFecGroupSize + 1;
+    _fecParity = (uint8_t*)malloc(numGroups * _updateChunkSize);
+    if (_fecParity) {
+      FecGroup unused;
+      unused.group = ~size_t(0);
+      unused.received = 0;
+      _fecGroups.assign(numGroups, unused);
+    }
+  }
+
+  if (_outOfOrderReceive && canReceiveOutOfOrder() && !_updateVerified) {
+    size_t numChunks = (_updateVersion.len + _updateChunkSize - 1) / _updateChunkSize;
+    _chunksReceived.assign(numChunks, false);
+    // Anything received in order before we knew the chunk size.
+    for (size_t i = 0; i != numChunks && (i + 1) * _updateChunkSize <= _updateCurOffset; ++i) {
+      _chunksReceived[i] = true;
+    }
+  } else if (_updateWindowSize > 1) {
+    _windowBuf = (uint8_t*)malloc(_updateWindowSize * _updateChunkSize);
+  }
+}
+
+void MeshSync::_stopChunkTracking() {
+  if (_windowBuf) {
+    free(_windowBuf);
+    _windowBuf = nullptr;
+  }
+  if (_fecParity) {
+    free(_fecParity);
+    _fecParity = nullptr;
+  }
+  _fecGroups.clear();
+  _fecGroups.shrink_to_fit();
+  _chunksReceived.clear();
+  _chunksReceived.shrink_to_fit();
+  _updateChunkSize = 0;
+  _windowReceived = 0;
+  _windowRequested = 0;
+}
+
 void MeshSync::_checkUpdateComplete() {
   assert(_updateCurOffset <= _updateVersion.len);
   assert(_updateInProgress);
   if (_updateCurOffset == _updateVersion.len) {
+    _clearResumeState();
+    _updateFailed = false;
+    onUpdateComplete();
+    _updateVerified = false;
+    _updateManifest.clear();
+    _updateInProgress = false;
+    _stopChunkTracking();
+    if (_updateFailed) {
+      // Still on our old version, so keep looking for the new one.
+      if (_updateStopHook) {
+        _updateStopHook("Unable to apply update");
+      } else {
+        Serial.println("Unable to apply update");
+      }
+      return;
+    }
+
     Serial.println("\nUpdate complete!");
     if (_updateStopHook) {
       _updateStopHook("Update complete");
     }
-    onUpdateComplete();
-    _updateInProgress = false;
     _seenNewerVersion = false;
     _seenThisOrOlderVersion = true;
+
+    if (_trickle) {
+      // Our version changed, so start over quickly.
+      _trickleIntervalMs = _trickleMinMs;
+      _trickleNewInterval(MeshClock::millis());
+    } else if (_flood) {
+      // Pass it on soon, but not at the same time as our neighbors.  If
+      // we can't hear enough other neighbors to stay quiet, as at the
+      // edge of a sparse mesh, waiting would only slow it down.
+      _floodPending = true;
+      _floodCopies = 0;
+      _nextAdvertiseTime = MeshClock::millis();
+      if (_recentNeighbors() > _floodRedundancy) {
+        _nextAdvertiseTime += MeshClock::random(0, _floodDelayMs);
+      }
+    }
   }
 }
 
 int MeshSync::sendIfNeeded(uint8_t* dst, uint8_t* pkt, size_t maxlen) {
   if (!_startTime) {
-    _startTime = millis();
+    _startTime = MeshClock::millis();
+  }
+  if (maxlen > 1 + sizeof(ProvideData)) {
+    _chunkSize = maxlen - 1 - sizeof(ProvideData);
   }
   if (_updateInProgress) {
+    _startChunkTracking();
     return _sendRequestIfNeeded(dst, pkt, maxlen);
   }
 
@@ -229,95 +973,547 @@ int MeshSync::sendIfNeeded(uint8_t* dst, uint8_t* pkt, size_t maxlen) {
   return -1;
 }
 
-void MeshSync::_resetRetryTime() { _nextRetryTime = millis() + random(_retryMs, _retryMs * 2); }
+void MeshSync::_noteUpdateSource(const uint8_t* srcaddr, int baseVersion) {
+  UpdateSource* oldest = nullptr;
+  for (UpdateSource& source : _updateSources) {
+    if (memcmp(source.eth, srcaddr, ETH_ADDR_LEN) == 0) {
+      if (source.baseVersion < 0 || baseVersion == _updateBaseVersion) {
+        // If it has both streams, remember that it has the one we're receiving.
+        source.baseVersion = baseVersion;
+      }
+      source.lastHeard = MeshClock::millis();
+      return;
+    }
+    if (!oldest || timeIsAfter(oldest->lastHeard, source.lastHeard)) {
+      oldest = &source;
+    }
+  }
+
+  if (_updateSources.size() < MAX_UPDATE_SOURCES) {
+    _updateSources.emplace_back();
+    oldest = &_updateSources.back();
+  }
+  memcpy(oldest->eth, srcaddr, ETH_ADDR_LEN);
+  oldest->baseVersion = baseVersion;
+  oldest->lastHeard = MeshClock::millis();
+}
+
+void MeshSync::_noteRequester(const uint8_t* srcaddr) {
+  Requester* oldest = nullptr;
+  for (Requester& requester : _requesters) {
+    if (memcmp(requester.eth, srcaddr, ETH_ADDR_LEN) == 0) {
+      requester.lastHeard = MeshClock::millis();
+      return;
+    }
+    if (!oldest || timeIsAfter(oldest->lastHeard, requester.lastHeard)) {
+      oldest = &requester;
+    }
+  }
+
+  if (_requesters.size() < MAX_REQUESTERS) {
+    _requesters.emplace_back();
+    oldest = &_requesters.back();
+  }
+  memcpy(oldest->eth, srcaddr, ETH_ADDR_LEN);
+  oldest->lastHeard = MeshClock::millis();
+}
+
+void MeshSync::_noteNeighbor(const uint8_t* srcaddr) {
+  Requester* oldest = nullptr;
+  for (Requester& neighbor : _neighbors) {
+    if (memcmp(neighbor.eth, srcaddr, ETH_ADDR_LEN) == 0) {
+      neighbor.lastHeard = MeshClock::millis();
+      return;
+    }
+    if (!oldest || timeIsAfter(oldest->lastHeard, neighbor.lastHeard)) {
+      oldest = &neighbor;
+    }
+  }
+
+  if (_neighbors.size() < MAX_NEIGHBORS) {
+    _neighbors.emplace_back();
+    oldest = &_neighbors.back();
+  }
+  memcpy(oldest->eth, srcaddr, ETH_ADDR_LEN);
+  oldest->lastHeard = MeshClock::millis();
+}
+
+size_t MeshSync::_recentNeighbors() const {
+  // Everyone advertises at least every 2 * _advertiseMs.
+  size_t count = 0;
+  for (const Requester& neighbor : _neighbors) {
+    count += MeshClock::millis() - neighbor.lastHeard <= 2 * _advertiseMs;
+  }
+  return count;
+}
+
+void MeshSync::_requestDst(uint8_t* dst) const {
+  if (_unicast) {
+    memcpy(dst, _updateEth, ETH_ADDR_LEN);
+  } else {
+    memset(dst, 0xff, ETH_ADDR_LEN);
+  }
+}
+
+void MeshSync::_provideDst(uint8_t* dst) const {
+  memset(dst, 0xff, ETH_ADDR_LEN);  // broadcast update to everyone
+  if (!_unicast) {
+    return;
+  }
+
+  // A requester that's still waiting for data will ask again within the longest retry interval.
+  const Requester* only = nullptr;
+  for (const Requester& requester : _requesters) {
+    if (MeshClock::millis() - requester.lastHeard > std::max(_retryMs, _maxRetryMs)) {
+      continue;
+    }
+    if (only) {
+      // Several nodes want data; let them all hear it.
+      return;
+    }
+    only = &requester;
+  }
+  if (only) {
+    memcpy(dst, only->eth, ETH_ADDR_LEN);
+  }
+}
+
+bool MeshSync::_failover() {
+  // Only consider sources that have advertised recently enough that they're probably still around.
+  uint32_t maxAge = 2 * _advertiseMs;
+  const UpdateSource* alt = nullptr;
+  bool fullAvailable = false;
+  for (const UpdateSource& source : _updateSources) {
+    if (MeshClock::millis() - source.lastHeard > maxAge) {
+      continue;
+    }
+    if (source.baseVersion != _updateBaseVersion) {
+      fullAvailable |= source.baseVersion < 0;
+      continue;
+    }
+    if (memcmp(source.eth, _updateEth, ETH_ADDR_LEN) == 0) {
+      continue;
+    }
+    if (!alt || timeIsAfter(source.lastHeard, alt->lastHeard)) {
+      alt = &source;
+    }
+  }
+
+  if (alt) {
+    Serial.printf("Update source %s stalled; switching to %s\n", etherToString(_updateEth).c_str(),
+                  etherToString(alt->eth).c_str());
+    memcpy(_updateEth, alt->eth, ETH_ADDR_LEN);
+    ++_failovers;
+    // Give the new source its own chance before failing over again, and
+    // ask it for everything we're missing.  _retryCount keeps counting,
+    // so sources that all stall still use up _maxRetries.
+    _sourceRetryCount = 1;
+    _windowRequested = 0;
+    return true;
+  }
+
+  if (_updateBaseVersion >= 0 && fullAvailable) {
+    // Nobody's left with the delta, so get the full version instead.
+    _updateStop("Delta source stalled; waiting for full version");
+    return false;
+  }
+
+  if (_newerVersionSeen && MeshClock::millis() - _newerVersionTime <= maxAge) {
+    // Our sources have probably moved on to the newer version.
+    _updateStop("Update source stalled; waiting for newer version");
+    return false;
+  }
+
+  return true;
+}
+
+void MeshSync::_resetRetryTime() {
+  uint32_t interval = _rttIntervalMs();
+  for (uint8_t i = 0; i != _retryBackoff && interval < _maxRetryMs; ++i) {
+    interval *= 2;
+  }
+  if (_adaptiveRetry && interval > _maxRetryMs) {
+    // Only bound intervals we computed, not one set with retryMs.
+    interval = _maxRetryMs;
+  }
+  _nextRetryTime = MeshClock::millis() + MeshClock::random(interval, interval * 2);
+}
+
+uint32_t MeshSync::_rttIntervalMs() const {
+  if (!_adaptiveRetry || !_rttSamples) {
+    return _retryMs;
+  }
+  return _rto;
+}
+
+void MeshSync::_rttSample(uint32_t rtt) {
+  ++_rttSamples;
+  if (_rttSamples == 1) {
+    _srtt8 = rtt << 3;
+    _rttvar4 = rtt << 1;
+  } else {
+    // Jacobson/Karels: srtt += (rtt - srtt) / 8, rttvar += (|rtt - srtt| - rttvar) / 4
+    int32_t err = int32_t(rtt) - int32_t(_srtt8 >> 3);
+    _srtt8 += err;
+    uint32_t absErr = err < 0 ? -err : err;
+    _rttvar4 = _rttvar4 + absErr - (_rttvar4 >> 2);
+  }
+
+  // Retry after the smoothed round trip time plus 4 times its mean deviation.
+  _rto = (_srtt8 >> 3) + _rttvar4;
+  if (_rto < _minRetryMs) {
+    _rto = _minRetryMs;
+  }
+  if (_rto > _maxRetryMs) {
+    _rto = _maxRetryMs;
+  }
+}
+
+MeshSync::RttStats MeshSync::rttStats() const {
+  RttStats stats;
+  stats.srttMs = _srtt8 >> 3;
+  stats.rttvarMs = _rttvar4 >> 2;
+  stats.retryMs = _rttIntervalMs();
+  stats.samples = _rttSamples;
+  stats.backoff = _retryBackoff;
+  return stats;
+}
+
+void MeshSync::onSendStatus(const uint8_t* dst, bool success) {
+  if (success || !_updateInProgress || memcmp(dst, _updateEth, ETH_ADDR_LEN)) {
+    return;
+  }
+  if (_linkRetries == MAX_LINK_RETRIES) {
+    // Leave it to the retry timer.
+    return;
+  }
+  // Our request didn't reach the node providing the update, so there's
+  // no point waiting for an answer.
+  ++_linkRetries;
+  _linkRetryPending = true;
+  _nextRetryTime = MeshClock::millis();
+}
 
 int MeshSync::_sendRequestIfNeeded(uint8_t* dst, uint8_t* pkt, size_t maxlen) {
-  if (timeIsAfter(millis(), _nextRetryTime)) {
-    ++_retryCount;
-    if (_retryCount > _maxRetries) {
-      _updateStop("Retries exceeded");
-      return -1;
+  if (timeIsAfter(MeshClock::millis(), _nextRetryTime)) {
+    if (_linkRetryPending) {
+      // Resending a request the link didn't deliver, which isn't a retry.
+      _linkRetryPending = false;
+      _rttPending = false;
+    } else {
+      _linkRetries = 0;
+      ++_retryCount;
+      ++_sourceRetryCount;
+      if (_failoverRetries && _sourceRetryCount > _failoverRetries && !_failover()) {
+        return -1;
+      }
+      if (_retryCount > _maxRetries) {
+        _updateStop("Retries exceeded");
+        return -1;
+      }
+      if (_adaptiveRetry && _sourceRetryCount > 1 && !_seenOther &&
+          _retryBackoff < MAX_RETRY_BACKOFF) {
+        // Our last request went unanswered; back off in case the network is congested.
+        ++_retryBackoff;
+      }
+
+      // Only time requests that aren't retries, since we can't tell which
+      // of several requests a response is for.
+      _rttPending = _sourceRetryCount == 1;
+      _rttRequestTime = MeshClock::millis();
+      _rttRequestOffset = _updateCurOffset;
+      _rttRequestEnd = _updateCurOffset + 1;
     }
     _resetRetryTime();
     _seenOther = false;
 
-    assert(maxlen >= 1 + sizeof(RequestData));
+    if (_updateWindowSize > 1) {
+      int res = _sendWindowRequest(dst, pkt, maxlen);
+      if (res > 0) {
+        return res;
+      }
+    }
 
-    // memcpy(dst, _updateEth, ETH_ADDR_LEN);
-    memset(dst, 0xff, ETH_ADDR_LEN);
+    assert(maxlen >= MAX_OP_LEN + sizeof(RequestData));
+
+    _requestDst(dst);
 
     RequestData req;
     req.version = _updateVersion.version;
     req.offset = _updateCurOffset;
-    pkt[0] = int(Op::REQUEST);
-    memcpy(pkt + 1, &req, sizeof(RequestData));
+    size_t opLen = _writeOp(pkt, Op::REQUEST, _updateBaseVersion);
+    memcpy(pkt + opLen, &req, sizeof(RequestData));
 
-    return 1 + sizeof(RequestData);
+    return opLen + sizeof(RequestData);
   }
 
   return -1;
 }
 
+int MeshSync::_sendWindowRequest(uint8_t* dst, uint8_t* pkt, size_t maxlen) {
+  if (!_windowActive()) {
+    // Fall back to requesting a single chunk.
+    return -1;
+  }
+
+  assert(maxlen >= MAX_OP_LEN + sizeof(WindowRequestData));
+  assert(_updateCurOffset < _updateVersion.len);
+
+  size_t numChunks =
+      (_updateVersion.len - _updateCurOffset + _updateChunkSize - 1) / _updateChunkSize;
+  if (numChunks > _updateWindowSize) {
+    numChunks = _updateWindowSize;
+  }
+
+  _requestDst(dst);
+
+  WindowRequestData req;
+  req.version = _updateVersion.version;
+  req.offset = _updateCurOffset;
+  req.chunkSize = _updateChunkSize;
+  req.fecGroupSize = _fecParity ? _updateFecGroupSize : 0;
+  req.missing = 0;
+  for (size_t i = 0; i != numChunks; ++i) {
+    if (!_haveChunk(i)) {
+      req.missing |= uint32_t(1) << i;
+    }
+  }
+  _windowRequested = req.missing;
+  _rttRequestEnd = _updateCurOffset + numChunks * _updateChunkSize;
+  size_t opLen = _writeOp(pkt, Op::REQUEST_WINDOW, _updateBaseVersion);
+  memcpy(pkt + opLen, &req, sizeof(WindowRequestData));
+
+  return opLen + sizeof(WindowRequestData);
+}
+
 int MeshSync::_sendProvideIfNeeded(uint8_t* dst, uint8_t* pkt, size_t maxlen) {
-  if (!_dataRequested) {
+  if (!_dataRequested && !_provideWindowMissing && !_provideRepairPending) {
     return -1;
   }
 
   if (_updateInProgress) {
     _dataRequested = false;
+    _provideWindowMissing = 0;
+    _provideRepairPending = false;
+    return -1;
+  }
+
+  if (!timeIsAfter(MeshClock::millis(), _nextProvideTime)) {
+    return -1;
+  }
+  _nextProvideTime = MeshClock::millis();
+
+  if (_dataRequested) {
+    _dataRequested = false;
+    return _provideChunk(dst, pkt, maxlen, _provideRequestBase, _maxRequestedOffset, maxlen);
+  }
+
+  if (_provideRepairPending) {
+    _provideRepairPending = false;
+    return _provideRepair(dst, pkt, maxlen);
+  }
+
+  // Stream the next chunk of the requested window.
+  int idx = __builtin_ctz(_provideWindowMissing);
+  _provideWindowMissing &= ~(uint32_t(1) << idx);
+  size_t offset = _provideWindowOffset + idx * size_t(_provideWindowChunkSize);
+  if (offset >= _localStreamLen(_provideWindowBase)) {
     return -1;
   }
 
-  if (!timeIsAfter(millis(), _nextProvideTime)) {
+  if (_provideWindowFecGroupSize && _provideWindowOffset % _provideWindowChunkSize == 0) {
+    // Follow the last chunk we're sending from each group with a repair packet.
+    size_t groupBytes = size_t(_provideWindowFecGroupSize) * _provideWindowChunkSize;
+    size_t groupOffset = offset - offset % groupBytes;
+    bool lastInGroup = true;
+    if (_provideWindowMissing) {
+      size_t nextOffset = _provideWindowOffset +
+                          __builtin_ctz(_provideWindowMissing) * size_t(_provideWindowChunkSize);
+      lastInGroup = nextOffset >= groupOffset + groupBytes;
+    }
+    if (lastInGroup) {
+      _provideRepairPending = true;
+      _provideRepairBase = _provideWindowBase;
+      _provideRepairOffset = groupOffset;
+      _provideRepairChunkSize = _provideWindowChunkSize;
+      _provideRepairGroupSize = _provideWindowFecGroupSize;
+    }
+  }
+  return _provideChunk(dst, pkt, maxlen, _provideWindowBase, offset, _provideWindowChunkSize);
+}
+
+int MeshSync::_provideRepair(uint8_t* dst, uint8_t* pkt, size_t maxlen) {
+  size_t streamLen = _localStreamLen(_provideRepairBase);
+  size_t opLen = _writeOp(pkt, Op::REPAIR, _provideRepairBase);
+  if (opLen + sizeof(RepairData) + _provideRepairChunkSize > maxlen) {
+    // Doesn't fit in our packets; the requester will have to ask again for anything lost.
     return -1;
   }
-  _nextProvideTime = millis();
 
-  assert(maxlen >= 1 + sizeof(ProvideData));
-  pkt[0] = int(Op::PROVIDE);
+  _provideDst(dst);
 
-  memset(dst, 0xff, 6);  // broadcast update to everyone
+  RepairData rep;
+  rep.version = _localVersion.version;
+  rep.offset = _provideRepairOffset;
+  rep.chunkSize = _provideRepairChunkSize;
+  rep.groupSize = _provideRepairGroupSize;
+  memcpy(pkt + opLen, &rep, sizeof(RepairData));
+
+  // XOR together each chunk of the group, as if they were all padded to a full chunk.
+  uint8_t* parity = pkt + opLen + sizeof(RepairData);
+  memset(parity, 0, _provideRepairChunkSize);
+  size_t parityLen = 0;
+  for (size_t i = 0; i != _provideRepairGroupSize; ++i) {
+    size_t chunkOffset = rep.offset + i * _provideRepairChunkSize;
+    if (chunkOffset >= streamLen) {
+      break;
+    }
+    size_t chunkLen = streamLen - chunkOffset;
+    if (chunkLen > _provideRepairChunkSize) {
+      chunkLen = _provideRepairChunkSize;
+    }
+    if (chunkLen > parityLen) {
+      parityLen = chunkLen;
+    }
+
+    // Read a piece at a time so we don't need a whole chunk of buffer space.
+    uint8_t piece[32];
+    for (size_t pos = 0; pos < chunkLen; pos += sizeof(piece)) {
+      size_t pieceLen = chunkLen - pos;
+      if (pieceLen > sizeof(piece)) {
+        pieceLen = sizeof(piece);
+      }
+      if (!_provideStreamChunk(_provideRepairBase, chunkOffset + pos, piece, pieceLen)) {
+        Serial.printf("Unable to gather update chunk at %d\n", int(chunkOffset + pos));
+        return -1;
+      }
+      for (size_t j = 0; j != pieceLen; ++j) {
+        parity[pos + j] ^= piece[j];
+      }
+    }
+  }
+
+  return opLen + sizeof(RepairData) + parityLen;
+}
+
+int MeshSync::_provideChunk(uint8_t* dst, uint8_t* pkt, size_t maxlen, int baseVersion,
+                            size_t offset, size_t chunkSize) {
+  assert(maxlen >= MAX_OP_LEN + sizeof(ProvideData));
+  size_t streamLen = _localStreamLen(baseVersion);
+  size_t opLen = _writeOp(pkt, Op::PROVIDE, baseVersion);
+
+  _provideDst(dst);
 
   ProvideData provide;
   provide.version = _localVersion.version;
-  provide.offset = _maxRequestedOffset;
-  memcpy(pkt + 1, &provide, sizeof(ProvideData));
+  provide.offset = offset;
+  memcpy(pkt + opLen, &provide, sizeof(ProvideData));
 
-  size_t chunkSize = maxlen - 1 - sizeof(ProvideData);
-  if (provide.offset + chunkSize > _localVersion.len) {
-    assert(provide.offset < _localVersion.len);
-    chunkSize = _localVersion.len - provide.offset;
+  if (chunkSize > maxlen - opLen - sizeof(ProvideData)) {
+    chunkSize = maxlen - opLen - sizeof(ProvideData);
+  }
+  if (provide.offset + chunkSize > streamLen) {
+    assert(provide.offset < streamLen);
+    chunkSize = streamLen - provide.offset;
   }
 
-  _dataRequested = false;
-
-  bool res = provideUpdateChunk(provide.offset, pkt + 1 + sizeof(ProvideData), chunkSize);
+  uint8_t* chunk = pkt + opLen + sizeof(ProvideData);
+  bool res = _provideStreamChunk(baseVersion, provide.offset, chunk, chunkSize);
   if (!res) {
-    Serial.printf("Unable to gather update chunk at %d\n", _maxRequestedOffset);
+    Serial.printf("Unable to gather update chunk at %d\n", provide.offset);
     return -1;
   }
 
   if (_transmitProgressHook) {
-    _transmitProgressHook(provide.offset, _localVersion.len);
+    _transmitProgressHook(provide.offset, streamLen);
   }
 
-  return 1 + sizeof(ProvideData) + chunkSize;
+  return opLen + sizeof(ProvideData) + chunkSize;
+}
+
+void MeshSync::trickle(bool enable) {
+  _trickle = enable;
+  // Start from the minimum interval at the next advertisement.
+  _trickleIntervalMs = 0;
+}
+
+void MeshSync::_trickleNewInterval(uint32_t now) {
+  _trickleCopies = 0;
+  _trickleIntervalEnd = now + _trickleIntervalMs;
+  _nextAdvertiseTime = now + MeshClock::random(_trickleIntervalMs / 2, _trickleIntervalMs);
+}
+
+void MeshSync::_trickleReset(uint32_t now) {
+  if (_trickleIntervalMs == _trickleMinMs) {
+    // Already advertising as often as we can.
+    return;
+  }
+  _trickleIntervalMs = _trickleMinMs;
+  _trickleNewInterval(now);
 }
 
 int MeshSync::_sendAdvertiseIfNeeded(uint8_t* dst, uint8_t* pkt, size_t maxlen) {
-  if (timeIsAfter(millis(), _nextAdvertiseTime)) {
-    _nextAdvertiseTime = millis() + random(_advertiseMs, 2 * _advertiseMs);
-    pkt[0] = int(Op::ADVERTISE);
+  if (_trickle && !_deltaAdvertised) {
+    uint32_t now = MeshClock::millis();
+    if (!_trickleIntervalMs) {
+      _trickleIntervalMs = _trickleMinMs;
+      _trickleNewInterval(now);
+    } else if (timeIsAfter(now, _trickleIntervalEnd)) {
+      _trickleIntervalMs = std::min(2 * _trickleIntervalMs, _trickleMaxMs);
+      _trickleNewInterval(now);
+    }
+  }
+  if (timeIsAfter(MeshClock::millis(), _nextAdvertiseTime)) {
+    if (_trickle && !_deltaAdvertised && _trickleCopies >= _trickleRedundancy) {
+      // Enough neighbors have advertised our version this interval.
+      ++_advertisementsSuppressed;
+      _nextAdvertiseTime = _trickleIntervalEnd;
+      return -1;
+    }
+    AdvertiseData adv = _localVersion;
+    int baseVersion = provideDeltaBase();
+    if (baseVersion >= 0 && !_deltaAdvertised) {
+      // Offer the delta first, so nodes that can use it don't start a full transfer.
+      _deltaAdvertised = true;
+      adv.len = provideDeltaLen();
+    } else {
+      _deltaAdvertised = false;
+      _floodPending = false;
+      baseVersion = -1;
+      if (_trickle) {
+        // Nothing more until the next interval.
+        _nextAdvertiseTime = _trickleIntervalEnd;
+      } else {
+        _nextAdvertiseTime =
+            MeshClock::millis() + MeshClock::random(_advertiseMs, 2 * _advertiseMs);
+      }
+    }
+
+    size_t opLen = _writeOp(pkt, Op::ADVERTISE, baseVersion);
+    size_t hdrLen = opLen + sizeof(AdvertiseData);
+    if (baseVersion < 0 && _manifestBlockSize) {
+      if (!_buildLocalManifest()) {
+        return -1;
+      }
+      adv.len = _localManifest.streamLen();
+      ManifestData manifest;
+      manifest.root = _localManifest.root();
+      manifest.blockSize = _localManifest.blockSize();
+      manifest.dataLen = _localManifest.dataLen();
+      assert(maxlen >= hdrLen + sizeof(ManifestData));
+      memcpy(pkt + hdrLen, &manifest, sizeof(ManifestData));
+      hdrLen += sizeof(ManifestData);
+    }
+
     memset(dst, 0xff, 6);  // broadcast to everyone!
-    assert(maxlen >= 1 + sizeof(AdvertiseData));
-    memcpy(pkt + 1, &_localVersion, sizeof(AdvertiseData));
+    assert(maxlen >= hdrLen);
+    memcpy(pkt + opLen, &adv, sizeof(AdvertiseData));
 
-    size_t maxMetadata = maxlen - 1 - sizeof(AdvertiseData);
-    int metalen = provideUpdateMetadata(pkt + 1 + sizeof(AdvertiseData), maxMetadata);
+    int metalen = provideUpdateMetadata(pkt + hdrLen, maxlen - hdrLen);
     if (metalen < 0) {
       return -1;
     }
-    return 1 + sizeof(AdvertiseData) + metalen;
+    return hdrLen + metalen;
   }
 
   return -1;
@@ -330,12 +1526,21 @@ void MeshSync::updateVersion(int newLocalVersion, size_t newLocalSize) {
 
   // Don't serve old data
   _dataRequested = false;
+  _provideWindowMissing = 0;
+  _provideRepairPending = false;
+  _deltaAdvertised = false;
+  _floodPending = false;
+  _localManifestBuilt = false;
 
   _localVersion.version = newLocalVersion;
   _localVersion.len = newLocalSize;
 
+  if (_trickle) {
+    _trickleIntervalMs = _trickleMinMs;
+    _trickleNewInterval(MeshClock::millis());
+  }
   // Advertise right away that we have a new version.o
-  _nextAdvertiseTime = millis();
+  _nextAdvertiseTime = MeshClock::millis();
 
   Serial.printf("Updated to version %u, size=%u\n", newLocalVersion, newLocalSize);
 }
@@ -3,27 +3,189 @@
 
 #include <functional>
 
+#include "MeshSyncManifest.h"
+#include "MeshSyncResume.h"
 #include "ProtoDispatch.h"
 
 class MeshSync : public ProtoDispatchTarget {
  public:
+  ~MeshSync() override;
+
   // Sets the number of milliseconds between retries.  The actual
   // interval will be a random interval between 1 and 2 times this
   // number to avoid synchronization issues.
+  //
+  // With adaptive retries, this is only used until the round trip
+  // time of the update in progress has been measured.
   void retryMs(uint32_t ms) { _retryMs = ms; }
 
+  // If enabled, the retry interval is estimated from the measured
+  // round trip time between sending a request and receiving the
+  // requested data, the same way TCP estimates its retransmission
+  // timeout.  While requests go unanswered, the interval doubles with
+  // each retry.  The estimated interval is kept between minMs and
+  // maxMs.  Disabled by default.
+  void adaptiveRetry(bool enable) { _adaptiveRetry = enable; }
+  void retryLimitsMs(uint32_t minMs, uint32_t maxMs) {
+    _minRetryMs = minMs;
+    _maxRetryMs = maxMs;
+  }
+
+  struct RttStats {
+    // Smoothed round trip time and its mean deviation.
+    uint32_t srttMs;
+    uint32_t rttvarMs;
+    // Current retry interval, before backoff and randomization.
+    uint32_t retryMs;
+    // Number of round trips measured during the current or most recent update.
+    uint32_t samples;
+    // The retry interval is currently multiplied by 2^backoff.
+    uint8_t backoff;
+  };
+  RttStats rttStats() const;
+
   // Sets the number of milliseconds between advertisements.  The
   // actual interval will be a random interval between 1 and 2 times
   // this number to avoid synchronization issues.
   void advertiseMs(uint32_t ms) { _advertiseMs = ms; }
 
+  // If enabled, a newer version received from another node is passed
+  // on after a random delay of up to floodDelayMs instead of right
+  // away, and isn't passed on at all if floodRedundancy neighbors are
+  // overheard advertising it first.  Nodes in range of each other then
+  // don't all rebroadcast every change at once, while changes still
+  // cross the mesh a hop at a time without waiting for the next
+  // regular advertisement.  Meant for small objects like
+  // MeshSyncStruct.  Disabled by default.
+  //
+  // This only saves frames where many nodes are in range of each
+  // other.  In a sparse mesh, like a grid, nearly every node has to
+  // pass a change on anyway, and the delay makes it cross a little
+  // more slowly than without flooding.  Nodes that have heard no more
+  // than floodRedundancy neighbors don't wait.
+  void flood(bool enable) { _flood = enable; }
+  void floodDelayMs(uint32_t ms) { _floodDelayMs = ms; }
+  void floodRedundancy(uint8_t copies) { _floodRedundancy = copies; }
+
+  // Number of times we didn't pass on a newer version because enough neighbors already had.
+  uint32_t floodsSuppressed() const { return _floodsSuppressed; }
+
+  // If enabled, advertisements are timed with the Trickle algorithm
+  // (RFC 6206) instead of every advertiseMs.  The advertisement
+  // interval starts at minMs and doubles up to maxMs each time it
+  // passes without anything new, and an advertisement is skipped if
+  // trickleRedundancy neighbors have already advertised our version
+  // during the interval.  Hearing an older or newer version, or
+  // getting a new one, drops the interval back to minMs.  Once
+  // neighbors agree, each neighborhood sends about trickleRedundancy
+  // advertisements every maxMs, while changes still spread within a
+  // few multiples of minMs per hop.  Disabled by default.
+  void trickle(bool enable);
+  void trickleLimitsMs(uint32_t minMs, uint32_t maxMs) {
+    _trickleMinMs = minMs;
+    _trickleMaxMs = maxMs;
+  }
+  void trickleRedundancy(uint8_t copies) { _trickleRedundancy = copies; }
+
+  // Number of advertisements skipped because enough neighbors had sent the same one.
+  uint32_t advertisementsSuppressed() const { return _advertisementsSuppressed; }
+
   // Sets the number of milliseconds to initially wait for an upgrade
   // upon startup before setting _upToDate.
   void initialUpgradeMs(uint32_t ms) { _initialUpgradeMs = ms; }
 
-  // Sets maximum number of retries before giving up.
+  // Sets maximum number of retries without progress before giving up.
+  // Retries to every source count, so failing over doesn't reset this.
   void maxRetries(uint32_t retries) { _maxRetries = retries; }
 
+  // Sets the number of retries without progress after which the
+  // source of an update is considered stalled.  At that point, if
+  // another node has recently advertised the same update, requests
+  // are redirected to it without restarting the transfer.  Otherwise,
+  // if the update can't be finished as started (a delta nobody else
+  // has, or a version everyone else has moved on from), it's stopped
+  // early so the next advertisement can start a better one.  0
+  // disables failover.
+  void failoverRetries(uint32_t retries) { _failoverRetries = retries; }
+
+  // Number of times an update in progress has switched to a different source.
+  uint32_t failovers() const { return _failovers; }
+
+  // If enabled, requests are sent only to the node providing the
+  // update, and data is sent only to the node requesting it when
+  // there's just one.  Unicast frames are acknowledged and retried by
+  // the radio, and the dispatcher reports when they aren't delivered
+  // so they can be resent right away.  When several nodes are
+  // requesting data, it's still broadcast so they can all use it.
+  // Other nodes can't overhear unicast frames, so this should be
+  // enabled on all nodes or none.  Disabled by default.
+  void unicast(bool enable) { _unicast = enable; }
+
+  // Sets the number of chunks to request at once when receiving an
+  // update.  With a window of 1 (the default), each chunk is
+  // requested and acknowledged individually.  With a larger window,
+  // the provider streams the whole window back to back and only
+  // missing chunks are requested again.
+  //
+  // Out-of-order chunks are buffered in RAM, so this costs up to
+  // windowSize chunks of memory during an update.  Receivers with
+  // slow storage can keep the window small to limit how much the
+  // provider sends before waiting for them.  Takes effect at the start
+  // of the next update.  Nodes providing updates must be running a
+  // version that understands windowed requests.
+  void windowSize(uint8_t chunks);
+  static constexpr uint8_t MAX_WINDOW_SIZE = 32;
+
+  // If the subclass supports it (see canReceiveOutOfOrder), keep
+  // track of which chunks have been received and store any chunk of
+  // the version being received, including chunks overheard while
+  // they're provided to other nodes.  This helps most when receivers
+  // start an update at different times, since late ones can use what
+  // was sent to the others.  Disabled by default.  Takes effect at the
+  // start of the next update.
+  void outOfOrderReceive(bool enable) { _outOfOrderReceive = enable; }
+
+  // When receiving with a window larger than 1, asks the provider to
+  // follow each group of this many chunks with a repair packet
+  // holding their XOR.  That lets us rebuild any one lost chunk per
+  // group without requesting it again, at the cost of one extra
+  // packet per group (a code rate of groupSize / (groupSize + 1)).
+  // Smaller groups recover from more loss but cost more airtime.  0
+  // (the default) disables repair packets.  Takes effect at the start
+  // of the next update.
+  void fecGroupSize(uint8_t chunks);
+  static constexpr uint8_t MAX_FEC_GROUP_SIZE = 32;
+  // Number of lost chunks rebuilt from repair packets instead of
+  // being requested again.
+  uint32_t chunksRepaired() const { return _chunksRepaired; }
+
+  // An aborted update resumes where it left off if the same update
+  // is started again (see resumeUpdate).  If a store is given, how far
+  // the update got is also saved to it every checkpointBytes bytes, so
+  // it can be resumed after a reboot.
+  void resumeStore(MeshSyncResumeStore* store, size_t checkpointBytes = 4096) {
+    _resumeStore = store;
+    _resumeCheckpointBytes = checkpointBytes;
+  }
+
+  // If nonzero, full updates are sent along with a checksum of each
+  // block of this many bytes, and a checksum of those checksums is
+  // added to the advertisement (see MeshSyncManifest).  Each block is
+  // checked as soon as it's received, and only passed on to
+  // receiveUpdateChunk once it's been verified; a corrupted block is
+  // requested again right away instead of being discovered after the
+  // whole update.  Since only verified data is passed on, a resumed
+  // update continues from trusted data.
+  //
+  // Verified updates are received in order, buffering one block in
+  // RAM.  This changes the advertisement format, so all nodes syncing
+  // this data must agree on the block size being nonzero.  0 (the
+  // default) disables checksums.  Must be set before data is provided.
+  void manifestBlockSize(size_t bytes);
+
+  // Number of received blocks that didn't match their checksums.
+  uint32_t corruptBlocks() const { return _corruptBlocks; }
+
   int localVersion() const { return _localVersion.version; }
   size_t localSize() const { return _localVersion.len; }
 
@@ -49,7 +211,31 @@ class MeshSync : public ProtoDispatchTarget {
   // Returns false if update should be aborted.
   virtual bool receiveUpdateChunk(const uint8_t* /* chunk */, size_t /* chunklen */) { abort(); };
 
+  // Subclasses that can store chunks at arbitrary offsets should
+  // return true here and implement receiveUpdateChunkAt.  If
+  // outOfOrderReceive is enabled, chunks are then delivered to
+  // receiveUpdateChunkAt in whatever order they arrive instead of in
+  // order to receiveUpdateChunk.  The same range may be delivered more
+  // than once.
+  virtual bool canReceiveOutOfOrder() const { return false; }
+
+  // Returns false if update should be aborted.
+  virtual bool receiveUpdateChunkAt(size_t /* offset */, const uint8_t* /* chunk */,
+                                    size_t /* chunklen */) {
+    abort();
+  }
+
+  // Called after startUpdate or startDeltaUpdate.  offset is the
+  // number of bytes at the start of this update received by an
+  // earlier attempt that was aborted, or 0 if there wasn't one.
+  // Returns how many of those are still stored, and don't need to be
+  // received again; this must not be more than offset.
+  virtual size_t resumeUpdate(size_t /* offset */) { return 0; }
+
   virtual void onUpdateAbort() {}
+  // Called once every chunk has been received.  If the update can't be
+  // applied (e.g. it doesn't decompress), call updateFailed() from
+  // here; we then stay on the local version and get the update again.
   virtual void onUpdateComplete() {}
 
   // For sending updates.  Provides the given chunk.  Does not need to
@@ -62,6 +248,30 @@ class MeshSync : public ProtoDispatchTarget {
   // Provides additional metadata to be included with the advertise message.
   virtual int provideUpdateMetadata(uint8_t* /* metadata */, size_t /* maxlen */) { return 0; }
 
+  // Delta updates.  A subclass that can describe its local version as
+  // a patch against an older version returns that version's number
+  // from provideDeltaBase, along with the patch's length and
+  // contents.  Such a patch is advertised alongside the full version;
+  // nodes that have exactly the base version may then fetch the patch
+  // instead of the whole thing.  Returns -1 if no delta is available.
+  virtual int provideDeltaBase() const { return -1; }
+  virtual size_t provideDeltaLen() const { return 0; }
+  virtual bool provideDeltaChunk(size_t /* offset */, uint8_t* /* chunk */,
+                                 size_t /* size of chunk */) {
+    abort();
+  }
+
+  // Starts receiving a patch of deltaLen bytes that turns our local
+  // version (baseVersion) into newVersion.  The patch is then
+  // delivered through the same receiveUpdateChunk/receiveUpdateChunkAt
+  // calls as a full update.  Returns false to ignore the delta and
+  // wait for the full version instead.
+  virtual bool startDeltaUpdate(size_t /* deltaLen */, int /* newVersion */,
+                                int /* baseVersion */, const uint8_t* /* metadata */,
+                                size_t /* metadataLen */) {
+    return false;
+  }
+
   using progress_hook_func_t = std::function<void(size_t /* offset */, size_t /* length */)>;
   void setReceiveProgressHook(const progress_hook_func_t& f);
   void setTransmitProgressHook(const progress_hook_func_t& f);
@@ -73,30 +283,101 @@ class MeshSync : public ProtoDispatchTarget {
   MeshSync(int localVersion = -1, size_t localSize = 0);
 
   void updateVersion(int newLocalVersion, size_t newLocalSize);
+  // Reports that the update passed to onUpdateComplete couldn't be
+  // applied.
+  void updateFailed() { _updateFailed = true; }
 
-  size_t getNewOffset() const { return _updateCurOffset; }
-  size_t getNewSize() const { return _updateVersion.len; }
+  size_t getNewOffset() const { return _deliveredOffset(); }
+  size_t getNewSize() const {
+    return _updateVerified ? _updateManifest.dataLen() : _updateVersion.len;
+  }
+  // Base version of the delta being received, or -1 if receiving a full update.
+  int getNewBaseVersion() const { return _updateBaseVersion; }
 
  private:
+  // A DELTA op is followed by DeltaData and then another op that
+  // refers to the delta instead of the full version.
+  enum class Op : uint8_t { ADVERTISE, REQUEST, PROVIDE, REQUEST_WINDOW, REPAIR, DELTA };
+
   void onPacketReceived(const ProtoDispatchPktHdr* srcaddr, const uint8_t* pkt,
                         size_t len) override;
-  void _onAdvertise(const uint8_t* srcaddr, const uint8_t* pkt, size_t len);
-  void _onRequest(const uint8_t* srcaddr, const uint8_t* pkt, size_t len);
-  void _onProvide(const uint8_t* srcaddr, const uint8_t* pkt, size_t len);
+  // baseVersion is the base version of the delta a packet refers to, or -1 for the full version.
+  void _onAdvertise(const uint8_t* srcaddr, const uint8_t* pkt, size_t len, int baseVersion);
+  void _onDeltaAdvertise(const uint8_t* srcaddr, const uint8_t* pkt, size_t len, int baseVersion);
+  void _onRequest(const uint8_t* srcaddr, const uint8_t* pkt, size_t len, int baseVersion);
+  void _onRequestWindow(const uint8_t* srcaddr, const uint8_t* pkt, size_t len, int baseVersion);
+  void _onProvide(const uint8_t* srcaddr, const uint8_t* pkt, size_t len, int baseVersion);
+  void _onRepair(const uint8_t* srcaddr, const uint8_t* pkt, size_t len, int baseVersion);
+  struct ManifestData;
+  void _beginUpdate(const uint8_t* srcaddr, const uint8_t* metadata, size_t metadataLen,
+                    const ManifestData* manifest = nullptr);
+  void _yieldToOtherProvider();
+  void _yieldToOtherRequester(size_t offset);
   void _checkUpdateComplete();
 
+  void _noteRequester(const uint8_t* srcaddr);
+  void _noteNeighbor(const uint8_t* srcaddr);
+  size_t _recentNeighbors() const;
+  // Fills in the destination of a request or of provided data.
+  void _requestDst(uint8_t* dst) const;
+  void _provideDst(uint8_t* dst) const;
+
   int sendIfNeeded(uint8_t* dst, uint8_t* pkt, size_t maxlen) override;
+  void onSendStatus(const uint8_t* dst, bool success) override;
   int _sendRequestIfNeeded(uint8_t* dst, uint8_t* pkt, size_t maxlen);
+  int _sendWindowRequest(uint8_t* dst, uint8_t* pkt, size_t maxlen);
   int _sendProvideIfNeeded(uint8_t* dst, uint8_t* pkt, size_t maxlen);
+  int _provideChunk(uint8_t* dst, uint8_t* pkt, size_t maxlen, int baseVersion, size_t offset,
+                    size_t chunkSize);
+  int _provideRepair(uint8_t* dst, uint8_t* pkt, size_t maxlen);
   int _sendAdvertiseIfNeeded(uint8_t* dst, uint8_t* pkt, size_t maxlen);
+  // Starts a new Trickle interval of _trickleIntervalMs at now.
+  void _trickleNewInterval(uint32_t now);
+  // Drops the Trickle interval back to the minimum after hearing
+  // something inconsistent with our version.
+  void _trickleReset(uint32_t now);
 
   void _updateProgress();
   void _updateUpToDate();
   void _updateStop(String msg);
 
   void _resetRetryTime();
-
-  enum class Op : uint8_t { ADVERTISE, REQUEST, PROVIDE };
+  uint32_t _rttIntervalMs() const;
+  void _rttSample(uint32_t rtt);
+
+  // Failover support
+  void _noteUpdateSource(const uint8_t* srcaddr, int baseVersion);
+  bool _failover();
+
+  // Resume support
+  size_t _resumeOffset() const;
+  void _saveResumeState();
+  void _clearResumeState();
+
+  // Manifest support
+  bool _buildLocalManifest();
+  bool _receiveVerifiedChunk(const uint8_t* chunk, size_t chunkLen);
+  size_t _deliveredOffset() const;
+
+  // Delta support
+  static size_t _writeOp(uint8_t* pkt, Op op, int baseVersion);
+  bool _isUpdateStream(int version, int baseVersion) const;
+  bool _isLocalStream(int version, int baseVersion) const;
+  size_t _localStreamLen(int baseVersion);
+  bool _provideStreamChunk(int baseVersion, size_t offset, uint8_t* chunk, size_t size);
+
+  // Windowed receive support
+  void _startChunkTracking();
+  void _stopChunkTracking();
+  bool _windowActive() const;
+  bool _haveChunk(size_t idx) const;
+  size_t _expectedChunkLen(size_t offset) const;
+  bool _bufferWindowChunk(size_t offset, const uint8_t* chunk, size_t chunkLen);
+  bool _receiveChunk(const uint8_t* chunk, size_t chunkLen);
+  int _storeChunk(size_t offset, const uint8_t* chunk, size_t chunkLen);
+  bool _acceptChunk(size_t offset, const uint8_t* chunk, size_t chunkLen);
+  void _fecAccumulate(size_t offset, const uint8_t* chunk, size_t chunkLen);
+  void _onChunkProgress();
 
   struct AdvertiseData {
     int version;
@@ -109,25 +390,125 @@ class MeshSync : public ProtoDispatchTarget {
     size_t offset;
   };
 
+  struct WindowRequestData {
+    int version;
+    size_t offset;
+    uint16_t chunkSize;
+    // If nonzero, send a repair packet after each group of this many chunks.
+    uint8_t fecGroupSize;
+    // Bit N is set if the chunk at offset + N * chunkSize is wanted.
+    uint32_t missing;
+  };
+
   struct ProvideData {
     int version;
     size_t offset;
     // Data follows afterwards.
   };
 
+  struct RepairData {
+    int version;
+    // Offset of the first chunk in the group.
+    size_t offset;
+    uint16_t chunkSize;
+    uint8_t groupSize;
+    // XOR of all the chunks in the group follows afterwards.
+  };
+
+  struct DeltaData {
+    int baseVersion;
+  };
+
+  // Precedes the metadata of full version advertisements if _manifestBlockSize is nonzero.
+  struct ManifestData {
+    uint32_t root;
+    uint16_t blockSize;
+    // Length of the data, not including the leaves sent before it.
+    size_t dataLen;
+  };
+  // Longest op header, including a DELTA prefix.
+  static constexpr size_t MAX_OP_LEN = 2 + sizeof(DeltaData);
+
+  struct UpdateSource {
+    uint8_t eth[ETH_ADDR_LEN];
+    // Base version of the delta this source has advertised, or -1 for the full version.
+    int baseVersion;
+    uint32_t lastHeard;
+  };
+  static constexpr size_t MAX_UPDATE_SOURCES = 4;
+  struct Requester {
+    uint8_t eth[ETH_ADDR_LEN];
+    uint32_t lastHeard;
+  };
+  static constexpr size_t MAX_REQUESTERS = 4;
+  // Neighbors remembered for flooding.  Only needs to be more than any
+  // sensible floodRedundancy.
+  static constexpr size_t MAX_NEIGHBORS = 8;
+  static constexpr uint8_t MAX_RETRY_BACKOFF = 6;
+  // Times a request is resent right away after the link reports it
+  // wasn't delivered, before waiting for the retry timer.
+  static constexpr uint8_t MAX_LINK_RETRIES = 3;
+
+  struct FecGroup {
+    // Group number, or ~0 if unused.
+    size_t group;
+    // Bit N is set if chunk N of the group has been XORed into the parity buffer.
+    uint32_t received;
+  };
+
   progress_hook_func_t _receiveProgressHook;
   progress_hook_func_t _transmitProgressHook;
   updateStopHook_func_t _updateStopHook;
 
   uint32_t _retryMs = 300;
+  bool _adaptiveRetry = false;
+  uint32_t _minRetryMs = 20;
+  uint32_t _maxRetryMs = 5000;
   uint32_t _advertiseMs = 15000;
   uint32_t _initialUpgradeMs = 2000;
   uint32_t _maxRetries = 100;
+  uint32_t _failoverRetries = 5;
+  uint32_t _failovers = 0;
+  bool _unicast = false;
+  bool _flood = false;
+  uint32_t _floodDelayMs = 200;
+  uint8_t _floodRedundancy = 2;
+  uint32_t _floodsSuppressed = 0;
+  bool _trickle = false;
+  uint32_t _trickleMinMs = 100;
+  uint32_t _trickleMaxMs = 10 * 60 * 1000;
+  uint8_t _trickleRedundancy = 2;
+  uint32_t _advertisementsSuppressed = 0;
+  uint8_t _windowSize = 1;
+  bool _outOfOrderReceive = false;
+  uint8_t _fecGroupSize = 0;
+  uint32_t _chunksRepaired = 0;
+  // Set by updateFailed during onUpdateComplete.
+  bool _updateFailed = false;
+  size_t _manifestBlockSize = 0;
+  uint32_t _corruptBlocks = 0;
 
   AdvertiseData _localVersion;
 
   uint32_t _startTime = 0;
   uint32_t _nextAdvertiseTime = 0;
+  // True if we're going to pass on a version we received at
+  // _nextAdvertiseTime, unless we overhear enough neighbors doing so.
+  bool _floodPending = false;
+  // Neighbors overheard advertising our version since we received it.
+  uint8_t _floodCopies = 0;
+  // Nodes overheard advertising anything, when flooding.
+  std::vector<Requester> _neighbors;
+  // Current Trickle interval, or 0 if it hasn't started yet.
+  uint32_t _trickleIntervalMs = 0;
+  uint32_t _trickleIntervalEnd = 0;
+  // Neighbors overheard advertising our version during this interval.
+  uint8_t _trickleCopies = 0;
+  // True if we've sent the delta advertisement but not yet the full one.
+  bool _deltaAdvertised = false;
+  // Checksums of our local version, if _localManifestBuilt.
+  bool _localManifestBuilt = false;
+  MeshSyncManifest _localManifest;
 
   // For receiving updates
   bool _updateInProgress = false;
@@ -139,15 +520,111 @@ class MeshSync : public ProtoDispatchTarget {
   bool _seenOther = false;
 
   AdvertiseData _updateVersion;
+  // Nodes that have recently advertised or provided the update in progress.
+  std::vector<UpdateSource> _updateSources;
+  // True if a version newer than the one being received was advertised at _newerVersionTime.
+  bool _newerVersionSeen = false;
+  uint32_t _newerVersionTime = 0;
+  // Base version of the delta being received, or -1 if receiving the full version.
+  int _updateBaseVersion = -1;
+  // Node currently providing the update.
   uint8_t _updateEth[ETH_ADDR_LEN];
   size_t _updateCurOffset = 0;
   size_t _nextRetryTime = 0;
-  uint8_t _retryCount = 0;
+  // Retries since the last progress, across all sources.
+  uint32_t _retryCount = 0;
+  // Retries since the last progress from the current source.
+  uint32_t _sourceRetryCount = 0;
+  // Retry interval is multiplied by 2^_retryBackoff.
+  uint8_t _retryBackoff = 0;
+  // True if the next request is resending one the link failed to
+  // deliver, which doesn't count as a retry.
+  bool _linkRetryPending = false;
+  uint8_t _linkRetries = 0;
+
+  // Round trip time estimate, in milliseconds, scaled by 8 and 4 respectively.
+  uint32_t _srtt8 = 0;
+  uint32_t _rttvar4 = 0;
+  // Retry interval derived from the round trip time.
+  uint32_t _rto = 0;
+  uint32_t _rttSamples = 0;
+  // True if we're waiting for chunks between _rttRequestOffset and
+  // _rttRequestEnd in response to a request that wasn't a retry.
+  // _rttRequestTime is when the request was sent or the last of
+  // those chunks was received.
+  bool _rttPending = false;
+  uint32_t _rttRequestTime = 0;
+  size_t _rttRequestOffset = 0;
+  size_t _rttRequestEnd = 0;
+
+  // Largest chunk that fits in a PROVIDE packet, learned from the
+  // maximum packet length offered by the dispatcher.
+  size_t _chunkSize = 0;
+
+  // True if the update in progress is checked against _updateManifest.
+  // _updateCurOffset is then an offset in the manifest's stream, and
+  // may be before the end of what it's received if that doesn't line
+  // up with our chunks.
+  bool _updateVerified = false;
+  MeshSyncManifest _updateManifest;
+
+  // Identifies the update in progress along with its version and length.
+  uint32_t _updateDigest = 0;
+
+  // How far the most recently aborted update got, if _resumeValid.
+  bool _resumeValid = false;
+  MeshSyncResumeStore::State _resumeState;
+  MeshSyncResumeStore* _resumeStore = nullptr;
+  size_t _resumeCheckpointBytes = 0;
+  // Offset last saved to _resumeStore.
+  size_t _resumeSavedOffset = 0;
+
+  // Chunk size used to track the update in progress, or 0 if we
+  // haven't learned the chunk size yet.
+  size_t _updateChunkSize = 0;
+
+  // For windowed receives.  Bit N of these refers to the chunk at
+  // _updateCurOffset + N * _updateChunkSize.  Chunk data for received
+  // bits is stored in _windowBuf, indexed by chunk number modulo
+  // _updateWindowSize.
+  uint8_t _updateWindowSize = 1;
+  uint8_t* _windowBuf = nullptr;
+  uint32_t _windowReceived = 0;
+  uint32_t _windowRequested = 0;
+
+  // For out-of-order receives, whether each chunk of the update has
+  // been received.  _updateCurOffset is the end of the contiguous
+  // prefix received so far.
+  std::vector<bool> _chunksReceived;
+
+  // For repair packets, the XOR of the chunks seen so far from each
+  // of the most recent groups, indexed by group number modulo the
+  // number of groups we keep.
+  uint8_t _updateFecGroupSize = 0;
+  std::vector<FecGroup> _fecGroups;
+  uint8_t* _fecParity = nullptr;
 
   // For sending updates
   bool _dataRequested = false;  // True if a client wants some of our data.
   size_t _maxRequestedOffset = 0;
+  int _provideRequestBase = -1;
   uint32_t _nextProvideTime = 0;
+  // Nodes that have recently requested data from us, for unicast mode.
+  std::vector<Requester> _requesters;
+
+  // Windowed request we're currently streaming, if _provideWindowMissing is nonzero.
+  int _provideWindowBase = -1;
+  size_t _provideWindowOffset = 0;
+  uint16_t _provideWindowChunkSize = 0;
+  uint32_t _provideWindowMissing = 0;
+  uint8_t _provideWindowFecGroupSize = 0;
+
+  // Repair packet to send before the next chunk, if _provideRepairPending.
+  bool _provideRepairPending = false;
+  int _provideRepairBase = -1;
+  size_t _provideRepairOffset = 0;
+  uint16_t _provideRepairChunkSize = 0;
+  uint8_t _provideRepairGroupSize = 0;
 };
 
 #endif
@@ -0,0 +1,403 @@
+#include "MeshSyncCollection.h"
+
+constexpr size_t MeshSyncCollection::MAX_OBJECT_LEN;
+
+// Number of subranges a range of keys is split into when comparing digests.
+static constexpr size_t k_num_ranges = 16;
+
+bool MeshSyncCollection::set(key_t key, const uint8_t* data, size_t len) {
+  if (!update(key, version(key) + 1, data, len)) {
+    return false;
+  }
+  // Send it right away instead of waiting for neighbors to notice.
+  _pendingObjects.insert(key);
+  return true;
+}
+
+bool MeshSyncCollection::set(key_t key, const String& data) {
+  return set(key, (const uint8_t*)data.begin(), data.length());
+}
+
+bool MeshSyncCollection::update(key_t key, int version, const uint8_t* data, size_t len) {
+  if (len > MAX_OBJECT_LEN) {
+    return false;
+  }
+  _store(key, version, data, len);
+  // Advertise right away that we have something new.
+  _nextAdvertiseTime = MeshClock::millis();
+  return true;
+}
+
+int MeshSyncCollection::version(key_t key) const {
+  auto it = _objects.find(key);
+  if (it == _objects.end()) {
+    return -1;
+  }
+  return it->second.version;
+}
+
+const uint8_t* MeshSyncCollection::data(key_t key, size_t* len) const {
+  auto it = _objects.find(key);
+  if (it == _objects.end()) {
+    *len = 0;
+    return nullptr;
+  }
+  *len = it->second.data.size();
+  return it->second.data.data();
+}
+
+String MeshSyncCollection::get(key_t key) const {
+  size_t len;
+  const uint8_t* buf = data(key, &len);
+  String result;
+  result.reserve(len);
+  for (size_t i = 0; i != len; ++i) {
+    result.concat(char(buf[i]));
+  }
+  return result;
+}
+
+void MeshSyncCollection::setChangeHook(const change_hook_func_t& f) { _changeHook = f; }
+
+uint32_t MeshSyncCollection::_entryHash(key_t key, int version) {
+  // Digests are sums of these, so they can be updated incrementally
+  // and computed for any range of keys regardless of order.
+  uint32_t h = uint32_t(key) * 2654435761u ^ uint32_t(version);
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+size_t MeshSyncCollection::_numRanges(key_t lo, key_t hi) {
+  size_t numKeys = size_t(hi) - lo + 1;
+  return numKeys < k_num_ranges ? numKeys : k_num_ranges;
+}
+
+bool MeshSyncCollection::_subrange(key_t lo, key_t hi, size_t numRanges, size_t idx,
+                                   key_t* subLo, key_t* subHi) {
+  uint32_t width = (uint32_t(hi) - lo) / numRanges + 1;
+  uint32_t start = lo + idx * width;
+  if (start > hi) {
+    return false;
+  }
+  uint32_t end = start + width - 1;
+  *subLo = start;
+  *subHi = end > hi ? hi : end;
+  return true;
+}
+
+uint32_t MeshSyncCollection::_rangeDigest(key_t lo, key_t hi) const {
+  uint32_t digest = 0;
+  for (auto it = _objects.lower_bound(lo); it != _objects.end() && it->first <= hi; ++it) {
+    digest += _entryHash(it->first, it->second.version);
+  }
+  return digest;
+}
+
+size_t MeshSyncCollection::_rangeCount(key_t lo, key_t hi) const {
+  size_t count = 0;
+  for (auto it = _objects.lower_bound(lo); it != _objects.end() && it->first <= hi; ++it) {
+    ++count;
+  }
+  return count;
+}
+
+void MeshSyncCollection::_queueRange(key_t lo, key_t hi, bool reply) {
+  PendingRange range;
+  range.lo = lo;
+  range.hi = hi;
+  range.reply = reply;
+  for (const PendingRange& pending : _pendingRanges) {
+    if (pending == range) {
+      return;
+    }
+  }
+  if (_pendingRanges.size() >= MAX_PENDING_RANGES) {
+    // We'll catch up after the next advertisement.
+    return;
+  }
+  _pendingRanges.push_back(range);
+}
+
+void MeshSyncCollection::_dropRange(key_t lo, key_t hi, bool reply) {
+  for (auto it = _pendingRanges.begin(); it != _pendingRanges.end(); ++it) {
+    if (it->lo == lo && it->hi == hi && it->reply == reply) {
+      _pendingRanges.erase(it);
+      return;
+    }
+  }
+}
+
+void MeshSyncCollection::_store(key_t key, int version, const uint8_t* data, size_t len) {
+  auto it = _objects.find(key);
+  if (it == _objects.end()) {
+    it = _objects.emplace(key, Object()).first;
+  } else {
+    _digest -= _entryHash(key, it->second.version);
+  }
+  it->second.version = version;
+  it->second.data.assign(data, data + len);
+  _digest += _entryHash(key, version);
+}
+
+void MeshSyncCollection::onPacketReceived(const ProtoDispatchPktHdr* /* hdr */,
+                                          const uint8_t* pkt, size_t len) {
+  if (len < 1) {
+    return;
+  }
+  Op op = (Op)pkt[0];
+  switch (op) {
+    case Op::ADVERTISE:
+      _onAdvertise(pkt + 1, len - 1);
+      break;
+    case Op::RANGES:
+      _onRanges(pkt + 1, len - 1);
+      break;
+    case Op::VERSIONS:
+      _onVersions(pkt + 1, len - 1);
+      break;
+    case Op::OBJECT:
+      _onObject(pkt + 1, len - 1);
+      break;
+    default:
+      Serial.printf("Unknown mesh sync collection packet type %d received with length %d\n",
+                    int(op), int(len));
+      break;
+  }
+}
+
+void MeshSyncCollection::_onAdvertise(const uint8_t* pkt, size_t len) {
+  if (len < sizeof(AdvertiseData)) {
+    return;
+  }
+  AdvertiseData adv;
+  memcpy(&adv, pkt, sizeof(AdvertiseData));
+  if (adv.digest == _digest && adv.count == _objects.size()) {
+    return;
+  }
+
+  // Compare all the keys either of us has.
+  key_t lo = adv.minKey;
+  key_t hi = adv.maxKey;
+  if (!_objects.empty()) {
+    key_t minKey = _objects.begin()->first;
+    key_t maxKey = _objects.rbegin()->first;
+    if (!adv.count || minKey < lo) {
+      lo = minKey;
+    }
+    if (!adv.count || maxKey > hi) {
+      hi = maxKey;
+    }
+  }
+  if (lo > hi) {
+    return;
+  }
+  _queueRange(lo, hi, false);
+}
+
+void MeshSyncCollection::_onRanges(const uint8_t* pkt, size_t len) {
+  if (len < sizeof(RangesData)) {
+    return;
+  }
+  RangesData ranges;
+  memcpy(&ranges, pkt, sizeof(RangesData));
+  if (ranges.lo > ranges.hi || !ranges.numRanges ||
+      len < sizeof(RangesData) + ranges.numRanges * sizeof(uint32_t)) {
+    return;
+  }
+  // Someone else already asked about this range; no need for us to.
+  _dropRange(ranges.lo, ranges.hi, false);
+
+  for (size_t i = 0; i != ranges.numRanges; ++i) {
+    key_t subLo, subHi;
+    if (!_subrange(ranges.lo, ranges.hi, ranges.numRanges, i, &subLo, &subHi)) {
+      break;
+    }
+    uint32_t digest;
+    memcpy(&digest, pkt + sizeof(RangesData) + i * sizeof(uint32_t), sizeof(uint32_t));
+    if (digest != _rangeDigest(subLo, subHi)) {
+      _queueRange(subLo, subHi, false);
+    }
+  }
+}
+
+void MeshSyncCollection::_onVersions(const uint8_t* pkt, size_t len) {
+  if (len < sizeof(VersionsData)) {
+    return;
+  }
+  VersionsData versions;
+  memcpy(&versions, pkt, sizeof(VersionsData));
+  if (versions.lo > versions.hi ||
+      len < sizeof(VersionsData) + versions.count * sizeof(VersionEntry)) {
+    return;
+  }
+  _dropRange(versions.lo, versions.hi, versions.reply);
+
+  // Both lists are in key order, so walk through them together.
+  const uint8_t* entries = pkt + sizeof(VersionsData);
+  bool theyHaveNewer = false;
+  auto it = _objects.lower_bound(versions.lo);
+  size_t idx = 0;
+  VersionEntry entry;
+  for (;;) {
+    bool haveOurs = it != _objects.end() && it->first <= versions.hi;
+    bool haveTheirs = idx != versions.count;
+    if (haveTheirs) {
+      memcpy(&entry, entries + idx * sizeof(VersionEntry), sizeof(VersionEntry));
+    }
+    if (!haveOurs && !haveTheirs) {
+      break;
+    }
+
+    if (haveTheirs && (!haveOurs || entry.key < it->first)) {
+      // They have something we don't.
+      theyHaveNewer = true;
+      ++idx;
+    } else if (!haveTheirs || entry.key > it->first) {
+      // We have something they don't.
+      _pendingObjects.insert(it->first);
+      ++it;
+    } else {
+      if (entry.version > it->second.version) {
+        theyHaveNewer = true;
+      } else if (entry.version < it->second.version) {
+        _pendingObjects.insert(it->first);
+      }
+      ++idx;
+      ++it;
+    }
+  }
+
+  if (theyHaveNewer && !versions.reply) {
+    // Let them know which ones we need.
+    _queueRange(versions.lo, versions.hi, true);
+  }
+}
+
+void MeshSyncCollection::_onObject(const uint8_t* pkt, size_t len) {
+  if (len < sizeof(ObjectData) || len - sizeof(ObjectData) > MAX_OBJECT_LEN) {
+    return;
+  }
+  ObjectData obj;
+  memcpy(&obj, pkt, sizeof(ObjectData));
+
+  int localVersion = version(obj.key);
+  if (obj.version >= localVersion) {
+    // Whoever needed ours just got this one instead.
+    _pendingObjects.erase(obj.key);
+  }
+  if (obj.version <= localVersion) {
+    return;
+  }
+  _store(obj.key, obj.version, pkt + sizeof(ObjectData), len - sizeof(ObjectData));
+  if (_changeHook) {
+    _changeHook(obj.key, obj.version);
+  }
+}
+
+int MeshSyncCollection::sendIfNeeded(uint8_t* dst, uint8_t* pkt, size_t maxlen) {
+  if (!_pendingRanges.empty()) {
+    PendingRange range = _pendingRanges.front();
+    _pendingRanges.erase(_pendingRanges.begin());
+    return _sendRange(dst, pkt, maxlen, range);
+  }
+
+  if (!_pendingObjects.empty()) {
+    key_t key = *_pendingObjects.begin();
+    _pendingObjects.erase(_pendingObjects.begin());
+    return _sendObject(dst, pkt, maxlen, key);
+  }
+
+  if (timeIsAfter(MeshClock::millis(), _nextAdvertiseTime)) {
+    _nextAdvertiseTime = MeshClock::millis() + MeshClock::random(_advertiseMs, 2 * _advertiseMs);
+    return _sendAdvertise(dst, pkt, maxlen);
+  }
+
+  return -1;
+}
+
+int MeshSyncCollection::_sendRange(uint8_t* dst, uint8_t* pkt, size_t maxlen,
+                                   const PendingRange& range) {
+  memset(dst, 0xff, ETH_ADDR_LEN);
+
+  size_t count = _rangeCount(range.lo, range.hi);
+  size_t maxCount = (maxlen - 1 - sizeof(VersionsData)) / sizeof(VersionEntry);
+  if (maxCount > 255) {
+    maxCount = 255;
+  }
+  if (count <= maxCount) {
+    VersionsData versions;
+    versions.lo = range.lo;
+    versions.hi = range.hi;
+    versions.reply = range.reply;
+    versions.count = count;
+    pkt[0] = int(Op::VERSIONS);
+    memcpy(pkt + 1, &versions, sizeof(VersionsData));
+    uint8_t* entries = pkt + 1 + sizeof(VersionsData);
+    for (auto it = _objects.lower_bound(range.lo); it != _objects.end() && it->first <= range.hi;
+         ++it) {
+      VersionEntry entry;
+      entry.key = it->first;
+      entry.version = it->second.version;
+      memcpy(entries, &entry, sizeof(VersionEntry));
+      entries += sizeof(VersionEntry);
+    }
+    return 1 + sizeof(VersionsData) + count * sizeof(VersionEntry);
+  }
+
+  // Too many to list; narrow it down first.
+  RangesData ranges;
+  ranges.lo = range.lo;
+  ranges.hi = range.hi;
+  ranges.numRanges = _numRanges(range.lo, range.hi);
+  assert(maxlen >= 1 + sizeof(RangesData) + ranges.numRanges * sizeof(uint32_t));
+  pkt[0] = int(Op::RANGES);
+  memcpy(pkt + 1, &ranges, sizeof(RangesData));
+  for (size_t i = 0; i != ranges.numRanges; ++i) {
+    key_t subLo, subHi;
+    uint32_t digest = 0;
+    if (_subrange(range.lo, range.hi, ranges.numRanges, i, &subLo, &subHi)) {
+      digest = _rangeDigest(subLo, subHi);
+    }
+    memcpy(pkt + 1 + sizeof(RangesData) + i * sizeof(uint32_t), &digest, sizeof(uint32_t));
+  }
+  return 1 + sizeof(RangesData) + ranges.numRanges * sizeof(uint32_t);
+}
+
+int MeshSyncCollection::_sendObject(uint8_t* dst, uint8_t* pkt, size_t maxlen, key_t key) {
+  auto it = _objects.find(key);
+  if (it == _objects.end()) {
+    return -1;
+  }
+  const Object& local = it->second;
+  if (1 + sizeof(ObjectData) + local.data.size() > maxlen) {
+    Serial.printf("Mesh sync collection object %u doesn't fit in a packet\n", key);
+    return -1;
+  }
+
+  memset(dst, 0xff, ETH_ADDR_LEN);
+  ObjectData obj;
+  obj.key = key;
+  obj.version = local.version;
+  pkt[0] = int(Op::OBJECT);
+  memcpy(pkt + 1, &obj, sizeof(ObjectData));
+  memcpy(pkt + 1 + sizeof(ObjectData), local.data.data(), local.data.size());
+  return 1 + sizeof(ObjectData) + local.data.size();
+}
+
+int MeshSyncCollection::_sendAdvertise(uint8_t* dst, uint8_t* pkt, size_t maxlen) {
+  assert(maxlen >= 1 + sizeof(AdvertiseData));
+  memset(dst, 0xff, ETH_ADDR_LEN);  // broadcast to everyone!
+
+  AdvertiseData adv;
+  adv.digest = _digest;
+  adv.count = _objects.size();
+  adv.minKey = _objects.empty() ? 0 : _objects.begin()->first;
+  adv.maxKey = _objects.empty() ? 0 : _objects.rbegin()->first;
+  pkt[0] = int(Op::ADVERTISE);
+  memcpy(pkt + 1, &adv, sizeof(AdvertiseData));
+  return 1 + sizeof(AdvertiseData);
+}
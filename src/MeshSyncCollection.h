@@ -0,0 +1,176 @@
+#ifndef MESH_SYNC_COLLECTION_H
+#define MESH_SYNC_COLLECTION_H
+
+#include <functional>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "ProtoDispatch.h"
+
+// Synchronizes many small keyed objects under a single protocol id.
+//
+// As with MeshSyncStruct, each object has a version, and nodes with a
+// lower version of an object receive the higher one.  But instead of
+// every object advertising itself, each node advertises a digest of
+// the versions of all its objects.  When a neighbor's digest differs
+// from ours, we compare digests of ranges of keys, narrowing down to
+// the ranges that differ, then exchange the versions of the keys in
+// those ranges.  Only objects that actually differ are sent.
+//
+// Each object must fit in a single packet (see MAX_OBJECT_LEN).
+// Objects can't be removed once added.
+class MeshSyncCollection : public ProtoDispatchTarget {
+ public:
+  using key_t = uint16_t;
+  static constexpr size_t MAX_OBJECT_LEN = 200;
+
+  // Sets the local value of an object, with a version one higher than
+  // before, and sends it to our neighbors.  Returns false if it's
+  // longer than MAX_OBJECT_LEN.
+  bool set(key_t key, const uint8_t* data, size_t len);
+  bool set(key_t key, const String& data);
+
+  template <typename T>
+  bool setValue(key_t key, const T& val) {
+    return set(key, (const uint8_t*)&val, sizeof(T));
+  }
+
+  // Sets the local value of an object along with its version, e.g.
+  // when loading saved objects.  If the version is higher than
+  // neighboring nodes have, it will be propagated after they notice our
+  // digest has changed.
+  bool update(key_t key, int version, const uint8_t* data, size_t len);
+
+  bool has(key_t key) const { return _objects.count(key); }
+  // Returns -1 if we don't have the object.
+  int version(key_t key) const;
+  // Returns null if we don't have the object.
+  const uint8_t* data(key_t key, size_t* len) const;
+  // Returns the object as an Arduino String.  This should not be used
+  // for binary data, as the Arduino String does not deal well with null
+  // characters.
+  String get(key_t key) const;
+
+  // Returns false if we don't have the object, or if it's the wrong size.
+  template <typename T>
+  bool getValue(key_t key, T* val) const {
+    size_t len;
+    const uint8_t* buf = data(key, &len);
+    if (!buf || len != sizeof(T)) {
+      return false;
+    }
+    memcpy(val, buf, sizeof(T));
+    return true;
+  }
+
+  size_t size() const { return _objects.size(); }
+
+  // Digest of the keys and versions of all our objects.  Nodes that
+  // have the same versions of the same objects have the same digest.
+  uint32_t digest() const { return _digest; }
+
+  // Sets the number of milliseconds between advertisements.  The
+  // actual interval will be a random interval between 1 and 2 times
+  // this number to avoid synchronization issues.
+  void advertiseMs(uint32_t ms) { _advertiseMs = ms; }
+
+  // Called when an object is received from another node.
+  using change_hook_func_t = std::function<void(key_t /* key */, int /* version */)>;
+  void setChangeHook(const change_hook_func_t& f);
+
+ private:
+  enum class Op : uint8_t { ADVERTISE, RANGES, VERSIONS, OBJECT };
+
+  struct Object {
+    int version;
+    std::vector<uint8_t> data;
+  };
+
+  struct AdvertiseData {
+    uint32_t digest;
+    uint16_t count;
+    // Range of keys we have, if count is nonzero.
+    key_t minKey;
+    key_t maxKey;
+  };
+
+  struct RangesData {
+    // Range of keys compared, inclusive.
+    key_t lo;
+    key_t hi;
+    // The range is split into this many subranges of equal size, and
+    // a uint32_t digest of each follows.
+    uint8_t numRanges;
+  };
+
+  struct VersionsData {
+    // Range of keys listed, inclusive.
+    key_t lo;
+    key_t hi;
+    // True if this is a response to someone else's versions.
+    bool reply;
+    // This many VersionEntry follow.
+    uint8_t count;
+  };
+
+  struct VersionEntry {
+    key_t key;
+    int version;
+  };
+
+  struct ObjectData {
+    key_t key;
+    int version;
+    // Object data follows.
+  };
+
+  // A range of keys whose versions we should send, or whose digests
+  // we should send if there are too many to fit in a packet.
+  struct PendingRange {
+    key_t lo;
+    key_t hi;
+    bool reply;
+    bool operator==(const PendingRange& rhs) const {
+      return lo == rhs.lo && hi == rhs.hi && reply == rhs.reply;
+    }
+  };
+  static constexpr size_t MAX_PENDING_RANGES = 32;
+
+  void onPacketReceived(const ProtoDispatchPktHdr* hdr, const uint8_t* pkt, size_t len) override;
+  void _onAdvertise(const uint8_t* pkt, size_t len);
+  void _onRanges(const uint8_t* pkt, size_t len);
+  void _onVersions(const uint8_t* pkt, size_t len);
+  void _onObject(const uint8_t* pkt, size_t len);
+
+  int sendIfNeeded(uint8_t* dst, uint8_t* pkt, size_t maxlen) override;
+  int _sendRange(uint8_t* dst, uint8_t* pkt, size_t maxlen, const PendingRange& range);
+  int _sendObject(uint8_t* dst, uint8_t* pkt, size_t maxlen, key_t key);
+  int _sendAdvertise(uint8_t* dst, uint8_t* pkt, size_t maxlen);
+
+  static uint32_t _entryHash(key_t key, int version);
+  static size_t _numRanges(key_t lo, key_t hi);
+  static bool _subrange(key_t lo, key_t hi, size_t numRanges, size_t idx, key_t* subLo,
+                        key_t* subHi);
+  uint32_t _rangeDigest(key_t lo, key_t hi) const;
+  size_t _rangeCount(key_t lo, key_t hi) const;
+  void _queueRange(key_t lo, key_t hi, bool reply);
+  void _dropRange(key_t lo, key_t hi, bool reply);
+  void _store(key_t key, int version, const uint8_t* data, size_t len);
+
+  change_hook_func_t _changeHook;
+
+  uint32_t _advertiseMs = 15000;
+  uint32_t _nextAdvertiseTime = 0;
+
+  std::map<key_t, Object> _objects;
+  // Sum of _entryHash of each object.
+  uint32_t _digest = 0;
+
+  // Ranges to send versions or digests of, in order.
+  std::vector<PendingRange> _pendingRanges;
+  // Objects that a neighbor has an older version of, or doesn't have.
+  std::set<key_t> _pendingObjects;
+};
+
+#endif
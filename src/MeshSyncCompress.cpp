@@ -0,0 +1,183 @@
+#include "MeshSyncCompress.h"
+
+#include <vector>
+
+constexpr size_t MeshSyncCompress::WINDOW_SIZE;
+
+// Shortest and longest back references that can be encoded.
+static constexpr size_t k_min_match = 3;
+static constexpr size_t k_max_match = k_min_match + 63;
+// Number of hash buckets for finding matches; must match the range of _hash.
+static constexpr size_t k_hash_buckets = 256;
+// Maximum number of candidate matches to try at each position.
+static constexpr size_t k_max_chain = 16;
+
+uint8_t MeshSyncCompress::_hash(const uint8_t* p) {
+  uint32_t h = uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16);
+  h *= 2654435761u;
+  return h >> 24;
+}
+
+size_t MeshSyncCompress::compress(const uint8_t* in, size_t inLen, uint8_t* out, size_t maxOut) {
+  // Positions with the same hash are chained together, most recent
+  // first.  We only need to remember positions within the window.
+  std::vector<int> head(k_hash_buckets, -1);
+  std::vector<int> prev(WINDOW_SIZE, -1);
+
+  size_t outPos = 0;
+  size_t controlPos = 0;
+  uint8_t controlBit = 8;
+
+  size_t i = 0;
+  size_t hashed = 0;
+  while (i < inLen) {
+    if (controlBit == 8) {
+      if (outPos == maxOut) {
+        return 0;
+      }
+      controlPos = outPos++;
+      out[controlPos] = 0;
+      controlBit = 0;
+    }
+
+    // Find the longest match for the data at i within the window.
+    size_t bestLen = 0;
+    size_t bestDist = 0;
+    if (i + k_min_match <= inLen) {
+      int candidate = head[_hash(in + i)];
+      for (size_t chain = 0; candidate >= 0 && chain != k_max_chain; ++chain) {
+        size_t dist = i - candidate;
+        if (dist > WINDOW_SIZE) {
+          break;
+        }
+        size_t len = 0;
+        while (len != k_max_match && i + len < inLen && in[candidate + len] == in[i + len]) {
+          ++len;
+        }
+        if (len > bestLen) {
+          bestLen = len;
+          bestDist = dist;
+        }
+        int next = prev[candidate % WINDOW_SIZE];
+        if (next >= candidate) {
+          // Overwritten by a newer position.
+          break;
+        }
+        candidate = next;
+      }
+    }
+
+    if (bestLen >= k_min_match) {
+      if (maxOut - outPos < 2) {
+        return 0;
+      }
+      out[controlPos] |= 1 << controlBit;
+      out[outPos++] = (bestDist - 1) & 0xff;
+      out[outPos++] = (((bestDist - 1) >> 8) << 6) | (bestLen - k_min_match);
+    } else {
+      if (outPos == maxOut) {
+        return 0;
+      }
+      out[outPos++] = in[i];
+      bestLen = 1;
+    }
+    ++controlBit;
+
+    i += bestLen;
+    for (; hashed < i && hashed + k_min_match <= inLen; ++hashed) {
+      uint8_t h = _hash(in + hashed);
+      prev[hashed % WINDOW_SIZE] = head[h];
+      head[h] = hashed;
+    }
+  }
+  return outPos;
+}
+
+bool MeshSyncCompress::decompress(const uint8_t* in, size_t inLen, uint8_t* out, size_t outLen) {
+  size_t pos = 0;
+  Decoder decoder([&](const uint8_t* data, size_t len) {
+    if (len > outLen - pos) {
+      return false;
+    }
+    memcpy(out + pos, data, len);
+    pos += len;
+    return true;
+  });
+  return decoder.write(in, inLen) && pos == outLen;
+}
+
+MeshSyncCompress::Decoder::Decoder(const output_func_t& output) : _output(output) {}
+
+MeshSyncCompress::Decoder::~Decoder() {
+  if (_window) {
+    free(_window);
+  }
+}
+
+void MeshSyncCompress::Decoder::_put(uint8_t b) {
+  _window[_outputLen % WINDOW_SIZE] = b;
+  ++_outputLen;
+  if (_outputLen % WINDOW_SIZE == 0) {
+    // About to wrap around and overwrite data we haven't output yet.
+    _flush();
+  }
+}
+
+bool MeshSyncCompress::Decoder::_flush() {
+  if (_failed) {
+    return false;
+  }
+  size_t len = _outputLen - _flushedLen;
+  if (len && !_output(_window + _flushedLen % WINDOW_SIZE, len)) {
+    _failed = true;
+    return false;
+  }
+  _flushedLen = _outputLen;
+  return true;
+}
+
+bool MeshSyncCompress::Decoder::write(const uint8_t* in, size_t len) {
+  if (_failed) {
+    return false;
+  }
+  if (!_window) {
+    _window = (uint8_t*)malloc(WINDOW_SIZE);
+    if (!_window) {
+      _failed = true;
+      return false;
+    }
+  }
+
+  const uint8_t* end = in + len;
+  while (in != end && !_failed) {
+    if (!_controlLeft) {
+      _control = *in++;
+      _controlLeft = 8;
+      continue;
+    }
+
+    if (!(_control & 1)) {
+      _put(*in++);
+    } else if (!_havePending) {
+      _pending = *in++;
+      _havePending = true;
+      continue;
+    } else {
+      uint8_t b = *in++;
+      _havePending = false;
+      size_t dist = (_pending | (size_t(b >> 6) << 8)) + 1;
+      size_t matchLen = (b & 0x3f) + k_min_match;
+      if (dist > _outputLen) {
+        _failed = true;
+        return false;
+      }
+      for (size_t i = 0; i != matchLen; ++i) {
+        _put(_window[(_outputLen - dist) % WINDOW_SIZE]);
+      }
+    }
+    _control >>= 1;
+    --_controlLeft;
+  }
+
+  return _flush();
+}
@@ -0,0 +1,74 @@
+#ifndef MESH_SYNC_COMPRESS_H
+#define MESH_SYNC_COMPRESS_H
+
+#include <Arduino.h>
+
+#include <functional>
+
+// Small-footprint LZSS compression for data sent over MeshSync.
+//
+// The compressed stream is a series of groups, each starting with a
+// control byte.  Bit N of the control byte (starting from the least
+// significant) describes the Nth item following it: 0 for a literal
+// byte, or 1 for a two byte back reference.  A back reference holds
+// a 10 bit distance minus 1 in the low 8 bits of the first byte and
+// the high 2 bits of the second, and the length minus 3 in the low 6
+// bits of the second byte.
+//
+// Decoding only needs the last WINDOW_SIZE bytes of output, so it can
+// be done incrementally as the data arrives.
+class MeshSyncCompress {
+ public:
+  static constexpr size_t WINDOW_SIZE = 1024;
+
+  // Compresses in to out.  Returns the length of the compressed data,
+  // or 0 if it doesn't fit in maxOut bytes.
+  static size_t compress(const uint8_t* in, size_t inLen, uint8_t* out, size_t maxOut);
+
+  // Decompresses everything in one go.  Returns false if the
+  // compressed data is malformed or doesn't decompress to exactly
+  // outLen bytes.
+  static bool decompress(const uint8_t* in, size_t inLen, uint8_t* out, size_t outLen);
+
+  // Incremental decompression.  Decompressed data is passed to the
+  // output function as it becomes available, in pieces of at most
+  // WINDOW_SIZE bytes.
+  class Decoder {
+   public:
+    // Returns false if decompression should be aborted.
+    using output_func_t = std::function<bool(const uint8_t* /* data */, size_t /* len */)>;
+
+    explicit Decoder(const output_func_t& output);
+    ~Decoder();
+
+    // Decompresses the next part of the compressed data.  Returns
+    // false if it's malformed, if we run out of memory, or if the
+    // output function returns false.
+    bool write(const uint8_t* in, size_t len);
+
+    // Total number of bytes decompressed so far.
+    size_t outputLen() const { return _outputLen; }
+
+   private:
+    void _put(uint8_t b);
+    bool _flush();
+
+    output_func_t _output;
+    uint8_t* _window = nullptr;
+    size_t _outputLen = 0;
+    size_t _flushedLen = 0;
+    bool _failed = false;
+
+    uint8_t _control = 0;
+    // Number of items described by _control that haven't been decoded yet.
+    uint8_t _controlLeft = 0;
+    // First byte of a back reference, if the second hasn't arrived yet.
+    bool _havePending = false;
+    uint8_t _pending = 0;
+  };
+
+ private:
+  static uint8_t _hash(const uint8_t* p);
+};
+
+#endif
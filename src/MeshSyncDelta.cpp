@@ -0,0 +1,163 @@
+#include "MeshSyncDelta.h"
+
+#include <vector>
+
+// Shortest match in the base worth encoding as a copy.
+static constexpr size_t k_min_match = 4;
+// Number of hash buckets for finding matches; must match the range of _hash.
+static constexpr size_t k_hash_buckets = 256;
+// Maximum number of candidate matches to try at each position.
+static constexpr size_t k_max_chain = 32;
+
+uint8_t MeshSyncDelta::_hash(const uint8_t* p) {
+  uint32_t h = uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) |
+               (uint32_t(p[3]) << 24);
+  h *= 2654435761u;
+  return h >> 24;
+}
+
+bool MeshSyncDelta::_putVarint(uint32_t val, uint8_t** out, const uint8_t* end) {
+  do {
+    if (*out == end) {
+      return false;
+    }
+    uint8_t b = val & 0x7f;
+    val >>= 7;
+    if (val) {
+      b |= 0x80;
+    }
+    *(*out)++ = b;
+  } while (val);
+  return true;
+}
+
+bool MeshSyncDelta::_getVarint(const uint8_t** in, const uint8_t* end, uint32_t* val) {
+  *val = 0;
+  for (int shift = 0; shift < 32; shift += 7) {
+    if (*in == end) {
+      return false;
+    }
+    uint8_t b = *(*in)++;
+    *val |= uint32_t(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool MeshSyncDelta::_putInsert(const uint8_t* literal, size_t len, uint8_t** out,
+                               const uint8_t* end) {
+  if (!len) {
+    return true;
+  }
+  if (!_putVarint((len << 1) | 1, out, end)) {
+    return false;
+  }
+  if (size_t(end - *out) < len) {
+    return false;
+  }
+  memcpy(*out, literal, len);
+  *out += len;
+  return true;
+}
+
+size_t MeshSyncDelta::encode(const uint8_t* base, size_t baseLen, const uint8_t* target,
+                             size_t targetLen, uint8_t* out, size_t maxOut) {
+  uint8_t* pos = out;
+  const uint8_t* end = out + maxOut;
+  if (!_putVarint(targetLen, &pos, end)) {
+    return 0;
+  }
+
+  // Chain together all positions in the base with the same hash, most recent first.
+  std::vector<int> head(k_hash_buckets, -1);
+  std::vector<int> prev(baseLen >= k_min_match ? baseLen - k_min_match + 1 : 0);
+  for (size_t i = 0; i != prev.size(); ++i) {
+    uint8_t h = _hash(base + i);
+    prev[i] = head[h];
+    head[h] = i;
+  }
+
+  size_t literalStart = 0;
+  size_t i = 0;
+  while (i + k_min_match <= targetLen) {
+    // Find the longest match for the data at i in the base.
+    size_t bestLen = 0;
+    size_t bestOffset = 0;
+    int candidate = head[_hash(target + i)];
+    for (size_t chain = 0; candidate >= 0 && chain != k_max_chain; ++chain) {
+      size_t len = 0;
+      while (candidate + len < baseLen && i + len < targetLen &&
+             base[candidate + len] == target[i + len]) {
+        ++len;
+      }
+      if (len > bestLen) {
+        bestLen = len;
+        bestOffset = candidate;
+      }
+      candidate = prev[candidate];
+    }
+
+    if (bestLen < k_min_match) {
+      ++i;
+      continue;
+    }
+
+    if (!_putInsert(target + literalStart, i - literalStart, &pos, end) ||
+        !_putVarint(bestLen << 1, &pos, end) || !_putVarint(bestOffset, &pos, end)) {
+      return 0;
+    }
+    i += bestLen;
+    literalStart = i;
+  }
+
+  if (!_putInsert(target + literalStart, targetLen - literalStart, &pos, end)) {
+    return 0;
+  }
+  return pos - out;
+}
+
+int MeshSyncDelta::targetLen(const uint8_t* delta, size_t deltaLen) {
+  uint32_t len;
+  if (!_getVarint(&delta, delta + deltaLen, &len) || int(len) < 0) {
+    return -1;
+  }
+  return len;
+}
+
+bool MeshSyncDelta::apply(const uint8_t* base, size_t baseLen, const uint8_t* delta,
+                          size_t deltaLen, uint8_t* out, size_t outLen) {
+  const uint8_t* end = delta + deltaLen;
+  uint32_t len;
+  if (!_getVarint(&delta, end, &len) || len != outLen) {
+    return false;
+  }
+
+  size_t pos = 0;
+  while (delta != end) {
+    uint32_t op;
+    if (!_getVarint(&delta, end, &op)) {
+      return false;
+    }
+    len = op >> 1;
+    if (len > outLen - pos) {
+      return false;
+    }
+    if (op & 1) {
+      if (len > size_t(end - delta)) {
+        return false;
+      }
+      memcpy(out + pos, delta, len);
+      delta += len;
+    } else {
+      uint32_t offset;
+      if (!_getVarint(&delta, end, &offset) || offset > baseLen || len > baseLen - offset) {
+        return false;
+      }
+      memcpy(out + pos, base + offset, len);
+    }
+    pos += len;
+  }
+  return pos == outLen;
+}
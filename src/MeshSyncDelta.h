@@ -0,0 +1,38 @@
+#ifndef MESH_SYNC_DELTA_H
+#define MESH_SYNC_DELTA_H
+
+#include <Arduino.h>
+
+// Binary deltas between two versions of a buffer, for sending only
+// what changed between consecutive versions.
+//
+// A delta starts with the length of the target as a varint, followed
+// by a series of ops.  Each op starts with a varint holding
+// (length << 1 | isInsert).  A copy op (isInsert = 0) is followed by
+// a varint offset into the base to copy length bytes from.  An insert
+// op is followed by length literal bytes.
+class MeshSyncDelta {
+ public:
+  // Writes a delta that turns base into target to out.  Returns the
+  // length of the delta, or 0 if it doesn't fit in maxOut bytes.
+  static size_t encode(const uint8_t* base, size_t baseLen, const uint8_t* target,
+                       size_t targetLen, uint8_t* out, size_t maxOut);
+
+  // Returns the length of the target described by the given delta,
+  // or -1 if the delta is malformed.
+  static int targetLen(const uint8_t* delta, size_t deltaLen);
+
+  // Applies delta to base, writing targetLen(delta, deltaLen) bytes to
+  // out.  Returns false if the delta is malformed or refers to data
+  // outside of base.
+  static bool apply(const uint8_t* base, size_t baseLen, const uint8_t* delta, size_t deltaLen,
+                    uint8_t* out, size_t outLen);
+
+ private:
+  static uint8_t _hash(const uint8_t* p);
+  static bool _putVarint(uint32_t val, uint8_t** out, const uint8_t* end);
+  static bool _getVarint(const uint8_t** in, const uint8_t* end, uint32_t* val);
+  static bool _putInsert(const uint8_t* literal, size_t len, uint8_t** out, const uint8_t* end);
+};
+
+#endif
@@ -0,0 +1,166 @@
+#include "MeshSyncManifest.h"
+
+constexpr size_t MeshSyncManifest::MAX_BLOCK_SIZE;
+
+// Data is read this many bytes at a time when computing checksums.
+static constexpr size_t k_read_piece = 64;
+
+MeshSyncManifest::~MeshSyncManifest() { clear(); }
+
+uint32_t MeshSyncManifest::crc32(uint32_t crc, const uint8_t* data, size_t len) {
+  // Bitwise CRC-32 (IEEE 802.3), to avoid the RAM for a table.
+  crc = ~crc;
+  for (size_t i = 0; i != len; ++i) {
+    crc ^= data[i];
+    for (int bit = 0; bit != 8; ++bit) {
+      crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+size_t MeshSyncManifest::leavesLen(size_t dataLen, size_t blockSize) {
+  return (dataLen + blockSize - 1) / blockSize * sizeof(uint32_t);
+}
+
+void MeshSyncManifest::clear() {
+  _leaves.clear();
+  _leaves.shrink_to_fit();
+  _dataLen = 0;
+  _blockSize = 0;
+  _root = 0;
+  _leavesReceived = 0;
+  _leavesVerified = false;
+  _dataVerified = 0;
+  _blockLen = 0;
+  if (_block) {
+    free(_block);
+    _block = nullptr;
+  }
+}
+
+bool MeshSyncManifest::build(size_t dataLen, size_t blockSize, const read_func_t& readData) {
+  clear();
+  assert(blockSize && blockSize <= MAX_BLOCK_SIZE);
+  _leaves.resize(leavesLen(dataLen, blockSize) / sizeof(uint32_t));
+  for (size_t i = 0; i != _leaves.size(); ++i) {
+    size_t start = i * blockSize;
+    size_t end = start + blockSize < dataLen ? start + blockSize : dataLen;
+    uint32_t crc = 0;
+    uint8_t piece[k_read_piece];
+    for (size_t pos = start; pos < end; pos += sizeof(piece)) {
+      size_t pieceLen = end - pos < sizeof(piece) ? end - pos : sizeof(piece);
+      if (!readData(pos, piece, pieceLen)) {
+        clear();
+        return false;
+      }
+      crc = crc32(crc, piece, pieceLen);
+    }
+    _leaves[i] = crc;
+  }
+  _dataLen = dataLen;
+  _blockSize = blockSize;
+  _root = crc32(0, (const uint8_t*)_leaves.data(), _leaves.size() * sizeof(uint32_t));
+  return true;
+}
+
+bool MeshSyncManifest::readStream(size_t offset, uint8_t* buf, size_t len,
+                                  const read_func_t& readData) const {
+  size_t leaves = _leaves.size() * sizeof(uint32_t);
+  if (offset < leaves) {
+    size_t leafLen = leaves - offset < len ? leaves - offset : len;
+    memcpy(buf, (const uint8_t*)_leaves.data() + offset, leafLen);
+    offset += leafLen;
+    buf += leafLen;
+    len -= leafLen;
+  }
+  if (!len) {
+    return true;
+  }
+  return readData(offset - leaves, buf, len);
+}
+
+bool MeshSyncManifest::expect(size_t dataLen, size_t blockSize, uint32_t root,
+                              size_t resumeOffset) {
+  clear();
+  if (!blockSize || blockSize > MAX_BLOCK_SIZE) {
+    return false;
+  }
+  if (resumeOffset % blockSize && resumeOffset != dataLen) {
+    return false;
+  }
+  _block = (uint8_t*)malloc(blockSize);
+  if (!_block) {
+    return false;
+  }
+  _leaves.resize(leavesLen(dataLen, blockSize) / sizeof(uint32_t));
+  _dataLen = dataLen;
+  _blockSize = blockSize;
+  _root = root;
+  _dataVerified = resumeOffset;
+  _leavesVerified = _leaves.empty();
+  return true;
+}
+
+size_t MeshSyncManifest::streamOffset() const {
+  if (!_leavesVerified) {
+    return _leavesReceived;
+  }
+  return _leaves.size() * sizeof(uint32_t) + _dataVerified + _blockLen;
+}
+
+MeshSyncManifest::Result MeshSyncManifest::write(size_t offset, const uint8_t* data, size_t len,
+                                                 const output_func_t& output) {
+  size_t pos = streamOffset();
+  assert(offset <= pos);
+  if (offset + len <= pos) {
+    return Result::OK;
+  }
+  // Skip anything we already have.
+  data += pos - offset;
+  len -= pos - offset;
+
+  size_t leaves = _leaves.size() * sizeof(uint32_t);
+  if (!_leavesVerified) {
+    size_t leafLen = leaves - _leavesReceived < len ? leaves - _leavesReceived : len;
+    memcpy((uint8_t*)_leaves.data() + _leavesReceived, data, leafLen);
+    _leavesReceived += leafLen;
+    data += leafLen;
+    len -= leafLen;
+    if (_leavesReceived != leaves) {
+      return Result::OK;
+    }
+    if (crc32(0, (const uint8_t*)_leaves.data(), leaves) != _root) {
+      _leavesReceived = 0;
+      return Result::CORRUPT;
+    }
+    _leavesVerified = true;
+    if (_dataVerified) {
+      // Resuming; the rest of this is data we already have.
+      return Result::OK;
+    }
+  }
+
+  while (len && _dataVerified < _dataLen) {
+    size_t blockEnd = _dataLen - _dataVerified < _blockSize ? _dataLen - _dataVerified : _blockSize;
+    size_t copyLen = blockEnd - _blockLen < len ? blockEnd - _blockLen : len;
+    memcpy(_block + _blockLen, data, copyLen);
+    _blockLen += copyLen;
+    data += copyLen;
+    len -= copyLen;
+    if (_blockLen != blockEnd) {
+      break;
+    }
+
+    size_t blockLen = _blockLen;
+    _blockLen = 0;
+    if (crc32(0, _block, blockLen) != _leaves[_dataVerified / _blockSize]) {
+      return Result::CORRUPT;
+    }
+    if (!output(_block, blockLen)) {
+      return Result::FAILED;
+    }
+    _dataVerified += blockLen;
+  }
+  return Result::OK;
+}
@@ -0,0 +1,97 @@
+#ifndef MESH_SYNC_MANIFEST_H
+#define MESH_SYNC_MANIFEST_H
+
+#include <Arduino.h>
+#include <assert.h>
+
+#include <functional>
+#include <vector>
+
+// Per-block checksums for data sent over MeshSync, so corruption is
+// caught as soon as a block arrives instead of after the whole
+// transfer.
+//
+// The data is split into blocks of blockSize bytes, and the CRC-32 of
+// each block is kept as a leaf checksum.  The root checksum is the
+// CRC-32 of all the leaves, making this a one level hash tree.  When
+// sent, the leaves precede the data in a single stream, and the root
+// is sent separately so the leaves can be checked before any data
+// is trusted.
+//
+// These are meant to catch corrupted data, not data that was changed
+// on purpose.
+class MeshSyncManifest {
+ public:
+  static constexpr size_t MAX_BLOCK_SIZE = 4096;
+
+  // Returns false if the data can't be read.
+  using read_func_t =
+      std::function<bool(size_t /* offset */, uint8_t* /* data */, size_t /* len */)>;
+  // Returns false if receiving should be aborted.
+  using output_func_t = std::function<bool(const uint8_t* /* data */, size_t /* len */)>;
+
+  ~MeshSyncManifest();
+
+  static uint32_t crc32(uint32_t crc, const uint8_t* data, size_t len);
+  // Length of the leaves for dataLen bytes of data.
+  static size_t leavesLen(size_t dataLen, size_t blockSize);
+
+  size_t dataLen() const { return _dataLen; }
+  size_t blockSize() const { return _blockSize; }
+  uint32_t root() const { return _root; }
+  // Length of the leaves followed by the data.
+  size_t streamLen() const { return leavesLen(_dataLen, _blockSize) + _dataLen; }
+
+  // Frees everything.
+  void clear();
+
+  // For sending.  Computes the checksums of dataLen bytes of data.
+  // Returns false if it can't be read.
+  bool build(size_t dataLen, size_t blockSize, const read_func_t& readData);
+
+  // Reads part of the stream, using readData for the data after the leaves.
+  bool readStream(size_t offset, uint8_t* buf, size_t len, const read_func_t& readData) const;
+
+  // For receiving.  Expects a stream for dataLen bytes of data whose
+  // leaves have the given root.  If resumeOffset is nonzero, the first
+  // resumeOffset bytes of data were verified by an earlier attempt; the
+  // stream then skips from the end of the leaves to that point.
+  // Returns false if we run out of memory or resumeOffset isn't at the
+  // end of a block.
+  bool expect(size_t dataLen, size_t blockSize, uint32_t root, size_t resumeOffset);
+
+  enum class Result {
+    OK,
+    // A block didn't match its checksum and was discarded.  Receiving
+    // continues from streamOffset.
+    CORRUPT,
+    // The output function returned false.
+    FAILED
+  };
+
+  // Receives the part of the stream at offset, which must not be after
+  // streamOffset.  Each block of data is passed to output once it's
+  // been verified.
+  Result write(size_t offset, const uint8_t* data, size_t len, const output_func_t& output);
+
+  // Offset in the stream of the next byte we need.
+  size_t streamOffset() const;
+  // Number of bytes of data verified and passed to the output function so far.
+  size_t dataVerified() const { return _dataVerified; }
+
+ private:
+  std::vector<uint32_t> _leaves;
+  size_t _dataLen = 0;
+  size_t _blockSize = 0;
+  uint32_t _root = 0;
+
+  // For receiving
+  size_t _leavesReceived = 0;
+  bool _leavesVerified = false;
+  size_t _dataVerified = 0;
+  // Received data of the block after _dataVerified.
+  uint8_t* _block = nullptr;
+  size_t _blockLen = 0;
+};
+
+#endif
@@ -1,24 +1,126 @@
 #include "MeshSyncMem.h"
 
+#include "MeshSyncCompress.h"
+#include "MeshSyncDelta.h"
+
 bool MeshSyncMem::startUpdate(size_t updateLen, int newVersion, const uint8_t* metadata,
                               size_t metadataLen) {
+  return _startUpdate(updateLen, newVersion, metadata, metadataLen, false /* not a delta */);
+}
+
+bool MeshSyncMem::_startUpdate(size_t updateLen, int newVersion, const uint8_t* metadata,
+                               size_t metadataLen, bool delta) {
   assert(!_newData);
   assert(!_newMetadata);
+  assert(!_decoder);
+  CompressedHeader hdr;
+  hdr.compressed = false;
+  if (_compressedTransfers) {
+    if (metadataLen < sizeof(CompressedHeader)) {
+      return false;
+    }
+    memcpy(&hdr, metadata, sizeof(CompressedHeader));
+    metadata += sizeof(CompressedHeader);
+    metadataLen -= sizeof(CompressedHeader);
+    // The same header is advertised with the delta, but deltas are
+    // never compressed.
+    hdr.compressed &= !delta;
+  }
   _copyBuf(metadata, metadataLen, &_newMetadata, &_newMetadataLen);
-  _newData = (uint8_t*)malloc(updateLen);
-  _newDataLen = updateLen;
-  _newDataOffset = 0;
+  if (hdr.compressed) {
+    // Only the decompressed data is kept.
+    _freePartial();
+    _newData = (uint8_t*)malloc(hdr.dataLen);
+    if (!_newData && hdr.dataLen) {
+      _freeNew();
+      return false;
+    }
+    _newDataLen = hdr.dataLen;
+    _newDecompressedLen = 0;
+    _newFromPartial = false;
+    _decoder = new MeshSyncCompress::Decoder(
+        [this](const uint8_t* data, size_t len) { return _decompressedOutput(data, len); });
+  } else if (_partialData && _partialDataLen == updateLen) {
+    // Might be resuming this update; see resumeUpdate.
+    _newData = _partialData;
+    _partialData = nullptr;
+    _newFromPartial = true;
+  } else {
+    _freePartial();
+    _newData = (uint8_t*)malloc(updateLen);
+    _newFromPartial = false;
+  }
+  if (!_decoder) {
+    _newDataLen = updateLen;
+  }
   _newVersion = newVersion;
+  _receivingDelta = false;
+  return true;
+}
+
+bool MeshSyncMem::startDeltaUpdate(size_t deltaLen, int newVersion, int baseVersion,
+                                   const uint8_t* metadata, size_t metadataLen) {
+  if (!_deltaUpdates || baseVersion != localVersion() || newVersion == _deltaFailedVersion) {
+    return false;
+  }
+  // The delta is received just like the full version, and applied once it's complete.
+  if (!_startUpdate(deltaLen, newVersion, metadata, metadataLen, true /* delta */)) {
+    return false;
+  }
+  _receivingDelta = true;
   return true;
 }
 
 bool MeshSyncMem::receiveUpdateChunk(const uint8_t* chunk, size_t chunklen) {
-  memcpy(_newData + _newDataOffset, chunk, chunklen);
-  _newDataOffset += chunklen;
+  return receiveUpdateChunkAt(getNewOffset(), chunk, chunklen);
+}
+
+bool MeshSyncMem::receiveUpdateChunkAt(size_t offset, const uint8_t* chunk, size_t chunklen) {
+  if (_decoder) {
+    return _decoder->write(chunk, chunklen);
+  }
+  assert(offset + chunklen <= _newDataLen);
+  memcpy(_newData + offset, chunk, chunklen);
+  return true;
+}
+
+bool MeshSyncMem::_decompressedOutput(const uint8_t* data, size_t len) {
+  if (len > _newDataLen - _newDecompressedLen) {
+    return false;
+  }
+  memcpy(_newData + _newDecompressedLen, data, len);
+  _newDecompressedLen += len;
   return true;
 }
 
-void MeshSyncMem::onUpdateAbort() { _freeNew(); }
+size_t MeshSyncMem::resumeUpdate(size_t offset) { return _newFromPartial ? offset : 0; }
+
+void MeshSyncMem::onUpdateAbort() {
+  if (_receivingDelta) {
+    // Get the full version next time, in case it's the delta that's the problem.
+    _deltaFailedVersion = _newVersion;
+    _freeNew();
+    return;
+  }
+  if (_decoder) {
+    // Decompression can't pick up where it left off.
+    _freeNew();
+    return;
+  }
+  // Keep what we've received so far in case this update is started again.
+  _freePartial();
+  _partialData = _newData;
+  _partialDataLen = _newDataLen;
+  _newData = nullptr;
+  _freeNew();
+}
+
+void MeshSyncMem::_freePartial() {
+  if (_partialData) {
+    free(_partialData);
+    _partialData = nullptr;
+  }
+}
 
 void MeshSyncMem::_freeNew() {
   if (_newMetadata) {
@@ -29,27 +131,152 @@ void MeshSyncMem::_freeNew() {
     free(_newData);
     _newData = nullptr;
   }
+  if (_decoder) {
+    delete _decoder;
+    _decoder = nullptr;
+  }
 }
 
 void MeshSyncMem::onUpdateComplete() {
-  assert(_newDataOffset == _newDataLen);
+  assert(_decoder || getNewOffset() == _newDataLen);
+  _freePartial();
+  if (_receivingDelta) {
+    if (!_applyNewDelta()) {
+      Serial.printf("Unable to apply delta to version %d\n", _newVersion);
+      _deltaFailedVersion = _newVersion;
+      _freeNew();
+      updateFailed();
+      return;
+    }
+  } else {
+    if (_decoder && _newDecompressedLen != _newDataLen) {
+      Serial.printf("Unable to decompress version %d\n", _newVersion);
+      _freeNew();
+      updateFailed();
+      return;
+    }
+    _computeDelta(localVersion(), _data, _dataLen);
+  }
   std::swap(_data, _newData);
   std::swap(_dataLen, _newDataLen);
   std::swap(_metadata, _newMetadata);
   std::swap(_metadataLen, _newMetadataLen);
-  updateVersion(_newVersion, _dataLen);
-
+  // Free the old version first, so it isn't held while compressing.
   _freeNew();
+  // Compressing is deterministic, so this gives the same stream the
+  // provider sent if we received it compressed.
+  _compressData();
+  updateVersion(_newVersion, _streamLen());
+}
+
+void MeshSyncMem::_compressData() {
+  _freeCompressed();
+  if (!_compressedTransfers || !_dataLen) {
+    return;
+  }
+
+  // Only worth keeping if it's smaller.
+  uint8_t* compressed = (uint8_t*)malloc(_dataLen);
+  if (!compressed) {
+    return;
+  }
+  size_t compressedLen = MeshSyncCompress::compress(_data, _dataLen, compressed, _dataLen - 1);
+  if (!compressedLen) {
+    free(compressed);
+    return;
+  }
+  _compressed = (uint8_t*)realloc(compressed, compressedLen);
+  _compressedLen = compressedLen;
+}
+
+void MeshSyncMem::_freeCompressed() {
+  if (_compressed) {
+    free(_compressed);
+    _compressed = nullptr;
+  }
+  _compressedLen = 0;
+}
+
+bool MeshSyncMem::_applyNewDelta() {
+  int newLen = MeshSyncDelta::targetLen(_newData, _newDataLen);
+  if (newLen < 0) {
+    return false;
+  }
+  uint8_t* newData = (uint8_t*)malloc(newLen);
+  if (!newData && newLen) {
+    return false;
+  }
+  if (!MeshSyncDelta::apply(_data, _dataLen, _newData, _newDataLen, newData, newLen)) {
+    free(newData);
+    return false;
+  }
+
+  // Keep the delta we received so we can pass it on.
+  _freeDelta();
+  _delta = _newData;
+  _deltaLen = _newDataLen;
+  _deltaBase = localVersion();
+
+  _newData = newData;
+  _newDataLen = newLen;
+  return true;
+}
+
+void MeshSyncMem::_computeDelta(int baseVersion, const uint8_t* base, size_t baseLen) {
+  _freeDelta();
+  if (!_deltaUpdates || baseVersion < 0 || !_newDataLen) {
+    return;
+  }
+
+  // Only worth keeping if it's smaller than the new version.
+  uint8_t* delta = (uint8_t*)malloc(_newDataLen);
+  if (!delta) {
+    return;
+  }
+  size_t deltaLen =
+      MeshSyncDelta::encode(base, baseLen, _newData, _newDataLen, delta, _newDataLen - 1);
+  if (!deltaLen) {
+    free(delta);
+    return;
+  }
+  _delta = (uint8_t*)realloc(delta, deltaLen);
+  _deltaLen = deltaLen;
+  _deltaBase = baseVersion;
+}
+
+void MeshSyncMem::_freeDelta() {
+  if (_delta) {
+    free(_delta);
+    _delta = nullptr;
+  }
+  _deltaLen = 0;
+  _deltaBase = -1;
+}
+
+int MeshSyncMem::provideDeltaBase() const { return _delta ? _deltaBase : -1; }
+
+bool MeshSyncMem::provideDeltaChunk(size_t offset, uint8_t* chunk, size_t size) {
+  memcpy(chunk, _delta + offset, size);
+  return true;
 }
 
 int MeshSyncMem::provideUpdateMetadata(uint8_t* metadata, size_t maxlen) {
-  assert(_metadataLen <= maxlen);
-  memcpy(metadata, _metadata, _metadataLen);
-  return _metadataLen;
+  size_t hdrLen = 0;
+  if (_compressedTransfers) {
+    CompressedHeader hdr;
+    hdr.compressed = _compressed != nullptr;
+    hdr.dataLen = _dataLen;
+    assert(sizeof(CompressedHeader) <= maxlen);
+    memcpy(metadata, &hdr, sizeof(CompressedHeader));
+    hdrLen = sizeof(CompressedHeader);
+  }
+  assert(hdrLen + _metadataLen <= maxlen);
+  memcpy(metadata + hdrLen, _metadata, _metadataLen);
+  return hdrLen + _metadataLen;
 }
 
 bool MeshSyncMem::provideUpdateChunk(size_t offset, uint8_t* chunk, size_t size) {
-  memcpy(chunk, _data + offset, size);
+  memcpy(chunk, (_compressed ? _compressed : _data) + offset, size);
   return true;
 }
 
@@ -61,8 +288,16 @@ void MeshSyncMem::update(int version, String metadata, String data) {
 void MeshSyncMem::update(int version, const uint8_t* metadata, size_t metadataLen,
                          const uint8_t* data, size_t dataLen) {
   _copyBuf(metadata, metadataLen, &_metadata, &_metadataLen);
-  _copyBuf(data, dataLen, &_data, &_dataLen);
-  updateVersion(version, _dataLen);
+  _freeNew();
+  _copyBuf(data, dataLen, &_newData, &_newDataLen);
+  _computeDelta(localVersion(), _data, _dataLen);
+  std::swap(_data, _newData);
+  std::swap(_dataLen, _newDataLen);
+  _compressData();
+  updateVersion(version, _streamLen());
+  _freeNew();
+  // Anything kept by aborting an update in progress is no longer useful.
+  _freePartial();
 }
 
 void MeshSyncMem::_copyBuf(const uint8_t* src, size_t srclen, uint8_t** dst, size_t* dstlen) {
@@ -79,6 +314,9 @@ MeshSyncMem::~MeshSyncMem() {
   if (_data) free(_data);
 
   _freeNew();
+  _freePartial();
+  _freeDelta();
+  _freeCompressed();
 }
 
 String MeshSyncMem::localData() const { return _bufToString(_data, _dataLen); }
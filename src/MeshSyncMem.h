@@ -2,6 +2,7 @@
 #define MESH_SYNC_METADATA_H
 
 #include "MeshSync.h"
+#include "MeshSyncCompress.h"
 
 // In-memory sync.  The synchronized data must be small enough to be
 // kept in memory.  The synchronized metadata must be small enought to
@@ -30,18 +31,56 @@ class MeshSyncMem : public MeshSync {
   const uint8_t* localMetadataBuffer() const { return _metadata; }
   size_t localMetadataBufferLen() const { return _metadataLen; }
 
+  // If enabled, keep a delta from the previous version to the current
+  // one, and offer it to nodes that still have the previous version.
+  // Nodes that have the previous version and also have delta updates
+  // enabled can then fetch only what changed.  Disabled by default.
+  void deltaUpdates(bool enable) { _deltaUpdates = enable; }
+
+  // If enabled, data is compressed before sending it, if that makes it
+  // smaller.  This adds a small header to the advertised metadata, so
+  // all nodes syncing this data must agree on whether it's enabled.
+  // Must be set before calling update.  Disabled by default.
+  //
+  // Compressed updates are decompressed as they arrive, so receiving
+  // one only needs room for the new data and the decompression window,
+  // not the compressed stream as well.  They're received in order, and
+  // start over instead of resuming if they're interrupted.
+  // localSize() is then the length of the compressed stream that's
+  // sent; localDataBufferLen() is the length of the data.
+  void compressedTransfers(bool enable) { _compressedTransfers = enable; }
+
  private:
   bool startUpdate(size_t updateLen, int newVersion, const uint8_t* metadata,
                    size_t metadataLen) override;
   bool receiveUpdateChunk(const uint8_t* chunk, size_t chunklen) override;
+  // Compressed updates have to be decompressed in order.
+  bool canReceiveOutOfOrder() const override { return !_decoder; }
+  bool receiveUpdateChunkAt(size_t offset, const uint8_t* chunk, size_t chunklen) override;
+  size_t resumeUpdate(size_t offset) override;
   void onUpdateAbort() override;
   void onUpdateComplete() override;
   int provideUpdateMetadata(uint8_t* metadata, size_t maxlen) override;
   bool provideUpdateChunk(size_t offset, uint8_t* chunk, size_t size) override;
+  int provideDeltaBase() const override;
+  size_t provideDeltaLen() const override { return _deltaLen; }
+  bool provideDeltaChunk(size_t offset, uint8_t* chunk, size_t size) override;
+  bool startDeltaUpdate(size_t deltaLen, int newVersion, int baseVersion, const uint8_t* metadata,
+                        size_t metadataLen) override;
 
+  bool _startUpdate(size_t updateLen, int newVersion, const uint8_t* metadata, size_t metadataLen,
+                    bool delta);
   static void _copyBuf(const uint8_t* src, size_t srclen, uint8_t** dst, size_t* dstlen);
   static String _bufToString(const uint8_t* buf, size_t buflen);
   void _freeNew();
+  void _freePartial();
+  void _freeDelta();
+  void _freeCompressed();
+  void _compressData();
+  bool _decompressedOutput(const uint8_t* data, size_t len);
+  size_t _streamLen() const { return _compressed ? _compressedLen : _dataLen; }
+  void _computeDelta(int baseVersion, const uint8_t* base, size_t baseLen);
+  bool _applyNewDelta();
 
   uint8_t* _data = nullptr;
   size_t _dataLen = 0;
@@ -54,9 +93,44 @@ class MeshSyncMem : public MeshSync {
 
   uint8_t* _newData = nullptr;
   size_t _newDataLen = 0;
-  size_t _newDataOffset = 0;
 
   int _newVersion;
+
+  // Data received by the most recently aborted update, in case it's resumed.
+  uint8_t* _partialData = nullptr;
+  size_t _partialDataLen = 0;
+  // True if _newData was taken from _partialData.
+  bool _newFromPartial = false;
+
+  // Precedes the metadata when _compressedTransfers is enabled.
+  struct CompressedHeader {
+    bool compressed;
+    // Uncompressed length of the data.
+    size_t dataLen;
+  };
+
+  bool _compressedTransfers = false;
+
+  // Compressed version of _data to send, if _compressed is not null.
+  uint8_t* _compressed = nullptr;
+  size_t _compressedLen = 0;
+
+  // Decompresses into _newData while receiving a compressed update.
+  MeshSyncCompress::Decoder* _decoder = nullptr;
+  // Bytes of _newData decompressed so far.
+  size_t _newDecompressedLen = 0;
+
+  bool _deltaUpdates = false;
+
+  // Delta from version _deltaBase to our local version, if _delta is not null.
+  uint8_t* _delta = nullptr;
+  size_t _deltaLen = 0;
+  int _deltaBase = -1;
+
+  // True if _newData holds a delta instead of the new version.
+  bool _receivingDelta = false;
+  // Version whose delta didn't apply; get the full version instead.
+  int _deltaFailedVersion = -1;
 };
 
 #endif
@@ -0,0 +1,25 @@
+#include "MeshSyncResume.h"
+
+#include <stdio.h>
+
+bool MeshSyncFileResumeStore::loadState(State* state) {
+  FILE* f = fopen(_path.c_str(), "rb");
+  if (!f) {
+    return false;
+  }
+  bool res = fread(state, sizeof(State), 1, f) == 1;
+  fclose(f);
+  return res;
+}
+
+void MeshSyncFileResumeStore::saveState(const State& state) {
+  FILE* f = fopen(_path.c_str(), "wb");
+  if (!f) {
+    Serial.printf("Unable to save resume state to %s\n", _path.c_str());
+    return;
+  }
+  fwrite(&state, sizeof(State), 1, f);
+  fclose(f);
+}
+
+void MeshSyncFileResumeStore::clearState() { remove(_path.c_str()); }
@@ -0,0 +1,41 @@
+#ifndef MESH_SYNC_RESUME_H
+#define MESH_SYNC_RESUME_H
+
+#include <Arduino.h>
+
+// Persists how far a MeshSync update got, so it can be resumed after
+// a reboot instead of starting over.  See MeshSync::resumeStore.
+class MeshSyncResumeStore {
+ public:
+  struct State {
+    int version;
+    // Length of the data being transferred.
+    size_t len;
+    // Identifies the update along with its version and length; see MeshSync::resumeDigest.
+    uint32_t digest;
+    // Number of bytes at the start of the update that have been received.
+    size_t offset;
+  };
+
+  virtual ~MeshSyncResumeStore() {}
+
+  // Returns false if there's no saved state.
+  virtual bool loadState(State* state) = 0;
+  virtual void saveState(const State& state) = 0;
+  virtual void clearState() = 0;
+};
+
+// Keeps the state in a file using C stdio, e.g. for host builds.
+class MeshSyncFileResumeStore : public MeshSyncResumeStore {
+ public:
+  explicit MeshSyncFileResumeStore(const String& path) : _path(path) {}
+
+  bool loadState(State* state) override;
+  void saveState(const State& state) override;
+  void clearState() override;
+
+ private:
+  String _path;
+};
+
+#endif
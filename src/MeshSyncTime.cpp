@@ -2,22 +2,52 @@
 
 #include <limits>
 
+constexpr size_t MeshSyncTime::MAX_SKEW_SAMPLES;
+constexpr uint32_t MeshSyncTime::MIN_SKEW_SPAN_MS;
+constexpr int32_t MeshSyncTime::MAX_SKEW_PPB;
+constexpr uint8_t MeshSyncTime::NO_STRATUM;
+
 MeshSyncTime::MeshSyncTime() {
-  _syncStart = millis() - random(0, TRANSMIT_INTERVAL_MS);
-  _adjustmentEnd = millis();
-  _nextTransmit = millis() + random(0, TRANSMIT_INTERVAL_MS);
+  _syncStart = MeshClock::millis() - MeshClock::random(0, TRANSMIT_INTERVAL_MS);
+  _adjustmentEnd = MeshClock::millis();
+  _nextTransmit = MeshClock::millis() + MeshClock::random(0, TRANSMIT_INTERVAL_MS);
+}
+
+void MeshSyncTime::electRoot(const uint8_t* localAddr) {
+  uint32_t now = MeshClock::millis();
+  _electRoot = true;
+  memcpy(_localAddr, localAddr, ETH_ADDR_LEN);
+  _becomeRoot(now);
+  // Our own timeline starts now; ties go to addresses, not to the
+  // random start we use otherwise.
+  _syncStart = now;
 }
 
 void MeshSyncTime::onPacketReceived(const ProtoDispatchPktHdr*  hdr, const uint8_t* pkt,
                                     size_t len) {
+  if (_electRoot) {
+    if (len != sizeof(MeshSyncTimeData) + sizeof(MeshSyncTimeRootData)) {
+      return;
+    }
+    MeshSyncTimeData remoteData;
+    MeshSyncTimeRootData rootData;
+    memcpy(&remoteData, pkt, sizeof(MeshSyncTimeData));
+    memcpy(&rootData, pkt + sizeof(MeshSyncTimeData), sizeof(MeshSyncTimeRootData));
+    _receiveRootSync(hdr, remoteData, rootData, MeshClock::millis());
+    return;
+  }
+
   if (len != sizeof(MeshSyncTimeData)) {
     return;
   }
 
   MeshSyncTimeData remoteData;
   memcpy(&remoteData, pkt, sizeof(MeshSyncTimeData));
+  receiveSync(hdr, remoteData);
+}
 
-  uint32_t now = millis();
+void MeshSyncTime::receiveSync(const ProtoDispatchPktHdr* hdr, const MeshSyncTimeData& remoteData,
+                               uint32_t now) {
   if (_receiveHook) {
     _receiveHook(hdr, remoteData.syncedMillis - localToSynced(now), remoteData.syncedDuration);
   }
@@ -28,14 +58,118 @@ void MeshSyncTime::onPacketReceived(const ProtoDispatchPktHdr*  hdr, const uint8
     return;
   }
 
-  applySync(remoteData.syncedMillis, now);
+  _applyRemoteSync(remoteData.syncedMillis, now);
   _syncStart = now - (remoteData.syncedDuration * 3/4);
 }
 
-void MeshSyncTime::applySync(uint32_t newSyncedMillis, uint32_t now) {
+void MeshSyncTime::_applyRemoteSync(uint32_t synced, uint32_t now) {
+  if (_skewCompensation) {
+    synced = _addSkewSample(now, synced);
+  }
+  applySync(synced, now);
+}
+
+void MeshSyncTime::_receiveRootSync(const ProtoDispatchPktHdr* hdr,
+                                    const MeshSyncTimeData& remoteData,
+                                    const MeshSyncTimeRootData& rootData, uint32_t now) {
+  if (_receiveHook) {
+    _receiveHook(hdr, remoteData.syncedMillis - localToSynced(now), remoteData.syncedDuration);
+  }
+  _checkRootTimeouts(now);
+
+  if (memcmp(rootData.root, _root, ETH_ADDR_LEN) != 0) {
+    if (_haveDeadRoot && memcmp(rootData.root, _deadRoot, ETH_ADDR_LEN) == 0 &&
+        !_seqIsAfter(rootData.rootSeq, _deadRootSeq)) {
+      // Old news from a neighbor that hasn't noticed the root is gone.
+      return;
+    }
+    if (!_isBetterRoot(rootData, now)) {
+      // Our neighbor will switch to our root when it hears from us.
+      return;
+    }
+    memcpy(_root, rootData.root, ETH_ADDR_LEN);
+    _rootSeq = rootData.rootSeq;
+    _rootHeard = now;
+    _syncStart = now - rootData.rootAge;
+    _followParent(hdr->src, rootData.stratum, now);
+    _applyRemoteSync(remoteData.syncedMillis, now);
+    // Let our neighbors know about the new root soon, so it spreads
+    // across the mesh a hop at a time instead of a transmit interval
+    // at a time.
+    _nextTransmit = now + MeshClock::random(0, TRIGGERED_TRANSMIT_MS);
+    return;
+  }
+
+  if (_isRoot()) {
+    return;
+  }
+  bool fresh = _seqIsAfter(rootData.rootSeq, _rootSeq);
+  if (fresh) {
+    _rootSeq = rootData.rootSeq;
+    _rootHeard = now;
+  }
+  bool fromParent = _stratum != NO_STRATUM && memcmp(hdr->src, _parent, ETH_ADDR_LEN) == 0;
+  if (!fromParent) {
+    // Only switch to a neighbor closer to the root.  If we've lost
+    // the one we were following, the new one must have heard from the
+    // root more recently than we have, so it isn't following us.
+    if (rootData.stratum + 1 >= _stratum || (_stratum == NO_STRATUM && !fresh)) {
+      return;
+    }
+  }
+  _followParent(hdr->src, rootData.stratum, now);
+  _applyRemoteSync(remoteData.syncedMillis, now);
+}
+
+bool MeshSyncTime::_isBetterRoot(const MeshSyncTimeRootData& rootData, uint32_t now) const {
+  uint32_t ourAge = syncedDuration(now);
+  if (rootData.rootAge > ourAge + AGE_TOLERANCE_MS) {
+    return true;
+  }
+  if (ourAge > rootData.rootAge + AGE_TOLERANCE_MS) {
+    return false;
+  }
+  return memcmp(rootData.root, _root, ETH_ADDR_LEN) < 0;
+}
+
+void MeshSyncTime::_becomeRoot(uint32_t now) {
+  memcpy(_root, _localAddr, ETH_ADDR_LEN);
+  _stratum = 0;
+  _rootHeard = now;
+}
+
+void MeshSyncTime::_followParent(const uint8_t* parent, uint8_t parentStratum, uint32_t now) {
+  memcpy(_parent, parent, ETH_ADDR_LEN);
+  _parentHeard = now;
+  _stratum = parentStratum < NO_STRATUM - 1 ? parentStratum + 1 : NO_STRATUM;
+}
+
+void MeshSyncTime::_checkRootTimeouts(uint32_t now) {
+  if (_isRoot()) {
+    return;
+  }
+  if (now - _rootHeard > ROOT_TIMEOUT_MS) {
+    // Carry on the root's timeline ourselves.  Other nodes that lost
+    // it too will settle on the lowest address among us, without
+    // their clocks jumping.
+    _haveDeadRoot = true;
+    memcpy(_deadRoot, _root, ETH_ADDR_LEN);
+    _deadRootSeq = _rootSeq;
+    _becomeRoot(now);
+    _nextTransmit = now + MeshClock::random(0, TRIGGERED_TRANSMIT_MS);
+    return;
+  }
+  if (_stratum != NO_STRATUM && now - _parentHeard > PARENT_TIMEOUT_MS) {
+    _stratum = NO_STRATUM;
+  }
+}
+
+void MeshSyncTime::applySync(uint32_t newSyncedMillis, uint32_t localNow) {
+  uint32_t now = _correct(localNow);
+
   // If we're in the middle of an adjustment, apply the adjustment so far before
   // resetting the adjustment.
-  _originOffset = localToSynced(now) - now;
+  _originOffset = _correctedToSynced(now) - now;
 
   uint32_t newOriginOffset = newSyncedMillis - now;
 
@@ -45,6 +179,7 @@ void MeshSyncTime::applySync(uint32_t newSyncedMillis, uint32_t now) {
     // Run double time for the adjustment time.
     _adjustForward = true;
     _adjustmentEnd = now + forwardAdjust;
+    _syncErrorMs = forwardAdjust;
     if (_adjustHook) {
       _adjustHook(forwardAdjust);
     }
@@ -52,6 +187,7 @@ void MeshSyncTime::applySync(uint32_t newSyncedMillis, uint32_t now) {
     // Run half time for double the adjustment time.
     _adjustForward = false;
     _adjustmentEnd = now + backwardAdjust * 2;
+    _syncErrorMs = backwardAdjust;
     if (_adjustHook) {
       _adjustHook(-backwardAdjust);
     }
@@ -61,17 +197,91 @@ void MeshSyncTime::applySync(uint32_t newSyncedMillis, uint32_t now) {
     if (_jumpHook) {
       _jumpHook(forwardAdjust);
     }
+    // Earlier sync packets were from a different timeline.
+    _skewSamples.clear();
   }
 
   _originOffset = newOriginOffset;
 }
 
+void MeshSyncTime::skewCompensation(bool enable) {
+  _skewCompensation = enable;
+  if (!enable) {
+    _skewSamples.clear();
+    _setSkew(0, MeshClock::millis());
+  }
+}
+
+uint32_t MeshSyncTime::_addSkewSample(uint32_t now, uint32_t synced) {
+  if (_skewSamples.size() == MAX_SKEW_SAMPLES) {
+    _skewSamples.pop_front();
+  }
+  _skewSamples.push_back({now, synced});
+
+  const SkewSample& first = _skewSamples.front();
+  const SkewSample& last = _skewSamples.back();
+  if (_skewSamples.size() < 3 || last.local - first.local < MIN_SKEW_SPAN_MS) {
+    return synced;
+  }
+
+  // Fit offset = synced - local as a line over local time.  Its slope
+  // is how much faster the synced clock runs than ours.
+  double n = _skewSamples.size();
+  double sumX = 0, sumY = 0, sumXX = 0, sumXY = 0;
+  for (const SkewSample& sample : _skewSamples) {
+    double x = int32_t(sample.local - last.local);
+    double y = int32_t((sample.synced - sample.local) - (last.synced - last.local));
+    sumX += x;
+    sumY += y;
+    sumXX += x * x;
+    sumXY += x * y;
+  }
+  double denom = n * sumXX - sumX * sumX;
+  if (denom <= 0) {
+    return synced;
+  }
+  double slope = (n * sumXY - sumX * sumY) / denom;
+  // Difference between the line and this packet's offset.  Using the
+  // line instead of just this packet averages out delivery jitter.
+  double intercept = (sumY - slope * sumX) / n;
+  double ppb = slope * 1e9;
+  if (ppb > MAX_SKEW_PPB || ppb < -MAX_SKEW_PPB || intercept > MAX_ADJUST_MS ||
+      intercept < -double(MAX_ADJUST_MS)) {
+    // Something's wrong with the samples; start over.
+    _skewSamples.clear();
+    _skewSamples.push_back({now, synced});
+    return synced;
+  }
+  _setSkew(int32_t(ppb), now);
+  return synced + int32_t(lround(intercept));
+}
+
+void MeshSyncTime::_setSkew(int32_t ppb, uint32_t now) {
+  // Keep corrected time continuous.
+  _skewBase = _correct(now) - now;
+  _skewRef = now;
+  _skewPpb = ppb;
+}
+
+uint32_t MeshSyncTime::_correct(uint32_t localMillis) const {
+  int64_t sinceRef = int32_t(localMillis - _skewRef);
+  return localMillis + _skewBase + int32_t(sinceRef * _skewPpb / 1000000000);
+}
+
+uint32_t MeshSyncTime::_uncorrect(uint32_t correctedMillis) const {
+  int64_t sinceRef = int32_t(correctedMillis - _skewBase - _skewRef);
+  return _skewRef + int32_t(sinceRef * 1000000000 / (1000000000 + _skewPpb));
+}
+
 int MeshSyncTime::sendIfNeeded(uint8_t* ethaddr, uint8_t* pkt, size_t maxlen) {
-  uint32_t now = millis();
+  uint32_t now = MeshClock::millis();
+  if (_electRoot) {
+    _checkRootTimeouts(now);
+  }
   if (!timeIsAfter(now, _nextTransmit)) {
     return -1;
   }
-  _nextTransmit = now + random(TRANSMIT_INTERVAL_MS, 2 * TRANSMIT_INTERVAL_MS);
+  _nextTransmit = now + MeshClock::random(TRANSMIT_INTERVAL_MS, 2 * TRANSMIT_INTERVAL_MS);
 
   assert(maxlen >= sizeof(MeshSyncTimeData));
 
@@ -81,13 +291,31 @@ int MeshSyncTime::sendIfNeeded(uint8_t* ethaddr, uint8_t* pkt, size_t maxlen) {
 
   memset(ethaddr, 0xFF, 6);
   memcpy(pkt, &data, sizeof(data));
-  return sizeof(data);
+  if (!_electRoot) {
+    return sizeof(data);
+  }
+
+  assert(maxlen >= sizeof(MeshSyncTimeData) + sizeof(MeshSyncTimeRootData));
+  if (_isRoot()) {
+    ++_rootSeq;
+  }
+  MeshSyncTimeRootData rootData;
+  rootData.rootAge = syncedDuration(now);
+  rootData.rootSeq = _rootSeq;
+  memcpy(rootData.root, _root, ETH_ADDR_LEN);
+  rootData.stratum = _stratum;
+  memcpy(pkt + sizeof(data), &rootData, sizeof(rootData));
+  return sizeof(data) + sizeof(rootData);
 }
 
 uint32_t MeshSyncTime::localToSynced(uint32_t localMillis) const {
-  uint32_t adjusted = localMillis + _originOffset;
-  if (timeIsAfter(_adjustmentEnd, localMillis)) {
-    uint32_t timeUntilAdjustmentDone = _adjustmentEnd - localMillis;
+  return _correctedToSynced(_correct(localMillis));
+}
+
+uint32_t MeshSyncTime::_correctedToSynced(uint32_t correctedMillis) const {
+  uint32_t adjusted = correctedMillis + _originOffset;
+  if (timeIsAfter(_adjustmentEnd, correctedMillis)) {
+    uint32_t timeUntilAdjustmentDone = _adjustmentEnd - correctedMillis;
 
     // "adjusted" is what the time should be at _adjustmentEnd.
     // If we're before then, we need to compensate.
@@ -103,6 +331,10 @@ uint32_t MeshSyncTime::localToSynced(uint32_t localMillis) const {
 }
 
 uint32_t MeshSyncTime::syncedToLocal(uint32_t syncedMillis) const {
+  return _uncorrect(_syncedToCorrected(syncedMillis));
+}
+
+uint32_t MeshSyncTime::_syncedToCorrected(uint32_t syncedMillis) const {
   uint32_t adjusted = syncedMillis - _originOffset;
   if (timeIsAfter(_adjustmentEnd, adjusted)) {
     // Time in synced seconds.
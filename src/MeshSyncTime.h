@@ -1,6 +1,7 @@
 #ifndef MESH_SYNC_TIME_H
 #define MESH_SYNC_TIME_H
 
+#include <deque>
 #include <functional>
 
 #include "MeshSync.h"
@@ -13,14 +14,64 @@ struct MeshSyncTimeData {
   uint32_t syncedDuration;
 };
 
+// Follows MeshSyncTimeData when electing a root; see MeshSyncTime::electRoot.
+struct MeshSyncTimeRootData {
+  // Length of time (in millis) since the root started its timeline.
+  uint32_t rootAge;
+  // Incremented by the root each time it transmits, so other nodes can
+  // tell it's still around.
+  uint16_t rootSeq;
+  // Node everyone is synchronizing to.
+  uint8_t root[ProtoDispatchTarget::ETH_ADDR_LEN];
+  // Number of hops from the root; 0 for the root itself.
+  uint8_t stratum;
+};
+
 class MeshSyncTime : public ProtoDispatchTarget {
  public:
   MeshSyncTime();
   void onPacketReceived(const ProtoDispatchPktHdr* hdr, const uint8_t* pkt, size_t len) override;
   int sendIfNeeded(uint8_t* ethaddr, uint8_t* pkt, size_t maxlen) override;
 
-  void applySync(uint32_t synced, uint32_t now = millis());
-  uint32_t syncedDuration(uint32_t now = millis()) const;
+  // Handles a sync packet received from another node at local time now.
+  void receiveSync(const ProtoDispatchPktHdr* hdr, const MeshSyncTimeData& remoteData,
+                   uint32_t now = MeshClock::millis());
+
+  void applySync(uint32_t synced, uint32_t now = MeshClock::millis());
+  uint32_t syncedDuration(uint32_t now = MeshClock::millis()) const;
+
+  // If enabled, the difference between the rate of our clock and the
+  // synced clock is estimated with a linear regression over recent
+  // sync packets, and corrected for continuously.  Otherwise crystal
+  // drift builds up between sync packets and is only corrected when
+  // the next one arrives.  Disabled by default.
+  void skewCompensation(bool enable);
+  // Estimated rate of the synced clock relative to ours, minus 1, in
+  // parts per billion.
+  int32_t skewPpb() const { return _skewPpb; }
+
+  // If enabled, nodes elect a single root and synchronize to it over a
+  // tree, instead of each following whichever neighbor has been synced
+  // longest.  localAddr is the address the dispatcher sends from, e.g.
+  // from WiFi.macAddress().  The root is the node whose timeline has
+  // been running longest, with ties of up to AGE_TOLERANCE_MS going to
+  // the lowest address, and each node follows the neighbor with the
+  // fewest hops to the root.  Nodes that switch to a new root tell
+  // their neighbors right away, so a merged mesh settles within a few
+  // packets per hop.  Nodes without this enabled ignore our packets and
+  // vice versa, so all nodes should agree on it.  Disabled by default.
+  void electRoot(const uint8_t* localAddr);
+  // Root we're synchronizing to, and our number of hops from it.
+  // stratum() is NO_STRATUM if we've lost the neighbor we were
+  // following and haven't found another yet.
+  const uint8_t* root() const { return _root; }
+  uint8_t stratum() const { return _stratum; }
+  static constexpr uint8_t NO_STRATUM = 255;
+
+  // Size (in millis) of the most recent correction to our synced
+  // clock, which is about how far it drifts from the node we follow
+  // between sync packets.  0 until a sync packet adjusts the clock.
+  uint32_t syncErrorMs() const { return _syncErrorMs; }
 
   uint32_t localToSynced(uint32_t localMillis) const;
   uint32_t syncedToLocal(uint32_t syncedMillis) const;
@@ -41,7 +92,54 @@ class MeshSyncTime : public ProtoDispatchTarget {
 
   static constexpr uint32_t MAX_ADJUST_MS = 1000;
 
-  // Local millis of when synchronized time started.
+  // Number of recent sync packets the skew estimate is based on.
+  static constexpr size_t MAX_SKEW_SAMPLES = 16;
+  // Sync packets spanning less time than this aren't enough for an estimate.
+  static constexpr uint32_t MIN_SKEW_SPAN_MS = 30 * 1000;
+  // Estimates larger than this are assumed to be wrong.
+  static constexpr int32_t MAX_SKEW_PPB = 500 * 1000;
+
+  // Roots whose timelines started within this long of each other are
+  // considered the same age, and the lowest address wins.
+  static constexpr uint32_t AGE_TOLERANCE_MS = 2000;
+  // If we don't hear from the neighbor we're following for this long,
+  // we look for another.
+  static constexpr uint32_t PARENT_TIMEOUT_MS = 6 * TRANSMIT_INTERVAL_MS;
+  // If the root's sequence number doesn't advance for this long, we
+  // assume it's gone and carry on its timeline as a root ourselves.
+  static constexpr uint32_t ROOT_TIMEOUT_MS = 9 * TRANSMIT_INTERVAL_MS;
+  // Maximum delay before transmitting after switching to a new root.
+  static constexpr uint32_t TRIGGERED_TRANSMIT_MS = 500;
+
+  struct SkewSample {
+    uint32_t local;
+    uint32_t synced;
+  };
+
+  // Local time corrected for skew.  Offsets and adjustments are all
+  // kept in corrected time.
+  uint32_t _correct(uint32_t localMillis) const;
+  uint32_t _uncorrect(uint32_t correctedMillis) const;
+  uint32_t _correctedToSynced(uint32_t correctedMillis) const;
+  uint32_t _syncedToCorrected(uint32_t syncedMillis) const;
+  // Adds a sync packet to the skew estimate, and returns the synced
+  // time at now according to the estimate.
+  uint32_t _addSkewSample(uint32_t now, uint32_t synced);
+  void _setSkew(int32_t ppb, uint32_t now);
+  // Adopts a synced time received from another node.
+  void _applyRemoteSync(uint32_t synced, uint32_t now);
+
+  void _receiveRootSync(const ProtoDispatchPktHdr* hdr, const MeshSyncTimeData& remoteData,
+                        const MeshSyncTimeRootData& rootData, uint32_t now);
+  bool _isRoot() const { return memcmp(_root, _localAddr, ETH_ADDR_LEN) == 0; }
+  bool _isBetterRoot(const MeshSyncTimeRootData& rootData, uint32_t now) const;
+  void _becomeRoot(uint32_t now);
+  void _followParent(const uint8_t* parent, uint8_t parentStratum, uint32_t now);
+  void _checkRootTimeouts(uint32_t now);
+  static bool _seqIsAfter(uint16_t seq, uint16_t ref) { return uint16_t(ref - seq) >> 15; }
+
+  // Local millis of when synchronized time started.  When electing a
+  // root, this is when the root started its timeline.
   uint32_t _syncStart = 0;
 
   // Offset of origin with relation to local time.
@@ -57,9 +155,36 @@ class MeshSyncTime : public ProtoDispatchTarget {
   // Time in local millis when we're ending our adjustment.
   uint32_t _adjustmentEnd = 0;
 
+  // Most recent adjustment, not counting jumps.
+  uint32_t _syncErrorMs = 0;
+
   // Next time to transmit our synchronizing packet
   uint32_t _nextTransmit = 0;
 
+  bool _skewCompensation = false;
+  // _correct(local) = local + _skewBase + (local - _skewRef) * _skewPpb / 10^9
+  int32_t _skewPpb = 0;
+  uint32_t _skewRef = 0;
+  int32_t _skewBase = 0;
+  // Recent sync packets we applied, oldest first.
+  std::deque<SkewSample> _skewSamples;
+
+  bool _electRoot = false;
+  uint8_t _localAddr[ETH_ADDR_LEN] = {};
+  uint8_t _root[ETH_ADDR_LEN] = {};
+  uint8_t _stratum = 0;
+  // Latest sequence number from the root, and when we first heard it.
+  uint16_t _rootSeq = 0;
+  uint32_t _rootHeard = 0;
+  // Neighbor we're following, and when we last heard from it.
+  uint8_t _parent[ETH_ADDR_LEN] = {};
+  uint32_t _parentHeard = 0;
+  // Last root we timed out, so we don't go back to it when we hear
+  // from neighbors that haven't noticed yet.
+  bool _haveDeadRoot = false;
+  uint8_t _deadRoot[ETH_ADDR_LEN] = {};
+  uint16_t _deadRootSeq = 0;
+
   adjust_hook_func_t _adjustHook;
   jump_hook_func_t _jumpHook;
   receive_hook_func_t _receiveHook;
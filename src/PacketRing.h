@@ -0,0 +1,105 @@
+#ifndef PACKET_RING_H
+#define PACKET_RING_H
+
+#include <stdlib.h>
+
+#include <atomic>
+
+#include "ProtoDispatch.h"
+
+// Fixed size queue of received packets, for handing packets from a
+// WiFi callback to the main loop without doing any work in the
+// callback.  Safe without locking as long as only one context pushes
+// packets and only one context pops them.
+//
+// The slots are allocated by begin(), so a ring that's never used
+// doesn't take any memory.
+template <size_t MaxLen>
+class PacketRing {
+ public:
+  struct Packet {
+    ProtoDispatchPktHdr hdr;
+    size_t len;
+    uint8_t data[MaxLen];
+  };
+
+  ~PacketRing() { free(_slots); }
+
+  // Allocates room for numSlots packets, which must be a power of 2.
+  // Must be called once, before anything pushes packets.  Returns false
+  // if there isn't enough memory.
+  bool begin(size_t numSlots) {
+    assert(numSlots && (numSlots & (numSlots - 1)) == 0);
+    assert(!_slots);
+    _slots = (Packet*)malloc(numSlots * sizeof(Packet));
+    if (!_slots) {
+      return false;
+    }
+    _numSlots = numSlots;
+    return true;
+  }
+
+  // Called by the producer.  Copies the packet into the ring.  Returns
+  // false and counts an overflow if the ring is full or the packet is
+  // longer than MaxLen.
+  bool push(const ProtoDispatchPktHdr& hdr, const uint8_t* data, size_t len) {
+    uint32_t head = _head.load(std::memory_order_relaxed);
+    uint32_t used = head - _tail.load(std::memory_order_acquire);
+    if (used == _numSlots || len > MaxLen) {
+      // Only the producer writes this, so it doesn't need an atomic increment.
+      _overflows.store(_overflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      return false;
+    }
+    Packet& pkt = _slots[head & (_numSlots - 1)];
+    pkt.hdr = hdr;
+    pkt.len = len;
+    memcpy(pkt.data, data, len);
+    _head.store(head + 1, std::memory_order_release);
+
+    if (used + 1 > _highWater.load(std::memory_order_relaxed)) {
+      _highWater.store(used + 1, std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  // Called by the consumer.  Returns the oldest packet, or null if the
+  // ring is empty.  The packet stays valid until pop() is called.
+  const Packet* front() const {
+    uint32_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail == _head.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    return &_slots[tail & (_numSlots - 1)];
+  }
+
+  // Called by the consumer to discard the packet returned by front().
+  void pop() {
+    uint32_t tail = _tail.load(std::memory_order_relaxed);
+    assert(tail != _head.load(std::memory_order_acquire));
+    _tail.store(tail + 1, std::memory_order_release);
+  }
+
+  size_t size() const {
+    return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+  }
+
+  // Number of packets dropped because the ring was full or they were too long.
+  uint32_t overflows() const { return _overflows.load(std::memory_order_relaxed); }
+  // Largest number of packets that have been waiting at once.
+  uint32_t highWater() const { return _highWater.load(std::memory_order_relaxed); }
+
+ private:
+  Packet* _slots = nullptr;
+  size_t _numSlots = 0;
+
+  // Only written by the producer; next slot to fill.
+  std::atomic<uint32_t> _head{0};
+  // Only written by the consumer; next slot to read.
+  std::atomic<uint32_t> _tail{0};
+
+  // Only written by the producer.
+  std::atomic<uint32_t> _overflows{0};
+  std::atomic<uint32_t> _highWater{0};
+};
+
+#endif
@@ -0,0 +1,64 @@
+#include "PeerCache.h"
+
+#include "ProtoDispatch.h"
+
+constexpr size_t PeerCache::ETH_ADDR_LEN;
+
+PeerCache::PeerCache(const add_peer_func_t& addPeer, const del_peer_func_t& delPeer)
+    : _addPeer(addPeer), _delPeer(delPeer) {}
+
+void PeerCache::capacity(size_t peers) {
+  assert(peers);
+  _capacity = peers;
+  while (_peers.size() > _capacity) {
+    _evictOldest();
+  }
+}
+
+bool PeerCache::contains(const uint8_t* addr) const {
+  for (const Peer& peer : _peers) {
+    if (memcmp(peer.addr, addr, ETH_ADDR_LEN) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool PeerCache::use(const uint8_t* addr) {
+  if (etherIsBroadcast(addr)) {
+    return true;
+  }
+  ++_useCount;
+  for (Peer& peer : _peers) {
+    if (memcmp(peer.addr, addr, ETH_ADDR_LEN) == 0) {
+      peer.lastUsed = _useCount;
+      ++_hits;
+      return true;
+    }
+  }
+
+  ++_misses;
+  if (_peers.size() == _capacity) {
+    _evictOldest();
+  }
+  if (!_addPeer(addr)) {
+    return false;
+  }
+  _peers.emplace_back();
+  Peer& peer = _peers.back();
+  memcpy(peer.addr, addr, ETH_ADDR_LEN);
+  peer.lastUsed = _useCount;
+  return true;
+}
+
+void PeerCache::_evictOldest() {
+  auto oldest = _peers.begin();
+  for (auto it = _peers.begin(); it != _peers.end(); ++it) {
+    if (_useCount - it->lastUsed > _useCount - oldest->lastUsed) {
+      oldest = it;
+    }
+  }
+  _delPeer(oldest->addr);
+  _peers.erase(oldest);
+  ++_evictions;
+}
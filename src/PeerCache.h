@@ -0,0 +1,63 @@
+#ifndef PEER_CACHE_H
+#define PEER_CACHE_H
+
+#include <Arduino.h>
+
+#include <functional>
+#include <vector>
+
+// Keeps track of which unicast destinations have been added to a peer
+// table with a limited number of entries, like ESP-NOW's.  When the
+// table is full, the least recently used peer is removed to make
+// room.  Broadcast addresses are never added.
+class PeerCache {
+ public:
+  static constexpr size_t ETH_ADDR_LEN = 6;
+
+  // Returns false if the peer couldn't be added.
+  using add_peer_func_t = std::function<bool(const uint8_t* /* addr */)>;
+  using del_peer_func_t = std::function<void(const uint8_t* /* addr */)>;
+
+  PeerCache(const add_peer_func_t& addPeer, const del_peer_func_t& delPeer);
+
+  // Sets the maximum number of peers to keep in the table.  Extra
+  // peers are removed right away.
+  void capacity(size_t peers);
+  size_t capacity() const { return _capacity; }
+  size_t size() const { return _peers.size(); }
+
+  // Makes sure addr is in the peer table before sending to it.
+  // Returns false if it couldn't be added.
+  bool use(const uint8_t* addr);
+
+  bool contains(const uint8_t* addr) const;
+
+  // Times use() found the peer already in the table, had to add it,
+  // and removed another peer to make room.
+  uint32_t hits() const { return _hits; }
+  uint32_t misses() const { return _misses; }
+  uint32_t evictions() const { return _evictions; }
+
+ private:
+  struct Peer {
+    uint8_t addr[ETH_ADDR_LEN];
+    // Value of _useCount when last used.
+    uint32_t lastUsed;
+  };
+
+  void _evictOldest();
+
+  add_peer_func_t _addPeer;
+  del_peer_func_t _delPeer;
+
+  // ESP-NOW allows 20 peers, and the broadcast address takes one.
+  size_t _capacity = 16;
+  std::vector<Peer> _peers;
+  uint32_t _useCount = 0;
+
+  uint32_t _hits = 0;
+  uint32_t _misses = 0;
+  uint32_t _evictions = 0;
+};
+
+#endif
@@ -3,17 +3,45 @@
 #include <cstdio>
 
 void ProtoDispatchBase::begin() {
-  assert(!_targets.empty());
-  assert(_curSendTarget == nullptr);
-  _curSendTarget = _targets.data();
+  assert(numProtocols());
+  assert(!_begun);
+  _begun = true;
+  uint32_t now = MeshClock::millis();
+  for (Target& t : _targets) {
+    t.lastPolled = now;
+  }
   protoDispatchBegin();
 }
 
+constexpr uint8_t ProtoDispatchBase::AGGREGATE_PROTOCOL_ID;
+constexpr size_t ProtoDispatchBase::MAX_FRAME_LEN;
+constexpr size_t ProtoDispatchBase::MAX_FRAME_MESSAGES;
+constexpr size_t ProtoDispatchBase::NUM_PRIORITIES;
+constexpr size_t ProtoDispatchBase::MAX_IN_FLIGHT;
+constexpr size_t ProtoDispatchBase::MAX_LINK_STATS;
+
 void ProtoDispatchBase::addProtocol(uint8_t protocolId, ProtoDispatchTarget* target) {
-  _targets.emplace_back(protocolId, target);
-  if (_curSendTarget != nullptr) {
-    // Reset to beginning in case reallocation occured.
-    _curSendTarget = _targets.data();
+  assert(protocolId != AGGREGATE_PROTOCOL_ID);
+  Target t;
+  t.protocolId = protocolId;
+  t.target = target;
+  t.lastPolled = MeshClock::millis();
+  _targets.push_back(t);
+}
+
+void ProtoDispatchBase::setSchedule(uint8_t protocolId, const Schedule& schedule) {
+  assert(schedule.weight);
+  for (Target& t : _targets) {
+    if (t.protocolId == protocolId) {
+      t.schedule = schedule;
+      t.run = 0;
+    }
+  }
+}
+
+void ProtoDispatchBase::resetSendStats() {
+  for (SendStats& stats : _sendStats) {
+    stats = SendStats();
   }
 }
 
@@ -23,34 +51,283 @@ void ProtoDispatchBase::receivePacket(const ProtoDispatchPktHdr* hdr, const uint
     // No protocol ID?
     return;
   }
+  if (data[0] != AGGREGATE_PROTOCOL_ID) {
+    dispatchPacket(hdr, data, len);
+    return;
+  }
+
+  // Aggregated frame; each message is preceded by its length.
+  size_t pos = 1;
+  while (pos < len) {
+    size_t msgLen = data[pos++];
+    if (msgLen < 1 || msgLen > len - pos) {
+      Serial.printf("Malformed aggregated frame received with length %d\n", int(len));
+      return;
+    }
+    dispatchPacket(hdr, data + pos, msgLen);
+    pos += msgLen;
+  }
+}
+
+void ProtoDispatchBase::dispatchPacket(const ProtoDispatchPktHdr* hdr, const uint8_t* data,
+                                       size_t len) {
   uint8_t protoId = data[0];
 
-  for (const auto& proto : _targets) {
-    if (proto.first == protoId) {
-      proto.second->onPacketReceived(hdr, data + 1, len - 1);
+  for (const Target& t : _targets) {
+    if (t.protocolId == protoId) {
+      t.target->onPacketReceived(hdr, data + 1, len - 1);
     }
   }
 }
 
 int ProtoDispatchBase::transmitIfNeeded(uint8_t* dst, uint8_t* data, size_t maxlen) {
-  if (_curSendTarget == nullptr) {
+  if (!_begun) {
+    return -1;
+  }
+  assert(maxlen <= MAX_FRAME_LEN);
+  ++_round;
+  int len = _aggregate ? _transmitAggregate(dst, data, maxlen) : pollProtocols(dst, data, maxlen);
+  if (len > 0) {
+    _recordInFlight(dst, data, len);
+  }
+  return len;
+}
+
+void ProtoDispatchBase::_recordInFlight(const uint8_t* dst, const uint8_t* data, size_t len) {
+  if (_inFlightCount == MAX_IN_FLIGHT) {
+    // Forget the oldest.
+    _inFlightStart = (_inFlightStart + 1) % MAX_IN_FLIGHT;
+    --_inFlightCount;
+  }
+  InFlight& frame = _inFlight[(_inFlightStart + _inFlightCount) % MAX_IN_FLIGHT];
+  ++_inFlightCount;
+  memcpy(frame.dst, dst, ETH_ADDR_LEN);
+  if (data[0] != AGGREGATE_PROTOCOL_ID) {
+    frame.protocolIds[0] = data[0];
+    frame.numProtocols = 1;
+    return;
+  }
+  frame.numProtocols = 0;
+  size_t pos = 1;
+  while (pos + 1 < len) {
+    assert(frame.numProtocols < MAX_FRAME_MESSAGES);
+    frame.protocolIds[frame.numProtocols++] = data[pos + 1];
+    pos += 1 + data[pos];
+  }
+}
+
+void ProtoDispatchBase::sendCompleted(bool success) {
+  if (!_inFlightCount) {
+    return;
+  }
+  // Copied, since protocols may send more frames while being told.
+  InFlight frame = _inFlight[_inFlightStart];
+  _inFlightStart = (_inFlightStart + 1) % MAX_IN_FLIGHT;
+  --_inFlightCount;
+  _reportSendStatus(frame, success);
+}
+
+void ProtoDispatchBase::sendAborted() {
+  if (!_inFlightCount) {
+    return;
+  }
+  --_inFlightCount;
+  InFlight frame = _inFlight[(_inFlightStart + _inFlightCount) % MAX_IN_FLIGHT];
+  _reportSendStatus(frame, false);
+}
+
+void ProtoDispatchBase::_reportSendStatus(const InFlight& frame, bool success) {
+  ++_linkReports;
+  LinkEntry* entry = nullptr;
+  LinkEntry* oldest = nullptr;
+  for (LinkEntry& link : _linkStats) {
+    if (!memcmp(link.stats.addr, frame.dst, ETH_ADDR_LEN)) {
+      entry = &link;
+      break;
+    }
+    if (!oldest || _linkReports - link.lastReported > _linkReports - oldest->lastReported) {
+      oldest = &link;
+    }
+  }
+  if (!entry) {
+    if (_linkStats.size() < MAX_LINK_STATS) {
+      _linkStats.emplace_back();
+      entry = &_linkStats.back();
+    } else {
+      // Forget the destination we've heard least recently about.
+      entry = oldest;
+    }
+    entry->stats = LinkStats();
+    memcpy(entry->stats.addr, frame.dst, ETH_ADDR_LEN);
+  }
+  entry->lastReported = _linkReports;
+  LinkStats* stats = &entry->stats;
+  ++stats->sent;
+  if (success) {
+    stats->consecutiveFailures = 0;
+  } else {
+    ++stats->failed;
+    ++stats->consecutiveFailures;
+  }
+
+  for (uint8_t i = 0; i != frame.numProtocols; ++i) {
+    dispatchSendStatus(frame.protocolIds[i], frame.dst, success);
+  }
+}
+
+void ProtoDispatchBase::dispatchSendStatus(uint8_t protocolId, const uint8_t* dst, bool success) {
+  for (const Target& t : _targets) {
+    if (t.protocolId == protocolId) {
+      t.target->onSendStatus(dst, success);
+    }
+  }
+}
+
+const ProtoDispatchBase::LinkStats* ProtoDispatchBase::linkStats(const uint8_t* addr) const {
+  for (const LinkEntry& link : _linkStats) {
+    if (!memcmp(link.stats.addr, addr, ETH_ADDR_LEN)) {
+      return &link.stats;
+    }
+  }
+  return nullptr;
+}
+
+int ProtoDispatchBase::_poll(Target* t, uint32_t now, uint8_t* dst, uint8_t* pkt,
+                             size_t maxlen) {
+  t->polledRound = _round;
+  uint32_t delay = now - t->lastPolled;
+  t->lastPolled = now;
+
+  int res = t->target->sendIfNeeded(dst, pkt + 1, maxlen - 1);
+  if (res <= 0) {
     return -1;
   }
-  if (_curSendTarget == (_targets.data() + _targets.size())) {
-    _curSendTarget = _targets.data();
-    assert(!_targets.empty());
+  pkt[0] = t->protocolId;
+
+  SendStats& stats = _sendStats[size_t(t->schedule.priority)];
+  ++stats.sent;
+  stats.totalDelayMs += delay;
+  if (delay > stats.maxDelayMs) {
+    stats.maxDelayMs = delay;
+  }
+  if (t->schedule.deadlineMs && delay > t->schedule.deadlineMs) {
+    ++stats.deadlineMisses;
   }
+  return res + 1;
+}
 
-  int res = _curSendTarget->second->sendIfNeeded(dst, data + 1, maxlen - 1);
-  if (res > 0) {
-    data[0] = _curSendTarget->first;  // protocol id
-    ++_curSendTarget;
-    return res + 1;
+int ProtoDispatchBase::pollProtocols(uint8_t* dst, uint8_t* pkt, size_t maxlen) {
+  uint32_t now = MeshClock::millis();
+
+  // Anything past its deadline goes first, most overdue first.
+  for (;;) {
+    Target* overdue = nullptr;
+    uint32_t mostLate = 0;
+    for (Target& t : _targets) {
+      if (!t.schedule.deadlineMs || t.polledRound == _round) {
+        continue;
+      }
+      uint32_t waited = now - t.lastPolled;
+      if (waited >= t.schedule.deadlineMs &&
+          (!overdue || waited - t.schedule.deadlineMs > mostLate)) {
+        overdue = &t;
+        mostLate = waited - t.schedule.deadlineMs;
+      }
+    }
+    if (!overdue) {
+      break;
+    }
+    int res = _poll(overdue, now, dst, pkt, maxlen);
+    if (res > 0) {
+      return res;
+    }
+  }
+
+  size_t numTargets = _targets.size();
+  for (size_t prio = NUM_PRIORITIES; prio--;) {
+    size_t& turn = _turn[prio];
+    size_t start = turn;
+    for (size_t i = 0; i != numTargets; ++i) {
+      size_t idx = (start + i) % numTargets;
+      Target& t = _targets[idx];
+      if (size_t(t.schedule.priority) != prio || t.polledRound == _round) {
+        continue;
+      }
+      int res = _poll(&t, now, dst, pkt, maxlen);
+      if (res > 0) {
+        if (++t.run < t.schedule.weight) {
+          // Still this target's turn.
+          turn = idx;
+        } else {
+          t.run = 0;
+          turn = idx + 1;
+        }
+        return res;
+      }
+      t.run = 0;
+      turn = idx + 1;
+    }
   }
-  ++_curSendTarget;
   return -1;
 }
 
+int ProtoDispatchBase::_transmitAggregate(uint8_t* dst, uint8_t* data, size_t maxlen) {
+  // Each message takes a length byte in addition to its protocol id and
+  // contents, and the frame starts with AGGREGATE_PROTOCOL_ID.
+  size_t len = 0;
+  size_t numMsgs = 0;
+  uint8_t msgDst[ETH_ADDR_LEN];
+  _msgBuf.resize(maxlen);
+
+  bool first = true;
+  while (len + 3 <= maxlen) {
+    size_t msgLen;
+    if (first && !_held.empty()) {
+      // Start with whatever didn't fit last time.
+      msgLen = _held.size();
+      memcpy(_msgBuf.data(), _held.data(), msgLen);
+      memcpy(msgDst, _heldDst, ETH_ADDR_LEN);
+      _held.clear();
+    } else {
+      int res = pollProtocols(msgDst, _msgBuf.data(), maxlen);
+      if (res < 0) {
+        break;
+      }
+      msgLen = res;
+    }
+    first = false;
+
+    if (!numMsgs) {
+      if (msgLen + 2 > maxlen) {
+        // Too big to aggregate; send it on its own.
+        memcpy(dst, msgDst, ETH_ADDR_LEN);
+        memcpy(data, _msgBuf.data(), msgLen);
+        return msgLen;
+      }
+      memcpy(dst, msgDst, ETH_ADDR_LEN);
+      data[len++] = AGGREGATE_PROTOCOL_ID;
+    } else if (memcmp(dst, msgDst, ETH_ADDR_LEN) || len + 1 + msgLen > maxlen) {
+      _held.assign(_msgBuf.data(), _msgBuf.data() + msgLen);
+      memcpy(_heldDst, msgDst, ETH_ADDR_LEN);
+      break;
+    }
+    data[len++] = msgLen;
+    memcpy(data + len, _msgBuf.data(), msgLen);
+    len += msgLen;
+    ++numMsgs;
+  }
+
+  if (!numMsgs) {
+    return -1;
+  }
+  if (numMsgs == 1) {
+    // No need for the aggregation overhead.
+    memmove(data, data + 2, len - 2);
+    return len - 2;
+  }
+  return len;
+}
+
 bool etherIsBroadcast(const uint8_t* addr) {
   for (size_t i = 0; i != ProtoDispatchBase::ETH_ADDR_LEN; ++i) {
     if (addr[i] != 0xff) {
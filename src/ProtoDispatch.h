@@ -8,6 +8,8 @@
 #include <utility>
 #include <vector>
 
+#include "MeshClock.h"
+
 bool etherIsBroadcast(const uint8_t* addr);
 
 // Converts the given ethernet address to a string for easy printing
@@ -42,6 +44,12 @@ class ProtoDispatchTarget {
   // If this protocol doesn't need to send a packet right now, it should return -1.
   virtual int sendIfNeeded(uint8_t* ethaddr, uint8_t* pkt, size_t maxlen) = 0;
 
+  // Called once it's known whether a packet this protocol sent to
+  // ethaddr was acknowledged.  Broadcasts aren't acknowledged, so for
+  // those this only says whether it was sent.  Packets are reported in
+  // the order they were sent, but not all dispatchers report them.
+  virtual void onSendStatus(const uint8_t* /* ethaddr */, bool /* success */) {}
+
   virtual ~ProtoDispatchTarget() = default;
 };
 
@@ -51,8 +59,76 @@ class ProtoDispatchBase {
  public:
   static constexpr size_t ETH_ADDR_LEN = ProtoDispatchTarget::ETH_ADDR_LEN;
 
+  // Protocol id reserved for aggregated frames; see aggregate().
+  static constexpr uint8_t AGGREGATE_PROTOCOL_ID = 0xff;
+
+  // Largest frame subclasses may ask transmitIfNeeded to fill, which is
+  // the most ESP-NOW can send.
+  static constexpr size_t MAX_FRAME_LEN = 250;
+
   void addProtocol(uint8_t protocolId, ProtoDispatchTarget* target);
 
+  // When there's an opportunity to transmit, protocols are asked for
+  // packets in order of priority, so e.g. time sync beacons aren't
+  // stuck behind a bulk transfer.  Protocols of the same priority take
+  // turns.  Don't use names like LOW or HIGH; those are Arduino macros.
+  enum class Priority : uint8_t { BULK, NORMAL, TIMING };
+  static constexpr size_t NUM_PRIORITIES = 3;
+
+  struct Schedule {
+    Priority priority = Priority::NORMAL;
+    // Number of packets in a row this protocol may send when it's its
+    // turn, relative to others of the same priority.
+    uint8_t weight = 1;
+    // If nonzero, this protocol is asked for a packet before any other
+    // once it's gone this many milliseconds without being asked, so
+    // it's not starved by higher priority protocols.
+    uint32_t deadlineMs = 0;
+  };
+
+  // Sets how the given protocol is scheduled.  By default, protocols
+  // are NORMAL priority with a weight of 1 and no deadline.
+  void setSchedule(uint8_t protocolId, const Schedule& schedule);
+
+  struct SendStats {
+    // Packets sent by protocols of this priority.
+    uint32_t sent = 0;
+    // Time between each packet being sent and the protocol's previous
+    // opportunity to send.
+    uint32_t totalDelayMs = 0;
+    uint32_t maxDelayMs = 0;
+    // Packets sent later than the protocol's deadline.
+    uint32_t deadlineMisses = 0;
+  };
+  const SendStats& sendStats(Priority priority) const {
+    return _sendStats[size_t(priority)];
+  }
+  void resetSendStats();
+
+  // If enabled, messages from several protocols that are going to the
+  // same destination are packed into a single frame, instead of
+  // spending a whole frame on each small message.  Every protocol is
+  // asked for a message each time there's an opportunity to transmit,
+  // and each message in the frame is preceded by its length.  A
+  // message that doesn't fit is sent in the next frame.
+  //
+  // Aggregated frames are always understood when received, but nodes
+  // running older versions will ignore them.  Disabled by default.
+  void aggregate(bool enable) { _aggregate = enable; }
+
+  // Link level delivery results for frames sent to a destination.
+  struct LinkStats {
+    uint8_t addr[ETH_ADDR_LEN];
+    uint32_t sent = 0;
+    uint32_t failed = 0;
+    // Failures since the last success.
+    uint32_t consecutiveFailures = 0;
+  };
+  // Returns null if nothing sent to addr has been reported on.  Only
+  // the MAX_LINK_STATS destinations reported on most recently are kept.
+  const LinkStats* linkStats(const uint8_t* addr) const;
+  static constexpr size_t MAX_LINK_STATS = 16;
+
   void begin();
 
   template <typename C>
@@ -75,12 +151,92 @@ class ProtoDispatchBase {
   // Subclasses should call this when a packet is received from the network.
   void receivePacket(const ProtoDispatchPktHdr* hdr, const uint8_t* data, size_t len);
 
+  // Subclasses that find out whether frames were delivered should call
+  // this for each frame returned by transmitIfNeeded, in the same
+  // order, so the protocols that sent them can be told.
+  void sendCompleted(bool success);
+  // Subclasses should call this instead if the frame most recently
+  // returned by transmitIfNeeded couldn't be sent at all.
+  void sendAborted();
+
   // Subclasses may override this to do additional setup when begin() is called.
   virtual void protoDispatchBegin() {}
 
+  // Subclasses that keep their own protocol registry, like
+  // StaticProtoDispatch, override these instead of using addProtocol.
+  virtual size_t numProtocols() const { return _targets.size(); }
+  // Passes a single message, starting with its protocol id, to its protocol.
+  virtual void dispatchPacket(const ProtoDispatchPktHdr* hdr, const uint8_t* data, size_t len);
+  // Asks protocols that haven't been asked yet this round for a packet,
+  // in order of priority.  On success, pkt is filled with the protocol
+  // id followed by the packet and the total length is returned.
+  // Returns -1 once every protocol has been asked.
+  virtual int pollProtocols(uint8_t* dst, uint8_t* pkt, size_t maxlen);
+  // Passes the result of sending a message to its protocol.
+  virtual void dispatchSendStatus(uint8_t protocolId, const uint8_t* dst, bool success);
+  // Incremented each time there's an opportunity to transmit.
+  uint32_t pollRound() const { return _round; }
+
  private:
-  std::vector<DispatchProto> _targets;
-  DispatchProto* _curSendTarget = nullptr;
+  struct Target {
+    uint8_t protocolId;
+    ProtoDispatchTarget* target;
+    Schedule schedule;
+    // Last time this target was asked for a packet.
+    uint32_t lastPolled = 0;
+    // Value of _round when this target was last asked for a packet.
+    uint32_t polledRound = 0;
+    // Packets sent in a row during this target's turn.
+    uint8_t run = 0;
+  };
+
+  // Each message in an aggregated frame takes at least 3 bytes: its
+  // length, its protocol id, and some data.
+  static constexpr size_t MAX_FRAME_MESSAGES = MAX_FRAME_LEN / 3;
+
+  // A frame that's been sent but not reported on yet.
+  struct InFlight {
+    uint8_t dst[ETH_ADDR_LEN];
+    // Protocols with messages in the frame.
+    uint8_t numProtocols;
+    uint8_t protocolIds[MAX_FRAME_MESSAGES];
+  };
+  // Frames beyond this many that haven't been reported on are
+  // forgotten, in case the subclass doesn't report.  Dispatchers keep
+  // at most 4 frames queued.
+  static constexpr size_t MAX_IN_FLIGHT = 8;
+
+  int _transmitAggregate(uint8_t* dst, uint8_t* data, size_t maxlen);
+  void _recordInFlight(const uint8_t* dst, const uint8_t* data, size_t len);
+  void _reportSendStatus(const InFlight& frame, bool success);
+  int _poll(Target* t, uint32_t now, uint8_t* dst, uint8_t* pkt, size_t maxlen);
+
+  std::vector<Target> _targets;
+  bool _begun = false;
+  // Each call to transmitIfNeeded starts a new round of polling.
+  uint32_t _round = 0;
+  // Index of the target whose turn it is for each priority.
+  size_t _turn[NUM_PRIORITIES] = {};
+  SendStats _sendStats[NUM_PRIORITIES];
+
+  bool _aggregate = false;
+  // Message being added to an aggregated frame, including its protocol id.
+  std::vector<uint8_t> _msgBuf;
+  // Message that didn't fit in the previous aggregated frame, if not empty.
+  std::vector<uint8_t> _held;
+  uint8_t _heldDst[ETH_ADDR_LEN];
+
+  // Ring of frames in the order they were sent, oldest at _inFlightStart.
+  InFlight _inFlight[MAX_IN_FLIGHT];
+  uint8_t _inFlightStart = 0;
+  uint8_t _inFlightCount = 0;
+  struct LinkEntry {
+    LinkStats stats;
+    // Value of _linkReports when last reported on.
+    uint32_t lastReported;
+  };
+  std::vector<LinkEntry> _linkStats;
+  uint32_t _linkReports = 0;
 };
 
 #endif
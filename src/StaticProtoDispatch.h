@@ -0,0 +1,164 @@
+#ifndef STATIC_PROTO_DISPATCH_H
+#define STATIC_PROTO_DISPATCH_H
+
+#include <type_traits>
+#include <utility>
+
+#include "ProtoDispatch.h"
+
+// A protocol for StaticProtoDispatch: the protocol id, and the type of
+// the object handling it.
+template <uint8_t Id, typename T>
+struct StaticProto {
+  static_assert(Id != ProtoDispatchBase::AGGREGATE_PROTOCOL_ID, "Protocol id is reserved");
+  static_assert(std::is_base_of<ProtoDispatchTarget, T>::value,
+                "Protocols must be ProtoDispatchTargets");
+  static constexpr uint8_t id = Id;
+  using target_type = T;
+};
+
+template <uint8_t Id, typename T>
+constexpr uint8_t StaticProto<Id, T>::id;
+
+// Alternative to addProtocol where the set of protocols is fixed at
+// compile time.  Backend is the dispatcher that does the actual
+// sending and receiving, e.g. EspProtoDispatchClass or
+// FakeProtoDispatch.  For example:
+//
+//   StaticProtoDispatch<EspProtoDispatchClass, StaticProto<1, MeshSyncMem>,
+//                       StaticProto<2, MeshSyncTime>>
+//       dispatch(memsync, timesync);
+//
+// Protocol ids are looked up in a table built by the compiler instead
+// of searching a list for each packet.  The backend is inherited whole,
+// including its unused protocol list and scheduler, so this saves the
+// heap the list would use but not the rest of the dispatcher's memory.
+// Protocols take turns sending; setSchedule only applies to protocols
+// added with addProtocol.
+template <typename Backend, typename... Protos>
+class StaticProtoDispatch : public Backend {
+  // Largest protocol id used, to size the table.
+  template <typename... Ps>
+  struct MaxId;
+  template <typename P, typename... Ps>
+  struct MaxId<P, Ps...> {
+    static constexpr uint8_t value = P::id > MaxId<Ps...>::value ? P::id : MaxId<Ps...>::value;
+  };
+  template <typename P>
+  struct MaxId<P> {
+    static constexpr uint8_t value = P::id;
+  };
+
+  // True if no two protocols have the same id.
+  template <typename... Ps>
+  struct DistinctIds;
+  template <typename P>
+  struct DistinctIds<P> {
+    static constexpr bool value = true;
+  };
+  template <typename P, typename Q, typename... Ps>
+  struct DistinctIds<P, Q, Ps...> {
+    static constexpr bool value =
+        P::id != Q::id && DistinctIds<P, Ps...>::value && DistinctIds<Q, Ps...>::value;
+  };
+
+ public:
+  static constexpr size_t NUM_PROTOS = sizeof...(Protos);
+  static_assert(NUM_PROTOS > 0, "At least one protocol is required");
+  static_assert(NUM_PROTOS < 256, "Too many protocols");
+  // Unlike addProtocol, there's only one target per id.
+  static_assert(DistinctIds<Protos...>::value, "Protocol ids must be distinct");
+  // Size of the table mapping protocol ids to protocols.
+  static constexpr size_t TABLE_SIZE = MaxId<Protos...>::value + 1;
+
+  // Any arguments after the protocol targets are passed to the backend's constructor.
+  template <typename... Args>
+  explicit StaticProtoDispatch(typename Protos::target_type&... targets, Args&&... args)
+      : Backend(std::forward<Args>(args)...), _targets{&targets...} {}
+
+ private:
+  // One more than the index in Protos of the protocol with the given
+  // id, or 0 if there isn't one.
+  template <typename... Ps>
+  static constexpr uint8_t slotOf(uint8_t /* id */, uint8_t /* slot */) {
+    return 0;
+  }
+  template <typename P, typename... Ps>
+  static constexpr uint8_t slotOf(uint8_t id, uint8_t slot, P*, Ps*... rest) {
+    return P::id == id ? slot : slotOf(id, slot + 1, rest...);
+  }
+
+  template <size_t... Is>
+  struct Indices {};
+  template <size_t N, size_t... Is>
+  struct MakeIndices : MakeIndices<N - 1, N - 1, Is...> {};
+  template <size_t... Is>
+  struct MakeIndices<0, Is...> {
+    using type = Indices<Is...>;
+  };
+
+  struct Table {
+    uint8_t slots[TABLE_SIZE];
+  };
+  template <size_t... Ids>
+  static constexpr Table makeTable(Indices<Ids...>) {
+    return Table{{slotOf(Ids, 1, (Protos*)nullptr...)...}};
+  }
+  static constexpr Table k_table = makeTable(typename MakeIndices<TABLE_SIZE>::type());
+
+  size_t numProtocols() const override { return NUM_PROTOS; }
+
+  void dispatchPacket(const ProtoDispatchPktHdr* hdr, const uint8_t* data,
+                      size_t len) override {
+    uint8_t protoId = data[0];
+    if (protoId >= TABLE_SIZE || !k_table.slots[protoId]) {
+      return;
+    }
+    _targets[k_table.slots[protoId] - 1]->onPacketReceived(hdr, data + 1, len - 1);
+  }
+
+  void dispatchSendStatus(uint8_t protocolId, const uint8_t* dst, bool success) override {
+    if (protocolId >= TABLE_SIZE || !k_table.slots[protocolId]) {
+      return;
+    }
+    _targets[k_table.slots[protocolId] - 1]->onSendStatus(dst, success);
+  }
+
+  int pollProtocols(uint8_t* dst, uint8_t* pkt, size_t maxlen) override {
+    if (_round != this->pollRound()) {
+      _round = this->pollRound();
+      _polled = 0;
+    }
+    while (_polled != NUM_PROTOS) {
+      size_t idx = _nextSend;
+      _nextSend = (_nextSend + 1) % NUM_PROTOS;
+      ++_polled;
+      int res = _targets[idx]->sendIfNeeded(dst, pkt + 1, maxlen - 1);
+      if (res > 0) {
+        pkt[0] = k_ids[idx];
+        return res + 1;
+      }
+    }
+    return -1;
+  }
+
+  static constexpr uint8_t k_ids[NUM_PROTOS] = {Protos::id...};
+
+  ProtoDispatchTarget* const _targets[NUM_PROTOS];
+  size_t _nextSend = 0;
+  // Number of protocols asked for a packet during pollRound() _round.
+  size_t _polled = 0;
+  uint32_t _round = 0;
+};
+
+template <typename Backend, typename... Protos>
+constexpr size_t StaticProtoDispatch<Backend, Protos...>::NUM_PROTOS;
+template <typename Backend, typename... Protos>
+constexpr size_t StaticProtoDispatch<Backend, Protos...>::TABLE_SIZE;
+template <typename Backend, typename... Protos>
+constexpr typename StaticProtoDispatch<Backend, Protos...>::Table
+    StaticProtoDispatch<Backend, Protos...>::k_table;
+template <typename Backend, typename... Protos>
+constexpr uint8_t StaticProtoDispatch<Backend, Protos...>::k_ids[];
+
+#endif